@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "./utils.h"
+#include "./database.h"
+#include "./allocator.h"
+
+#define ITEM_CHUNK_SIZE 65536
+#define ITEMS_PER_CHUNK (ITEM_CHUNK_SIZE / sizeof(DBItem))
+
+#define KEY_CHUNK_SIZE 65536
+// Key blocks are a multiple of the granularity, so that every block can hold
+// the free list link at its start.
+#define KEY_BLOCK_GRANULARITY sizeof(void *)
+#define KEY_CLASS_COUNT 32
+#define KEY_MAX_BLOCK_SIZE (KEY_CLASS_COUNT * KEY_BLOCK_GRANULARITY)
+// Class of the keys allocated with malloc.
+#define KEY_LARGE_CLASS 0xFF
+
+// A key block starts with a byte holding its class, followed by the key.
+#define KEY_BLOCK_OF(key) ((unsigned char *)(key) - 1)
+
+// The free lists are linked through the first bytes of the freed memory.
+void *free_items = NULL;
+unsigned char *item_chunk_cursor = NULL;
+unsigned long item_chunk_left = 0;
+pthread_mutex_t items_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void *free_key_blocks[KEY_CLASS_COUNT] = {NULL};
+unsigned char *key_chunk_cursor = NULL;
+unsigned long key_chunk_left = 0;
+pthread_mutex_t keys_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Only touched with the mutex of the items or of the keys locked.
+DBAllocatorStats allocator_stats = {0};
+
+void static *allocate_chunk(size_t size);
+
+void static *allocate_chunk(size_t size)
+{
+  void *chunk = malloc(size);
+
+  if (!chunk)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  return chunk;
+}
+
+DBItem *allocate_item()
+{
+  void *item = NULL;
+
+  pthread_mutex_lock(&items_mutex);
+  if (free_items != NULL)
+  {
+    item = free_items;
+    free_items = *(void **)item;
+    allocator_stats.items_free--;
+  }
+  else
+  {
+    if (item_chunk_left == 0)
+    {
+      item_chunk_cursor = (unsigned char *)allocate_chunk(ITEMS_PER_CHUNK * sizeof(DBItem));
+      item_chunk_left = ITEMS_PER_CHUNK;
+      allocator_stats.item_chunks++;
+      allocator_stats.reserved_bytes += ITEMS_PER_CHUNK * sizeof(DBItem);
+    }
+    item = item_chunk_cursor;
+    item_chunk_cursor += sizeof(DBItem);
+    item_chunk_left--;
+  }
+  allocator_stats.items_used++;
+  pthread_mutex_unlock(&items_mutex);
+
+  return (DBItem *)item;
+}
+
+void deallocate_item(DBItem *item)
+{
+  if (item == NULL)
+    return;
+
+  pthread_mutex_lock(&items_mutex);
+  *(void **)item = free_items;
+  free_items = item;
+  allocator_stats.items_used--;
+  allocator_stats.items_free++;
+  pthread_mutex_unlock(&items_mutex);
+}
+
+char *allocate_key(size_t length)
+{
+  // the class byte and the terminator
+  size_t size = length + 2;
+  unsigned char *block = NULL;
+
+  if (size > KEY_MAX_BLOCK_SIZE)
+  {
+    block = (unsigned char *)malloc(size);
+
+    if (!block)
+      memory_error_handler(__FILE__, __LINE__, __func__);
+
+    block[0] = KEY_LARGE_CLASS;
+    pthread_mutex_lock(&keys_mutex);
+    allocator_stats.large_keys++;
+    allocator_stats.large_key_bytes += size;
+    pthread_mutex_unlock(&keys_mutex);
+    return (char *)(block + 1);
+  }
+
+  int key_class = (int)((size - 1) / KEY_BLOCK_GRANULARITY);
+  size_t block_size = (key_class + 1) * KEY_BLOCK_GRANULARITY;
+
+  pthread_mutex_lock(&keys_mutex);
+  if (free_key_blocks[key_class] != NULL)
+  {
+    block = (unsigned char *)free_key_blocks[key_class];
+    free_key_blocks[key_class] = *(void **)block;
+    allocator_stats.key_bytes_free -= block_size;
+  }
+  else
+  {
+    // the rest of a chunk too small for the block is left unused
+    if (key_chunk_left < block_size)
+    {
+      key_chunk_cursor = (unsigned char *)allocate_chunk(KEY_CHUNK_SIZE);
+      key_chunk_left = KEY_CHUNK_SIZE;
+      allocator_stats.key_chunks++;
+      allocator_stats.reserved_bytes += KEY_CHUNK_SIZE;
+    }
+    block = key_chunk_cursor;
+    key_chunk_cursor += block_size;
+    key_chunk_left -= block_size;
+  }
+  allocator_stats.key_bytes_used += block_size;
+  pthread_mutex_unlock(&keys_mutex);
+
+  block[0] = (unsigned char)key_class;
+  return (char *)(block + 1);
+}
+
+void deallocate_key(void *key)
+{
+  if (key == NULL)
+    return;
+
+  unsigned char *block = KEY_BLOCK_OF(key);
+  int key_class = block[0];
+
+  if (key_class == KEY_LARGE_CLASS)
+  {
+    size_t size = strlen((char *)key) + 2;
+    free(block);
+    pthread_mutex_lock(&keys_mutex);
+    allocator_stats.large_keys--;
+    allocator_stats.large_key_bytes -= size;
+    pthread_mutex_unlock(&keys_mutex);
+    return;
+  }
+
+  size_t block_size = (key_class + 1) * KEY_BLOCK_GRANULARITY;
+
+  pthread_mutex_lock(&keys_mutex);
+  *(void **)block = free_key_blocks[key_class];
+  free_key_blocks[key_class] = block;
+  allocator_stats.key_bytes_used -= block_size;
+  allocator_stats.key_bytes_free += block_size;
+  pthread_mutex_unlock(&keys_mutex);
+}
+
+DBAllocatorStats get_allocator_stats()
+{
+  pthread_mutex_lock(&items_mutex);
+  pthread_mutex_lock(&keys_mutex);
+  DBAllocatorStats stats = allocator_stats;
+  pthread_mutex_unlock(&keys_mutex);
+  pthread_mutex_unlock(&items_mutex);
+
+  return stats;
+}
@@ -0,0 +1,38 @@
+#ifndef CCH137_ALLOCATOR_H
+#define CCH137_ALLOCATOR_H
+
+#include <stddef.h>
+#include "./database.h"
+
+// Memory of the items and of their keys.
+// Items are carved from large chunks of fixed size slots and keys from large
+// chunks of bytes, so that loading many records does not make a small
+// allocation per item and per key. Freed items and keys are kept on free
+// lists and reused, the chunks are never returned to the system.
+
+typedef struct DBAllocatorStats
+{
+  unsigned long item_chunks;
+  unsigned long items_used;
+  unsigned long items_free;
+  unsigned long key_chunks;
+  // bytes of the key blocks in use and on the free lists, rounded to the block size
+  unsigned long key_bytes_used;
+  unsigned long key_bytes_free;
+  // keys too long for the arena, allocated with malloc
+  unsigned long large_keys;
+  unsigned long large_key_bytes;
+  // bytes of every chunk
+  unsigned long reserved_bytes;
+} DBAllocatorStats;
+
+DBItem *allocate_item();
+void deallocate_item(DBItem *item);
+
+// Returns room for a key of `length` characters and its terminator.
+char *allocate_key(size_t length);
+void deallocate_key(void *key);
+
+DBAllocatorStats get_allocator_stats();
+
+#endif
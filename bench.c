@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include "./cJSON.h"
+#include "./utils.h"
+#include "./hashtable.h"
+#include "./database.h"
+
+// Compares the hash of the database with the DJB2 hash it replaced, on the
+// keys of the database files and on generated names, then times the load of
+// a large generated database file with more and more threads.
+
+#define BENCH_MIN_HASHES 20000000
+#define BENCH_GENERATED_KEYS 100000
+// 2^12 keys made of blocks that have the same DJB2 hash
+#define BENCH_COLLIDING_BLOCKS 12
+#define BENCH_LOAD_FILENAME "bench-load.json"
+// loaded before each round, so that the items of the last one are not freed
+// by the timed load
+#define BENCH_EMPTY_FILENAME "bench-empty.json"
+#define BENCH_LOAD_RECORDS 300000
+// the fastest of the rounds is kept
+#define BENCH_LOAD_ROUNDS 3
+
+typedef struct BenchKeys
+{
+  const char *name;
+  char **keys;
+  int count;
+} BenchKeys;
+
+typedef struct BenchHash
+{
+  const char *name;
+  uint64_t (*hash)(const char *key);
+} BenchHash;
+
+const char *first_names[] = {"Alice", "Bob", "Charlie", "Diana", "Eve", "Frank", "Grace", "Heidi",
+                             "Ivan", "Judy", "Mallory", "Niaj", "Olivia", "Peggy", "Rupert", "Sybil",
+                             "Trent", "Victor", "Walter", "Yvonne"};
+const char *last_names[] = {"Smith", "Johnson", "Williams", "Brown", "Jones", "Garcia", "Miller", "Davis",
+                            "Rodriguez", "Martinez", "Hernandez", "Lopez", "Gonzalez", "Wilson", "Anderson", "Thomas",
+                            "Taylor", "Moore", "Jackson", "Martin"};
+
+uint64_t static djb2_hash(const char *key);
+uint64_t static database_hash(const char *key);
+BenchKeys static create_keys(const char *name, int capacity);
+void static add_key(BenchKeys *keys, const char *key);
+void static free_bench_keys(BenchKeys *keys);
+BenchKeys static load_file_keys(const char *filename);
+BenchKeys static generate_numbered_keys();
+BenchKeys static generate_full_names();
+BenchKeys static generate_colliding_keys();
+void static bench_hash(BenchKeys *keys, BenchHash *hash);
+double static get_seconds();
+long static write_load_file(const char *filename, int records);
+void static bench_load(const char *filename, long bytes, int threads);
+
+// The hash used by the database before it was seeded.
+uint64_t static djb2_hash(const char *key)
+{
+  uint64_t hash_value = 5831;
+  while (*key)
+    hash_value = ((hash_value << 5) + hash_value) + (unsigned char)*key++;
+  return hash_value;
+}
+
+uint64_t static database_hash(const char *key)
+{
+  return hash_key(key).hash;
+}
+
+BenchKeys static create_keys(const char *name, int capacity)
+{
+  BenchKeys keys = {name, (char **)malloc(capacity * sizeof(char *)), 0};
+
+  if (!keys.keys)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  return keys;
+}
+
+void static add_key(BenchKeys *keys, const char *key)
+{
+  keys->keys[keys->count] = (char *)malloc(strlen(key) + 1);
+
+  if (!keys->keys[keys->count])
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  strcpy(keys->keys[keys->count++], key);
+}
+
+void static free_bench_keys(BenchKeys *keys)
+{
+  for (int i = 0; i < keys->count; i++)
+    free(keys->keys[i]);
+  free(keys->keys);
+}
+
+// The keys of a database file, empty if the file can not be read.
+BenchKeys static load_file_keys(const char *filename)
+{
+  FILE *file = fopen(filename, "r");
+  BenchKeys keys = create_keys(filename, 1);
+
+  if (file == NULL)
+    return keys;
+
+  fseek(file, 0, SEEK_END);
+  long length = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  char *content = (char *)malloc(length + 1);
+
+  if (!content)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  content[fread(content, 1, length, file)] = '\0';
+  fclose(file);
+
+  cJSON *json = cJSON_Parse(content);
+  free(content);
+  if (json == NULL)
+    return keys;
+
+  free(keys.keys);
+  keys = create_keys(filename, cJSON_GetArraySize(json) + 1);
+  for (cJSON *child = json->child; child != NULL; child = child->next)
+    add_key(&keys, child->string);
+  cJSON_Delete(json);
+
+  return keys;
+}
+
+BenchKeys static generate_numbered_keys()
+{
+  BenchKeys keys = create_keys("Person<n>", BENCH_GENERATED_KEYS);
+  char key[32];
+
+  for (int i = 0; i < BENCH_GENERATED_KEYS; i++)
+  {
+    sprintf(key, "Person%d", i);
+    add_key(&keys, key);
+  }
+
+  return keys;
+}
+
+BenchKeys static generate_full_names()
+{
+  int first_count = sizeof(first_names) / sizeof(first_names[0]);
+  int last_count = sizeof(last_names) / sizeof(last_names[0]);
+  BenchKeys keys = create_keys("<first> <last> <n>", BENCH_GENERATED_KEYS);
+  char key[64];
+
+  for (int i = 0; i < BENCH_GENERATED_KEYS; i++)
+  {
+    sprintf(key, "%s %s %d", first_names[i % first_count], last_names[(i / first_count) % last_count], i / (first_count * last_count));
+    add_key(&keys, key);
+  }
+
+  return keys;
+}
+
+// "Ab" and "BA" have the same DJB2 hash, so every key made of them does too.
+BenchKeys static generate_colliding_keys()
+{
+  int count = 1 << BENCH_COLLIDING_BLOCKS;
+  BenchKeys keys = create_keys("DJB2 collisions", count);
+  char key[BENCH_COLLIDING_BLOCKS * 2 + 1];
+
+  for (int i = 0; i < count; i++)
+  {
+    for (int block = 0; block < BENCH_COLLIDING_BLOCKS; block++)
+      memcpy(key + block * 2, (i >> block) & 1 ? "BA" : "Ab", 2);
+    key[BENCH_COLLIDING_BLOCKS * 2] = '\0';
+    add_key(&keys, key);
+  }
+
+  return keys;
+}
+
+// Prints the throughput of the hash and how the keys spread over the
+// buckets of a table with one bucket per key, as the database sizes it.
+void static bench_hash(BenchKeys *keys, BenchHash *hash)
+{
+  unsigned long size = 1;
+  while (size < (unsigned long)keys->count)
+    size <<= 1;
+
+  unsigned long *buckets = (unsigned long *)calloc(size, sizeof(unsigned long));
+
+  if (!buckets)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  size_t bytes = 0;
+  for (int i = 0; i < keys->count; i++)
+  {
+    buckets[hash->hash(keys->keys[i]) & (size - 1)]++;
+    bytes += strlen(keys->keys[i]);
+  }
+
+  unsigned long empty = 0;
+  unsigned long longest = 0;
+  double probes = 0;
+  for (unsigned long i = 0; i < size; i++)
+  {
+    if (buckets[i] == 0)
+      empty++;
+    if (buckets[i] > longest)
+      longest = buckets[i];
+    // keys compared to find every key of the bucket
+    probes += buckets[i] * (buckets[i] + 1) / 2.0;
+  }
+  free(buckets);
+
+  int rounds = BENCH_MIN_HASHES / keys->count + 1;
+  volatile uint64_t sink = 0;
+  clock_t start = clock();
+  for (int round = 0; round < rounds; round++)
+  {
+    for (int i = 0; i < keys->count; i++)
+      sink ^= hash->hash(keys->keys[i]);
+  }
+  double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+  double hashes = (double)rounds * keys->count;
+
+  printf("  %-8s %8.2f ns/key %8.1f MB/s   empty %5.1f%%   longest %6lu   probes/key %7.2f\n",
+         hash->name, seconds * 1e9 / hashes, bytes * (double)rounds / seconds / 1e6,
+         100.0 * empty / size, longest, probes / keys->count);
+}
+
+double static get_seconds()
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Records shaped like the ones of the database file, under generated names.
+// Returns the size of the file, -1 if it can not be written.
+long static write_load_file(const char *filename, int records)
+{
+  int first_count = sizeof(first_names) / sizeof(first_names[0]);
+  int last_count = sizeof(last_names) / sizeof(last_names[0]);
+  FILE *file = fopen(filename, "w");
+
+  if (file == NULL)
+    return -1;
+
+  fputs("{\n", file);
+  for (int i = 0; i < records; i++)
+  {
+    const char *first = first_names[i % first_count];
+    const char *last = last_names[(i / first_count) % last_count];
+    fprintf(file,
+            "\t\"%s %s %d\":\t{\n\t\t\"name\":\t\"%s %s\",\n\t\t\"jobTitle\":\t\"Engineer\",\n"
+            "\t\t\"age\":\t%d,\n\t\t\"address\":\t\"%d Pineapple St\",\n"
+            "\t\t\"phoneNumbers\":\t[\"555-%04d\"],\n\t\t\"emailAddresses\":\t[\"%s%d@example.com\"],\n"
+            "\t\t\"isMarried\":\t%s,\n\t\t\"isEmployed\":\ttrue\n\t}%s\n",
+            first, last, i, first, last, 20 + i % 50, i % 1000, i % 10000, first, i, i % 2 ? "true" : "false",
+            i + 1 < records ? "," : "");
+  }
+  fputs("}\n", file);
+
+  long bytes = ftell(file);
+  return fclose(file) == 0 ? bytes : -1;
+}
+
+void static bench_load(const char *filename, long bytes, int threads)
+{
+  double fastest = 0;
+  double seconds = 0;
+
+  set_database_load_threads(threads);
+  for (int round = 0; round < BENCH_LOAD_ROUNDS; round++)
+  {
+    load_database(BENCH_EMPTY_FILENAME);
+    seconds = get_seconds();
+    load_database(filename);
+    seconds = get_seconds() - seconds;
+    if (round == 0 || seconds < fastest)
+      fastest = seconds;
+  }
+
+  printf("  %d threads %8.1f ms %8.1f MB/s %10.0f records/s\n", threads, fastest * 1e3, bytes / fastest / 1e6,
+         BENCH_LOAD_RECORDS / fastest);
+}
+
+int main()
+{
+  BenchHash hashes[] = {{"djb2", djb2_hash}, {"seeded", database_hash}};
+  BenchKeys datasets[] = {load_file_keys("test-before.json"), load_file_keys(DATABASE_FILENAME),
+                          generate_numbered_keys(), generate_full_names(), generate_colliding_keys()};
+  int dataset_count = sizeof(datasets) / sizeof(datasets[0]);
+
+  for (int i = 0; i < dataset_count; i++)
+  {
+    if (datasets[i].count != 0)
+    {
+      printf("%s (%d keys)\n", datasets[i].name, datasets[i].count);
+      for (int h = 0; h < (int)(sizeof(hashes) / sizeof(hashes[0])); h++)
+        bench_hash(&datasets[i], &hashes[h]);
+    }
+    free_bench_keys(&datasets[i]);
+  }
+
+  long bytes = write_load_file(BENCH_LOAD_FILENAME, BENCH_LOAD_RECORDS);
+  if (bytes > 0 && write_load_file(BENCH_EMPTY_FILENAME, 0) > 0)
+  {
+    printf("load of %d records (%.1f MB)\n", BENCH_LOAD_RECORDS, bytes / 1e6);
+    for (int threads = 1; threads <= 8; threads *= 2)
+      bench_load(BENCH_LOAD_FILENAME, bytes, threads);
+  }
+  unlink(BENCH_LOAD_FILENAME);
+  unlink(BENCH_EMPTY_FILENAME);
+
+  return 0;
+}
@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "./utils.h"
+#include "./bloomfilter.h"
+
+#define BLOOM_FILTER_COUNTER_MAX 0xFF
+
+// The counters are read without a lock, they are only touched with these.
+#define LOAD_COUNTER(counter) __atomic_load_n(counter, __ATOMIC_RELAXED)
+#define STORE_COUNTER(counter, value) __atomic_store_n(counter, value, __ATOMIC_RELAXED)
+
+// The positions of a hash are h1 + i * h2, h2 is odd so that they are all
+// different in a table of a power of two.
+#define BLOOM_FILTER_FIRST_HASH(hash) (hash)
+#define BLOOM_FILTER_SECOND_HASH(hash) ((((hash) >> 32) | ((hash) << 32)) | 1)
+
+DBBloomFilter *create_bloom_filter(unsigned long capacity)
+{
+  unsigned long size = 64;
+
+  while (size < capacity * BLOOM_FILTER_COUNTERS_PER_KEY)
+    size <<= 1;
+
+  DBBloomFilter *filter = (DBBloomFilter *)malloc(sizeof(DBBloomFilter) + size);
+
+  if (!filter)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  filter->size = size;
+  filter->capacity = capacity;
+  filter->count = 0;
+  memset(filter->counters, 0, size);
+
+  return filter;
+}
+
+void free_bloom_filter(void *filter)
+{
+  free(filter);
+}
+
+void add_hash_to_bloom_filter(DBBloomFilter *filter, uint64_t hash)
+{
+  uint64_t position = BLOOM_FILTER_FIRST_HASH(hash);
+  uint64_t step = BLOOM_FILTER_SECOND_HASH(hash);
+  unsigned char *counter = NULL;
+
+  for (int i = 0; i < BLOOM_FILTER_HASH_COUNT; i++, position += step)
+  {
+    counter = &filter->counters[position & (filter->size - 1)];
+    if (*counter != BLOOM_FILTER_COUNTER_MAX)
+      STORE_COUNTER(counter, *counter + 1);
+  }
+  filter->count++;
+}
+
+// The hash must have been added before.
+void remove_hash_from_bloom_filter(DBBloomFilter *filter, uint64_t hash)
+{
+  uint64_t position = BLOOM_FILTER_FIRST_HASH(hash);
+  uint64_t step = BLOOM_FILTER_SECOND_HASH(hash);
+  unsigned char *counter = NULL;
+
+  for (int i = 0; i < BLOOM_FILTER_HASH_COUNT; i++, position += step)
+  {
+    counter = &filter->counters[position & (filter->size - 1)];
+    // a saturated counter may count more keys than it can hold
+    if (*counter != BLOOM_FILTER_COUNTER_MAX)
+      STORE_COUNTER(counter, *counter - 1);
+  }
+  filter->count--;
+}
+
+bool may_contain_hash(DBBloomFilter *filter, uint64_t hash)
+{
+  uint64_t position = BLOOM_FILTER_FIRST_HASH(hash);
+  uint64_t step = BLOOM_FILTER_SECOND_HASH(hash);
+
+  for (int i = 0; i < BLOOM_FILTER_HASH_COUNT; i++, position += step)
+  {
+    if (LOAD_COUNTER(&filter->counters[position & (filter->size - 1)]) == 0)
+      return false;
+  }
+
+  return true;
+}
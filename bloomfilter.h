@@ -0,0 +1,36 @@
+#ifndef CCH137_BLOOMFILTER_H
+#define CCH137_BLOOMFILTER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Counting Bloom filter of key hashes, so that most absent keys are rejected
+// without probing a table. Each position is an 8-bit counter, so keys can be
+// removed too. A counter that reaches its max is never decremented again.
+//
+// Writers must be serialized by the caller. may_contain_hash() can be called
+// without a lock, a filter that is replaced must be retired.
+
+// Counters per key the filter is sized for, and positions set per key.
+#define BLOOM_FILTER_COUNTERS_PER_KEY 10
+#define BLOOM_FILTER_HASH_COUNT 7
+
+typedef struct DBBloomFilter
+{
+  // number of counters, a power of two
+  unsigned long size;
+  // number of keys it was sized for, and number of keys added
+  unsigned long capacity;
+  unsigned long count;
+  unsigned char counters[];
+} DBBloomFilter;
+
+DBBloomFilter *create_bloom_filter(unsigned long capacity);
+void free_bloom_filter(void *filter);
+
+void add_hash_to_bloom_filter(DBBloomFilter *filter, uint64_t hash);
+void remove_hash_from_bloom_filter(DBBloomFilter *filter, uint64_t hash);
+// False if the hash was never added, true if it may have been.
+bool may_contain_hash(DBBloomFilter *filter, uint64_t hash);
+
+#endif
@@ -3,492 +3,2872 @@
 #include <string.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "./cJSON.h"
 #include "./utils.h"
+#include "./epoch.h"
+#include "./allocator.h"
+#include "./bloomfilter.h"
+#include "./timingwheel.h"
+#include "./intern.h"
+#include "./wal.h"
 #include "./database.h"
+#include "./hashtable.h"
 
-#define HASH_MOD 5831
-#define HASH_SHIFT_BITS 5
-#define HASH_TABLE_SIZE 137
+// Keys a filter is sized for at least. A filter is rebuilt for twice its
+// keys when it is full, or when less than 1/BLOOM_FILTER_SHRINK_RATIO of it
+// is used.
+#define BLOOM_FILTER_MIN_CAPACITY 16
+#define BLOOM_FILTER_SHRINK_RATIO 8
 
-DBItem **hash_table = NULL;
+// Milliseconds per tick of the expiry wheels.
+#define EXPIRY_TICK_MS 10
 
-// The mutex is locked while the database is being read and written.
-// We will not destroy the mutex because it has a continuing purpose in the program.
-pthread_mutex_t _db_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t *db_mutex = &_db_mutex;
+// Buckets visited by the clock hand each time it locks a shard.
+#define CLOCK_BUCKETS_PER_LOCK 16
 
-unsigned long static hash(const char *string);
-DBItem static *create_item_with_json(const char *key, cJSON *json);
-DBItem static *add_item_to_hash_table(const char *key, DBItem *item);
-DBItem static *remove_item_from_hash_table(const char *key);
-DBItem static *set_item_key(DBItem *item, const char *key);
+#define JSON_BYTES(nodes, string_bytes) ((nodes) * sizeof(cJSON) + (string_bytes))
 
-// DBJ2 hash
-unsigned long static hash(const char *string)
+// References of DBItem::references.
+#define ITEM_TABLE_REFERENCE 1
+#define ITEM_HANDLE_REFERENCE 2
+
+typedef struct DBStalePointer
 {
-  if (string == NULL)
-    return 0;
+  void *pointer;
+  void (*free_pointer)(void *pointer);
+  struct DBStalePointer *next;
+} DBStalePointer;
+
+// Tells set_item whether the upsert created the item.
+typedef struct DBItemCreation
+{
+  cJSON *json;
+  bool created;
+} DBItemCreation;
+
+// The nodes of a json and the bytes of the strings they own.
+typedef struct DBJsonSize
+{
+  unsigned long nodes;
+  unsigned long string_bytes;
+} DBJsonSize;
+
+// Operations since the start, updated with relaxed atomics. The lookups are
+// counted in DBLookupCounters instead.
+typedef struct DBOperationCounters
+{
+  unsigned long inserts;
+  unsigned long updates;
+  unsigned long renames;
+  unsigned long deletes;
+  unsigned long evictions;
+  unsigned long reloads;
+  unsigned long expirations;
+  unsigned long checkpoints;
+} DBOperationCounters;
+
+#define COUNT_OPERATIONS(counter, count) __atomic_add_fetch(&operation_counters.counter, count, __ATOMIC_RELAXED)
+
+#define CACHE_LINE_SIZE 64
+
+// The lookups counted by one thread, so that the readers do not write to a
+// shared cache line. Only the owner writes them, with relaxed stores, and
+// db_stats() and get_filter_stats() add every record up. Records are never
+// freed, a record released by an exited thread is reused with its counts.
+typedef struct DBLookupCounters
+{
+  unsigned long lookups;
+  DBFilterStats filter;
+  // 1 while the record is owned by a thread
+  int in_use;
+  struct DBLookupCounters *next;
+} __attribute__((aligned(CACHE_LINE_SIZE))) DBLookupCounters;
+
+#define COUNT_LOOKUPS(counter, count) __atomic_store_n(&(counter), (counter) + (count), __ATOMIC_RELAXED)
+
+// The keys of a batch hashed once and grouped by shard. The positions of
+// the keys of shard i are order[shard_starts[i]] to order[shard_starts[i + 1] - 1],
+// in the order of the batch.
+typedef struct DBBatch
+{
+  DBHashedKey *hashed_keys;
+  int *order;
+  int shard_starts[DATABASE_SHARD_COUNT + 1];
+} DBBatch;
+
+// An item seen by the scan of a snapshot. The item is taken with a handle
+// while its shard is locked, which keeps its key and the json seen valid
+// until the snapshot is printed, except an evicted json, which is read back
+// for the snapshot only. The json is NULL for a deleted key, which is copied.
+typedef struct DBSnapshotEntry
+{
+  const char *key;
+  cJSON *json;
+  bool owned;
+  // NULL for a deleted key
+  DBItem *item;
+  // monotonic time in milliseconds, 0 if the item does not expire
+  uint64_t expires_at;
+  // the order of the visit, the last visit of a key wins
+  unsigned long order;
+} DBSnapshotEntry;
+
+typedef struct DBSnapshot
+{
+  DBSnapshotEntry *entries;
+  unsigned long count;
+  unsigned long capacity;
+  uint64_t now;
+  // only the dirty items and the deleted keys are taken
+  bool changes;
+  // the shard being scanned
+  struct DBShard *shard;
+} DBSnapshot;
+
+// A part of the records of a database file, parsed and inserted by one
+// thread of load_database().
+typedef struct DBLoadChunk
+{
+  // the records, without the braces of the object around them
+  const char *data;
+  size_t length;
+  // an object holding the records once parsed
+  cJSON *json;
+  // the expiries of the records, taken out of the object by load_records()
+  cJSON *expiries;
+  // the next shard to build the key index of, shared by the chunks
+  int *next_shard;
+} DBLoadChunk;
+
+typedef struct DBShard
+{
+  // The mutex is locked while the shard is being written, readers do not lock
+  // it and rely on epochs instead.
+  // We will not destroy the mutex because it has a continuing purpose in the program.
+  pthread_mutex_t mutex;
+  DBHashTable hash_table;
+  // NULL until the first key is added, replaced and retired when resized
+  DBBloomFilter *bloom_filter;
+  // size of the json of every item of the shard, evicted ones excluded
+  unsigned long json_nodes;
+  unsigned long json_string_bytes;
+  unsigned long evicted_items;
+  // timers of the items of the shard that expire
+  DBTimingWheel expiry_wheel;
+  // changes since the last full save, the deleted keys are copied and
+  // dropped past DATABASE_DELTA_MAX_DELETED_KEYS
+  unsigned long dirty_items;
+  char **deleted_keys;
+  unsigned long deleted_count;
+  bool deleted_overflowed;
+  // the keys of the shard in order
+  DBSkipList key_index;
+} DBShard;
+
+DBShard shards[DATABASE_SHARD_COUNT];
+pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+// The key index of every shard, merged by the key iterators.
+DBSkipList *key_indexes[DATABASE_SHARD_COUNT];
+
+// Items that have a DBItemExtra, counted in the item bytes of db_stats().
+unsigned long item_extras = 0;
+
+DBOperationCounters operation_counters = {0};
+DBLookupCounters *lookup_counters = NULL;
+pthread_mutex_t lookup_counters_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t lookup_counters_key;
+pthread_once_t lookup_counters_once = PTHREAD_ONCE_INIT;
+__thread DBLookupCounters *current_lookup_counters = NULL;
+
+// Bytes of the json of every shard, as counted by db_stats(), updated with
+// relaxed atomics so that the budget can be checked without a lock.
+unsigned long memory_budget = 0;
+unsigned long resident_json_bytes = 0;
+// The clock hand is a cursor of scan_hash_table() in one shard. It is only
+// moved with the mutex locked, which is locked before the shard mutexes.
+unsigned long clock_shard = 0;
+unsigned long clock_cursor = 0;
+pthread_mutex_t clock_mutex = PTHREAD_MUTEX_INITIALIZER;
+// NULL for DATABASE_SPILL_FILENAME, guarded by the clock mutex.
+char *memory_spill_filename = NULL;
+
+// Serializes the saves, each one rotates the write log.
+pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+// The file the changes are tracked from, NULL until a file is loaded or
+// fully saved. Guarded by the snapshot mutex.
+char *base_filename = NULL;
+// The checkpointer waits on the condition, with the mutex locked, until its
+// next checkpoint or until it is stopped.
+pthread_mutex_t checkpointer_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t checkpointer_cond;
+pthread_once_t checkpointer_once = PTHREAD_ONCE_INIT;
+pthread_t checkpointer_thread;
+bool checkpointer_running = false;
+bool checkpointer_stopping = false;
+char *checkpoint_filename = NULL;
+unsigned long checkpoint_interval_ms = 0;
+// 0 for a thread per online processor, see set_database_load_threads().
+int load_threads = 0;
+
+void static init_shards();
+void static release_lookup_counters(void *counters);
+void static init_lookup_counters_key();
+DBLookupCounters static *acquire_lookup_counters();
+DBShard static *get_shard(uint64_t hash);
+void static lock_shard_pair(DBShard *a, DBShard *b);
+void static unlock_shard_pair(DBShard *a, DBShard *b);
+DBItem static *create_item_with_json(const DBHashedKey *key, cJSON *json);
+DBItemExtra static *get_item_extra(DBItem *item);
+DBItem static *create_item_for_upsert(const DBHashedKey *key, void *creation);
+DBItem static *upsert_item_in_shard(DBShard *shard, const DBHashedKey *key, cJSON *json, const DBJsonSize *json_size, uint64_t expires_at, bool *created);
+DBJsonSize static measure_json(cJSON *json);
+void static add_json_size_to_shard(DBShard *shard, DBItem *item);
+void static remove_json_size_from_shard(DBShard *shard, DBItem *item);
+cJSON static *load_item_json(DBItem *item);
+bool static evict_item(DBShard *shard, DBItem *item);
+void static visit_item_with_clock(DBItem *item, void *shard);
+void static enforce_memory_budget();
+uint64_t static get_time_ms();
+uint64_t static get_wall_time_ms();
+uint64_t static get_wall_clock_offset();
+bool static is_item_expired(DBItem *item, uint64_t now);
+void static set_item_expiry(DBShard *shard, DBItem *item, uint64_t expires_at);
+void static remove_item_timer(DBShard *shard, DBItem *item);
+void static free_timer(DBTimer *timer);
+void static remove_expired_item(DBShard *shard, DBItem *item);
+void static expire_item(DBTimer *timer, void *shard);
+unsigned long static expire_shard_items(DBShard *shard, uint64_t now);
+void static purge_expired_item(DBShard *shard, const DBHashedKey *key, uint64_t now);
+void static restore_expiries(cJSON *expiries);
+size_t static match_expiry_member(const char *name);
+char static *print_json_for_log(cJSON *json);
+char static *print_item_json_for_log(DBItem *item);
+void static apply_log_record(DBLogRecordType type, const char *key, const char *value, uint64_t expires_at, void *data);
+DBBatch static create_batch(const char **keys, int count);
+void static free_batch(DBBatch *batch);
+DBItem static *find_item(DBShard *shard, const DBHashedKey *key);
+void static rebuild_shard_filter(DBShard *shard);
+void static add_to_shard_filter(DBShard *shard, uint64_t hash);
+void static remove_from_shard_filter(DBShard *shard, uint64_t hash);
+void static free_item(DBItem *item);
+void static release_table_reference(void *item);
+void static retire_item(DBItem *item);
+void static retire_from_item(DBItem *item, void *pointer, void (*free_pointer)(void *pointer));
+void static retire_stale_pointers(DBItem *item);
+DBItem static *set_item_key(DBItem *item, const DBHashedKey *key);
+void static add_deleted_key(DBShard *shard, const char *key);
+void static clear_deleted_keys(DBShard *shard);
+bool static has_few_changes();
+char static *get_delta_filename(const char *filename);
+int static parse_database_file(const char *filename, bool *found, int threads, DBLoadChunk *chunks);
+int static get_load_threads(size_t length);
+int static split_database_records(const char *data, size_t length, int count, DBLoadChunk *chunks);
+const char static *skip_json_whitespace(const char *data, const char *end);
+void static run_load_workers(void *(*work)(void *chunk), DBLoadChunk *chunks, int count);
+void static *parse_load_chunk(void *chunk);
+void static *load_records(void *chunk);
+int static compare_keys(const void *a, const void *b);
+void static build_shard_key_index(DBShard *shard);
+void static *build_key_indexes(void *chunk);
+void static load_database_changes(const char *filename);
+char static *detach_record(cJSON *parent, cJSON *record);
+void static add_snapshot_entry(DBSnapshot *snapshot, DBItem *item);
+void static add_snapshot_deletion(DBSnapshot *snapshot, const char *key);
+void static add_to_snapshot(DBItem *item, void *snapshot);
+void static scan_shard_for_snapshot(DBShard *shard, DBSnapshot *snapshot, int buckets_per_scan, unsigned long pause_us);
+int static compare_snapshot_entries(const void *a, const void *b);
+cJSON static *build_snapshot_json(DBSnapshot *snapshot, const struct stat *base_status);
+bool static write_file_atomically(const char *filename, const char *data);
+void static write_snapshot(const char *filename, bool changes, int buckets_per_scan, unsigned long pause_us);
+void static init_checkpointer();
+void static *run_checkpointer(void *data);
+
+void static init_shards()
+{
+  uint64_t tick = get_time_ms() / EXPIRY_TICK_MS;
 
-  unsigned long hash_value = HASH_MOD;
-  int current_char;
-  while ((current_char = *string++))
+  for (int i = 0; i < DATABASE_SHARD_COUNT; i++)
   {
-    hash_value = ((hash_value << HASH_SHIFT_BITS) + hash_value) + current_char;
+    pthread_mutex_init(&shards[i].mutex, NULL);
+    memset(&shards[i].hash_table, 0, sizeof(DBHashTable));
+    shards[i].hash_table.rehash_index = -1;
+    shards[i].bloom_filter = NULL;
+    shards[i].json_nodes = 0;
+    shards[i].json_string_bytes = 0;
+    shards[i].evicted_items = 0;
+    init_timing_wheel(&shards[i].expiry_wheel, tick);
+    shards[i].dirty_items = 0;
+    shards[i].deleted_keys = NULL;
+    shards[i].deleted_count = 0;
+    shards[i].deleted_overflowed = false;
+    init_skip_list(&shards[i].key_index);
+    key_indexes[i] = &shards[i].key_index;
   }
-  return hash_value % HASH_TABLE_SIZE;
 }
 
-DBItem static *create_item_with_json(const char *key, cJSON *json)
+// The shard is selected by the high bits of the hash, the tables of the
+// shard use the low bits.
+DBShard static *get_shard(uint64_t hash)
 {
-  if (json == NULL)
-    return NULL;
+  pthread_once(&shards_once, init_shards);
 
-  DBItem *item = (DBItem *)malloc(sizeof(DBItem));
+#if DATABASE_SHARD_BITS == 0
+  return &shards[0];
+#else
+  return &shards[hash >> (64 - DATABASE_SHARD_BITS)];
+#endif
+}
 
-  if (!item)
-    memory_error_handler(__FILE__, __LINE__, __func__);
+// Shards are always locked in address order, so that two operations locking
+// the same pair of shards can not deadlock.
+void static lock_shard_pair(DBShard *a, DBShard *b)
+{
+  if (a == b)
+  {
+    pthread_mutex_lock(&a->mutex);
+    return;
+  }
 
-  item->key = NULL;
-  item->json = json;
-  item->next = NULL;
-  set_item_key(item, key);
+  pthread_mutex_lock(&(a < b ? a : b)->mutex);
+  pthread_mutex_lock(&(a < b ? b : a)->mutex);
+}
 
-  return item;
+void static unlock_shard_pair(DBShard *a, DBShard *b)
+{
+  pthread_mutex_unlock(&a->mutex);
+  if (a != b)
+    pthread_mutex_unlock(&b->mutex);
 }
 
-DBItem static *add_item_to_hash_table(const char *key, DBItem *item)
+DBItem static *create_item_with_json(const DBHashedKey *key, cJSON *json)
 {
-  if (item == NULL)
+  if (json == NULL)
     return NULL;
 
-  unsigned long index = hash(key);
-  item->next = hash_table[index];
-  hash_table[index] = item;
+  DBItem *item = allocate_item();
+  item->key = NULL;
+  item->json = json;
+  item->next = NULL;
+  item->json_nodes = 0;
+  item->json_string_bytes = 0;
+  item->referenced = true;
+  item->expires_at = 0;
+  item->references = ITEM_TABLE_REFERENCE;
+  item->extra = NULL;
+  item->dirty = false;
+  set_item_key(item, key);
 
   return item;
 }
 
-DBItem static *remove_item_from_hash_table(const char *key)
+// Must be called with the shard locked. Readers without the lock only see
+// the extra fields once they are set.
+DBItemExtra static *get_item_extra(DBItem *item)
 {
-  if (key == NULL)
-    return NULL;
+  if (item->extra != NULL)
+    return item->extra;
 
-  unsigned long index = hash(key);
-  DBItem *prev = NULL;
-  DBItem *curr = hash_table[index];
+  DBItemExtra *extra = (DBItemExtra *)malloc(sizeof(DBItemExtra));
 
-  while (curr != NULL)
-  {
-    if (strcmp(curr->key, key) == 0)
-    {
-      if (prev == NULL)
-        hash_table[index] = curr->next;
-      else
-        prev->next = curr->next;
+  if (!extra)
+    memory_error_handler(__FILE__, __LINE__, __func__);
 
-      return curr;
-    }
-    prev = curr;
-    curr = curr->next;
-  }
+  extra->spilled.offset = -1;
+  extra->spilled.length = 0;
+  extra->timer = NULL;
+  extra->stale = NULL;
+  __atomic_add_fetch(&item_extras, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&item->extra, extra, __ATOMIC_RELEASE);
 
-  return NULL;
+  return extra;
 }
 
-DBItem static *set_item_key(DBItem *item, const char *key)
+DBItem static *create_item_for_upsert(const DBHashedKey *key, void *creation)
 {
-  if (item == NULL || key == NULL)
-    return NULL;
-
-  size_t key_length = (strlen(key) + 1) * sizeof(char);
-  item->key = (char *)realloc(item->key, key_length);
-
-  if (!item->key)
-    memory_error_handler(__FILE__, __LINE__, __func__);
-
-  memset(item->key, 0, key_length);
-  strcpy(item->key, key);
+  ((DBItemCreation *)creation)->created = true;
+  return create_item_with_json(key, ((DBItemCreation *)creation)->json);
+}
 
-  return item;
+void static release_lookup_counters(void *counters)
+{
+  __atomic_store_n(&((DBLookupCounters *)counters)->in_use, 0, __ATOMIC_RELEASE);
 }
 
-bool exists(const char *key)
+void static init_lookup_counters_key()
 {
-  return (key != NULL && get_item(key) != NULL);
+  pthread_key_create(&lookup_counters_key, release_lookup_counters);
 }
 
-DBItem *get_item(const char *key)
+DBLookupCounters static *acquire_lookup_counters()
 {
-  if (key == NULL)
-    return NULL;
+  pthread_once(&lookup_counters_once, init_lookup_counters_key);
 
-  unsigned long index = hash(key);
-  pthread_mutex_lock(db_mutex);
-  DBItem *item = hash_table[index];
+  // reuse the record of an exited thread if there is one
+  DBLookupCounters *counters = __atomic_load_n(&lookup_counters, __ATOMIC_ACQUIRE);
+  int expected = 0;
+  while (counters != NULL)
+  {
+    expected = 0;
+    if (__atomic_compare_exchange_n(&counters->in_use, &expected, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      break;
+    counters = counters->next;
+  }
 
-  while (item != NULL)
+  if (counters == NULL)
   {
-    if (strcmp(item->key, key) == 0)
-    {
-      pthread_mutex_unlock(db_mutex);
-      return item;
-    }
-    item = item->next;
+    void *memory = NULL;
+
+    if (posix_memalign(&memory, CACHE_LINE_SIZE, sizeof(DBLookupCounters)) != 0)
+      memory_error_handler(__FILE__, __LINE__, __func__);
+
+    counters = (DBLookupCounters *)memory;
+    memset(counters, 0, sizeof(DBLookupCounters));
+    counters->in_use = 1;
+    pthread_mutex_lock(&lookup_counters_mutex);
+    counters->next = lookup_counters;
+    __atomic_store_n(&lookup_counters, counters, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&lookup_counters_mutex);
   }
 
-  pthread_mutex_unlock(db_mutex);
-  return NULL;
+  pthread_setspecific(lookup_counters_key, counters);
+  return counters;
 }
 
-DBItem *set_item(const char *key, cJSON *json)
+// Must be called from inside an epoch. The filter of the shard rejects most
+// absent keys before the table is probed.
+DBItem static *find_item(DBShard *shard, const DBHashedKey *key)
 {
-  if (key == NULL || json == NULL)
-    return NULL;
+  DBBloomFilter *filter = __atomic_load_n(&shard->bloom_filter, __ATOMIC_ACQUIRE);
+  DBItem *item = NULL;
+
+  if (current_lookup_counters == NULL)
+    current_lookup_counters = acquire_lookup_counters();
 
-  DBItem *oldItem = get_item(key);
+  DBLookupCounters *counters = current_lookup_counters;
+  COUNT_LOOKUPS(counters->lookups, 1);
 
-  if (oldItem != NULL)
+  if (filter == NULL)
+  {
+    item = find_item_in_hash_table(&shard->hash_table, key);
+  }
+  else
   {
-    if (oldItem->json == json)
+    COUNT_LOOKUPS(counters->filter.lookups, 1);
+    if (!may_contain_hash(filter, key->hash))
     {
-      return oldItem;
+      COUNT_LOOKUPS(counters->filter.rejected, 1);
+      return NULL;
     }
-    delete_item(key);
+
+    item = find_item_in_hash_table(&shard->hash_table, key);
+    if (item == NULL)
+      COUNT_LOOKUPS(counters->filter.false_positives, 1);
   }
 
-  DBItem *item = create_item_with_json(key, json);
-  pthread_mutex_lock(db_mutex);
-  add_item_to_hash_table(key, item);
+  // the time is only read for the items that expire
+  if (item != NULL && __atomic_load_n(&item->expires_at, __ATOMIC_RELAXED) != 0 && is_item_expired(item, get_time_ms()))
+    return NULL;
 
-  pthread_mutex_unlock(db_mutex);
   return item;
 }
 
-DBItem *rename_item(const char *old_key, const char *new_key)
+// Builds a filter sized for the items of the shard, with the shard locked.
+void static rebuild_shard_filter(DBShard *shard)
 {
-  if (old_key == NULL || new_key == NULL || !exists(old_key) || exists(new_key))
-    return NULL;
-
-  pthread_mutex_lock(db_mutex);
-  // remove item with old key
-  DBItem *item = remove_item_from_hash_table(old_key);
+  unsigned long count = count_hash_table_items(&shard->hash_table);
+  unsigned long capacity = BLOOM_FILTER_MIN_CAPACITY;
 
-  // add item with new key
-  add_item_to_hash_table(new_key, item);
-  pthread_mutex_unlock(db_mutex);
+  while (capacity < count * 2)
+    capacity <<= 1;
 
-  // rename item
-  set_item_key(item, new_key);
+  DBBloomFilter *filter = create_bloom_filter(capacity);
+  DBHashTableIterator iterator = iterate_hash_table(&shard->hash_table);
+  DBItem *item = NULL;
+  while ((item = next_hash_table_item(&iterator)) != NULL)
+    add_hash_to_bloom_filter(filter, item->hash);
 
-  return item;
+  DBBloomFilter *old_filter = shard->bloom_filter;
+  __atomic_store_n(&shard->bloom_filter, filter, __ATOMIC_RELEASE);
+  if (old_filter != NULL)
+    retire_pointer(old_filter, free_bloom_filter);
 }
 
-// Return true if success, false if fail.
-bool delete_item(const char *key)
+// Must be called with the shard locked, once the item is in the table.
+void static add_to_shard_filter(DBShard *shard, uint64_t hash)
 {
-  pthread_mutex_lock(db_mutex);
-  DBItem *item = remove_item_from_hash_table(key);
-  pthread_mutex_unlock(db_mutex);
-
-  if (item == NULL)
-    return false;
-
-  cJSON_Delete(item->json);
-  free(item);
+  DBBloomFilter *filter = shard->bloom_filter;
 
-  return true;
+  // the rebuilt filter already has the new item
+  if (filter == NULL || filter->count >= filter->capacity)
+    rebuild_shard_filter(shard);
+  else
+    add_hash_to_bloom_filter(filter, hash);
 }
 
-// Returns the attribute Model.
-DBModel *def_model(DBModel *parent, const char *key, DBModelType type)
+// Must be called with the shard locked, once the item is out of the table.
+void static remove_from_shard_filter(DBShard *shard, uint64_t hash)
 {
-  DBModel *model = (DBModel *)malloc(sizeof(DBModel));
+  DBBloomFilter *filter = shard->bloom_filter;
 
-  if (!model)
-    memory_error_handler(__FILE__, __LINE__, __func__);
-
-  model->key = key;
-  model->type = type;
-  model->intvalue = 0;
-  model->attributes = NULL;
-
-  if (parent == NULL)
-    return model;
+  if (filter == NULL)
+    return;
 
-  parent->attributes = (DBModel **)realloc(parent->attributes, (parent->intvalue + 1) * sizeof(DBModel *));
+  remove_hash_from_bloom_filter(filter, hash);
+  if (filter->capacity > BLOOM_FILTER_MIN_CAPACITY && filter->count * BLOOM_FILTER_SHRINK_RATIO < filter->capacity)
+    rebuild_shard_filter(shard);
+}
 
-  if (!parent->attributes)
-    memory_error_handler(__FILE__, __LINE__, __func__);
+// Keys are only counted if they are not constant, names of the children
+// may be shared.
+DBJsonSize static measure_json(cJSON *json)
+{
+  DBJsonSize size = {0, 0};
+  DBJsonSize child_size;
 
-  parent->attributes[parent->intvalue] = model;
-  parent->intvalue++;
+  for (; json != NULL; json = json->next)
+  {
+    size.nodes++;
+    if (json->valuestring != NULL)
+      size.string_bytes += strlen(json->valuestring) + 1;
+    if (json->string != NULL && !(json->type & cJSON_StringIsConst))
+      size.string_bytes += strlen(json->string) + 1;
+    if (json->child != NULL)
+    {
+      child_size = measure_json(json->child);
+      size.nodes += child_size.nodes;
+      size.string_bytes += child_size.string_bytes;
+    }
+  }
 
-  return model;
+  return size;
 }
 
-// Returns the Model with the property set.
-DBModel *def_model_attr(DBModel *model, DBModelType attr, int value)
+// Must be called with the shard locked.
+void static add_json_size_to_shard(DBShard *shard, DBItem *item)
 {
-  DBModel *attribute = def_model(model, NULL, attr);
-  attribute->intvalue = value;
+  shard->json_nodes += item->json_nodes;
+  shard->json_string_bytes += item->json_string_bytes;
+  if (item->json == NULL)
+    shard->evicted_items++;
+  if (item->dirty)
+    shard->dirty_items++;
+  __atomic_add_fetch(&resident_json_bytes, JSON_BYTES(item->json_nodes, item->json_string_bytes), __ATOMIC_RELAXED);
+}
 
-  return model;
+// Must be called with the shard locked.
+void static remove_json_size_from_shard(DBShard *shard, DBItem *item)
+{
+  shard->json_nodes -= item->json_nodes;
+  shard->json_string_bytes -= item->json_string_bytes;
+  if (item->json == NULL)
+    shard->evicted_items--;
+  if (item->dirty)
+    shard->dirty_items--;
+  __atomic_sub_fetch(&resident_json_bytes, JSON_BYTES(item->json_nodes, item->json_string_bytes), __ATOMIC_RELAXED);
 }
 
-DBModel *get_model_attr(DBModel *model, DBModelType type)
+// Returns the json of the item, read back from the spill file if it was
+// evicted, and marks the item as used for the clock hand. Must be called
+// from inside an epoch or with a handle.
+cJSON static *load_item_json(DBItem *item)
 {
-  if (model == NULL)
-    return NULL;
+  // ordered after the handle taken by acquire_item, see evict_item()
+  cJSON *json = __atomic_load_n(&item->json, __ATOMIC_SEQ_CST);
 
-  int attributes_length = model->intvalue;
+  if (!__atomic_load_n(&item->referenced, __ATOMIC_RELAXED))
+    __atomic_store_n(&item->referenced, true, __ATOMIC_RELAXED);
 
-  if (type == DBModelAttr_ArrayTypeGetter)
+  if (json != NULL)
+    return json;
+
+  // a rename may move the item to another shard before it is locked
+  DBShard *shard = NULL;
+  while (true)
   {
-    for (int i = 0; i < attributes_length; i++)
-    {
-      if (model->attributes[i]->key == DBModel_ArrayTypeSymbol)
-        return model->attributes[i];
-    }
+    shard = get_shard(__atomic_load_n(&item->hash, __ATOMIC_ACQUIRE));
+    pthread_mutex_lock(&shard->mutex);
+    if (shard == get_shard(item->hash))
+      break;
+    pthread_mutex_unlock(&shard->mutex);
   }
-  else
+
+  json = item->json;
+  if (json == NULL)
   {
-    for (int i = 0; i < attributes_length; i++)
-    {
-      if (model->attributes[i]->type == type)
-        return model->attributes[i];
-    }
+    char *data = read_spill_record(&item->extra->spilled);
+    json = data != NULL ? cJSON_Parse(data) : NULL;
+    free(data);
+    if (json == NULL)
+      file_error_handler(get_spill_filename(), __FILE__, __LINE__, __func__);
+    intern_json_keys(json);
+
+    // an item deleted meanwhile is not counted in the shard anymore
+    DBHashedKey key = {item->key, item->key_length, item->hash};
+    bool linked = find_item_in_hash_table(&shard->hash_table, &key) == item;
+    DBJsonSize json_size = measure_json(json);
+
+    if (linked)
+      remove_json_size_from_shard(shard, item);
+    __atomic_store_n(&item->json, json, __ATOMIC_RELEASE);
+    item->json_nodes = (unsigned int)json_size.nodes;
+    item->json_string_bytes = (unsigned int)json_size.string_bytes;
+    if (linked)
+      add_json_size_to_shard(shard, item);
+    COUNT_OPERATIONS(reloads, 1);
   }
+  pthread_mutex_unlock(&shard->mutex);
 
-  return NULL;
+  return json;
 }
 
-DBKeys *get_model_keys(DBModel *model)
+// Must be called with the shard locked. The json is only written if it
+// changed since it was last evicted. Returns false if it can not be written.
+bool static evict_item(DBShard *shard, DBItem *item)
 {
-  DBKeys *keys = (DBKeys *)malloc(sizeof(DBKeys));
+  cJSON *json = item->json;
+  DBItemExtra *extra = get_item_extra(item);
 
-  if (!keys)
-    memory_error_handler(__FILE__, __LINE__, __func__);
+  if (extra->spilled.offset < 0)
+  {
+    char *data = cJSON_PrintUnformatted(json);
 
-  keys->length = 0;
-  keys->keys = NULL;
+    if (!data)
+      memory_error_handler(__FILE__, __LINE__, __func__);
 
-  if (model->type != DBModelType_Object)
-    return keys;
+    bool written = write_spill_record(data, strlen(data), &extra->spilled);
+    free(data);
+    if (!written)
+      return false;
+  }
 
-  int length = model->intvalue;
+  remove_json_size_from_shard(shard, item);
+  __atomic_store_n(&item->json, NULL, __ATOMIC_RELEASE);
+  item->json_nodes = 0;
+  item->json_string_bytes = 0;
+  add_json_size_to_shard(shard, item);
+  COUNT_OPERATIONS(evictions, 1);
 
-  keys->keys = (const char **)malloc(length * sizeof(const char *));
+  // The json is cleared before the handles are counted, so acquire_item
+  // either reads it back or has a handle that keeps this one valid.
+  retire_from_item(item, json, (void (*)(void *))cJSON_Delete);
 
-  if (!keys->keys)
-    memory_error_handler(__FILE__, __LINE__, __func__);
+  return true;
+}
 
-  keys->length = length;
+// A used item gets a second chance, it is evicted if it is still unused when
+// the hand comes back.
+void static visit_item_with_clock(DBItem *item, void *shard)
+{
+  if (item->json == NULL ||
+      __atomic_load_n(&resident_json_bytes, __ATOMIC_RELAXED) <= __atomic_load_n(&memory_budget, __ATOMIC_RELAXED))
+    return;
 
-  for (int i = 0; i < length; i++)
+  if (__atomic_load_n(&item->referenced, __ATOMIC_RELAXED))
   {
-    keys->keys[i] = model->attributes[i]->key;
+    __atomic_store_n(&item->referenced, false, __ATOMIC_RELAXED);
+    return;
   }
 
-  return keys;
+  if (__atomic_load_n(&item->references, __ATOMIC_SEQ_CST) == ITEM_TABLE_REFERENCE)
+    evict_item((DBShard *)shard, item);
 }
 
-#define GET_KEYS_CHUNK_SIZE 8
-
-DBKeys *get_cjson_keys(cJSON *json)
+// Moves the clock hand until the json fits in the budget. Must be called
+// without a shard locked.
+void static enforce_memory_budget()
 {
-  DBKeys *keys = (DBKeys *)malloc(sizeof(DBKeys));
+  unsigned long budget = __atomic_load_n(&memory_budget, __ATOMIC_RELAXED);
 
-  if (!keys)
-    memory_error_handler(__FILE__, __LINE__, __func__);
+  if (budget == 0 || __atomic_load_n(&resident_json_bytes, __ATOMIC_RELAXED) <= budget)
+    return;
 
-  keys->length = 0;
-  keys->keys = NULL;
-  int count = 0;
+  // one thread moves the hand, the others do not wait for it
+  if (pthread_mutex_trylock(&clock_mutex) != 0)
+    return;
 
-  cJSON *cursor = json->child;
-  while (cursor != NULL)
+  // every item is visited twice in 2 rounds after the current shard, the
+  // items still over the budget then all have handles
+  int shards_passed = 0;
+  while (shards_passed <= 2 * DATABASE_SHARD_COUNT &&
+         __atomic_load_n(&resident_json_bytes, __ATOMIC_RELAXED) > budget)
   {
-    count++;
-    if (keys->length < count)
+    DBShard *shard = &shards[clock_shard];
+    pthread_mutex_lock(&shard->mutex);
+    for (int i = 0; i < CLOCK_BUCKETS_PER_LOCK && __atomic_load_n(&resident_json_bytes, __ATOMIC_RELAXED) > budget; i++)
     {
-      keys->length += GET_KEYS_CHUNK_SIZE;
-      keys->keys = (const char **)realloc(keys->keys, keys->length * sizeof(const char *));
-
-      if (!keys->keys)
-        memory_error_handler(__FILE__, __LINE__, __func__);
+      clock_cursor = scan_hash_table(&shard->hash_table, clock_cursor, visit_item_with_clock, shard);
+      if (clock_cursor == 0)
+        break;
     }
-    keys->keys[count - 1] = cursor->string;
-    cursor = cursor->next;
-  }
+    pthread_mutex_unlock(&shard->mutex);
 
-  if (keys->length != count)
-  {
-    keys->length = count;
-    keys->keys = (const char **)realloc(keys->keys, count * sizeof(const char *));
-    if (!keys->keys)
-      memory_error_handler(__FILE__, __LINE__, __func__);
+    if (clock_cursor == 0)
+    {
+      clock_shard = (clock_shard + 1) & (DATABASE_SHARD_COUNT - 1);
+      shards_passed++;
+    }
   }
-
-  return keys;
+  pthread_mutex_unlock(&clock_mutex);
 }
 
-DBKeys *get_database_keys()
+uint64_t static get_time_ms()
 {
-  DBKeys *keys = (DBKeys *)malloc(sizeof(DBKeys));
-
-  if (!keys)
-    memory_error_handler(__FILE__, __LINE__, __func__);
+  struct timespec now;
 
-  keys->length = 0;
-  keys->keys = NULL;
-  int count = 0;
-  DBItem *cursor = NULL;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
 
-  for (int i = 0; i < HASH_TABLE_SIZE; i++)
-  {
-    cursor = hash_table[i];
-    while (cursor != NULL)
-    {
-      count++;
-      if (keys->length < count)
-      {
-        keys->length += GET_KEYS_CHUNK_SIZE;
-        keys->keys = (const char **)realloc(keys->keys, keys->length * sizeof(const char *));
-        if (!keys->keys)
-          memory_error_handler(__FILE__, __LINE__, __func__);
-      }
-      keys->keys[count - 1] = cursor->key;
-      cursor = cursor->next;
-    }
-  }
+uint64_t static get_wall_time_ms()
+{
+  struct timespec now;
 
-  if (keys->length != count)
-  {
-    keys->length = count;
-    keys->keys = (const char **)realloc(keys->keys, count * sizeof(const char *));
-    if (!keys->keys)
-      memory_error_handler(__FILE__, __LINE__, __func__);
-  }
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
 
-  return keys;
+// The timers run on the monotonic clock, the expiries are saved and logged
+// on the wall clock, which goes on across a restart. Added to a monotonic
+// time to convert it, wrapping around if the wall clock is behind.
+uint64_t static get_wall_clock_offset()
+{
+  return get_wall_time_ms() - get_time_ms();
 }
 
-void free_keys(DBKeys *keys)
+bool static is_item_expired(DBItem *item, uint64_t now)
 {
-  if (keys == NULL)
-    return;
+  uint64_t expires_at = __atomic_load_n(&item->expires_at, __ATOMIC_ACQUIRE);
 
-  free(keys->keys);
-  free(keys);
+  return expires_at != 0 && expires_at <= now;
 }
 
-void load_database(const char *filename)
+// Must be called with the shard locked, once the item is in the table. The
+// timer expires at the first tick after the expiry, never before it.
+void static set_item_expiry(DBShard *shard, DBItem *item, uint64_t expires_at)
 {
-  // read the JSON file
-  FILE *file = fopen(filename, "r");
-  char *db_json_string = NULL;
-  long length = 0;
-
-  if (file == NULL)
+  if (expires_at == 0)
   {
-    printf("Warning: Failed to open file %s\n", filename);
+    remove_item_timer(shard, item);
   }
   else
   {
-    fseek(file, 0, SEEK_END);
-    length = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    db_json_string = (char *)calloc((length + 1), sizeof(char));
-    if (!db_json_string)
-      memory_error_handler(__FILE__, __LINE__, __func__);
-    fread(db_json_string, 1, length, file);
-    fclose(file);
-    // prevent memory leak
-    db_json_string[length] = '\0';
-  }
+    DBItemExtra *extra = get_item_extra(item);
 
-  // clear table if table is not NULL
-  if (hash_table != NULL)
-  {
-    DBItem *item = NULL;
-    DBItem *next = NULL;
-    for (int i = 0; i < HASH_TABLE_SIZE; i++)
+    if (extra->timer == NULL)
     {
-      item = hash_table[i];
-      while (item != NULL)
-      {
-        next = item->next;
-        free(item->key);
-        free(item);
-        item = next;
-      }
+      extra->timer = (DBTimer *)malloc(sizeof(DBTimer));
+
+      if (!extra->timer)
+        memory_error_handler(__FILE__, __LINE__, __func__);
+
+      extra->timer->data = item;
+    }
+    else
+    {
+      remove_timer(&shard->expiry_wheel, extra->timer);
     }
-    free(hash_table);
-    hash_table = NULL;
+    extra->timer->deadline = (expires_at + EXPIRY_TICK_MS - 1) / EXPIRY_TICK_MS;
+    add_timer(&shard->expiry_wheel, extra->timer);
   }
 
-  // create hash table
-  hash_table = (DBItem **)calloc(HASH_TABLE_SIZE, sizeof(DBItem *));
+  __atomic_store_n(&item->expires_at, expires_at, __ATOMIC_RELEASE);
+}
 
-  if (!hash_table)
-    memory_error_handler(__FILE__, __LINE__, __func__);
+// Must be called with the shard locked.
+void static remove_item_timer(DBShard *shard, DBItem *item)
+{
+  if (item->extra == NULL || item->extra->timer == NULL)
+    return;
 
-  // create json root
-  cJSON *json_root = NULL;
-  if (db_json_string)
-  {
-    json_root = cJSON_Parse(db_json_string);
-    free(db_json_string);
-  }
-  if (json_root == NULL)
-    json_root = cJSON_CreateObject();
+  remove_timer(&shard->expiry_wheel, item->extra->timer);
+  free(item->extra->timer);
+  item->extra->timer = NULL;
+}
 
-  // load items
+void static free_timer(DBTimer *timer)
+{
+  free(timer);
+}
+
+// Must be called with the shard locked, the item must be in the table.
+void static remove_expired_item(DBShard *shard, DBItem *item)
+{
+  DBHashedKey key = {item->key, item->key_length, item->hash};
+
+  remove_item_timer(shard, item);
+  remove_item_from_hash_table(&shard->hash_table, &key);
+  remove_from_shard_filter(shard, item->hash);
+  remove_json_size_from_shard(shard, item);
+  remove_from_skip_list(&shard->key_index, item->key);
+  add_deleted_key(shard, item->key);
+  if (is_write_log_open())
+    append_write_log_record(DBLogRecord_Delete, item->key, NULL, 0);
+  COUNT_OPERATIONS(expirations, 1);
+  retire_item(item);
+}
+
+// The timer is already out of the wheel.
+void static expire_item(DBTimer *timer, void *shard)
+{
+  DBItem *item = (DBItem *)timer->data;
+
+  free(timer);
+  item->extra->timer = NULL;
+  remove_expired_item((DBShard *)shard, item);
+}
+
+// Must be called with the shard locked. Returns the number of items freed.
+unsigned long static expire_shard_items(DBShard *shard, uint64_t now)
+{
+  return advance_timing_wheel(&shard->expiry_wheel, now / EXPIRY_TICK_MS, expire_item, shard);
+}
+
+// The wheel frees an item at the end of the tick it expires in, so a writer
+// frees an expired item it is about to use itself. Must be called with the
+// shard locked.
+void static purge_expired_item(DBShard *shard, const DBHashedKey *key, uint64_t now)
+{
+  if (shard->expiry_wheel.count == 0)
+    return;
+
+  DBItem *item = find_item_in_hash_table(&shard->hash_table, key);
+
+  if (item != NULL && is_item_expired(item, now))
+    remove_expired_item(shard, item);
+}
+
+// Sets the expiries saved with a file on its items once they are all in. The
+// expiries are wall clock times in milliseconds keyed by the keys, the
+// items that expired since are freed.
+void static restore_expiries(cJSON *expiries)
+{
+  uint64_t offset = get_wall_clock_offset();
+  uint64_t now = get_time_ms() + offset;
+  uint64_t expires_at = 0;
+  DBHashedKey hashed_key;
+  DBShard *shard = NULL;
+  DBItem *item = NULL;
+  cJSON *expiry = NULL;
+
+  cJSON_ArrayForEach(expiry, expiries)
+  {
+    if (!cJSON_IsNumber(expiry) || expiry->valuedouble < 1 || expiry->string == NULL)
+      continue;
+
+    expires_at = (uint64_t)expiry->valuedouble;
+    hashed_key = hash_key(expiry->string);
+    shard = get_shard(hashed_key.hash);
+    pthread_mutex_lock(&shard->mutex);
+    item = find_item_in_hash_table(&shard->hash_table, &hashed_key);
+    if (item != NULL && expires_at <= now)
+      remove_expired_item(shard, item);
+    else if (item != NULL)
+      set_item_expiry(shard, item, expires_at - offset);
+    pthread_mutex_unlock(&shard->mutex);
+  }
+}
+
+// Returns the number of '$' that the name starts with when they are followed
+// by the rest of DATABASE_EXPIRY_MEMBER, 0 otherwise. With one, the name is
+// the member of the expiries, with more, it is a key saved with one more.
+size_t static match_expiry_member(const char *name)
+{
+  size_t dollars = 0;
+
+  while (name[dollars] == '$')
+    dollars++;
+
+  return dollars > 0 && strcmp(name + dollars, DATABASE_EXPIRY_MEMBER + 1) == 0 ? dollars : 0;
+}
+
+// Returns NULL if the write log is closed, the json is printed before the
+// shard is locked.
+char static *print_json_for_log(cJSON *json)
+{
+  if (json == NULL || !is_write_log_open())
+    return NULL;
+
+  char *data = cJSON_PrintUnformatted(json);
+
+  if (!data)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  return data;
+}
+
+// Must be called with the shard locked, an evicted json is taken as it is in
+// the spill file.
+char static *print_item_json_for_log(DBItem *item)
+{
+  if (item->json != NULL)
+    return print_json_for_log(item->json);
+
+  char *data = read_spill_record(&item->extra->spilled);
+
+  if (data == NULL)
+    file_error_handler(get_spill_filename(), __FILE__, __LINE__, __func__);
+
+  return data;
+}
+
+// A set whose item expired since it was logged is applied as a delete.
+void static apply_log_record(DBLogRecordType type, const char *key, const char *value, uint64_t expires_at, void *data)
+{
+  uint64_t now = expires_at != 0 ? get_wall_time_ms() : 0;
+
+  if (type == DBLogRecord_Delete || (expires_at != 0 && expires_at <= now))
+  {
+    delete_item(key);
+    return;
+  }
+
+  cJSON *json = cJSON_Parse(value);
+
+  if (json == NULL)
+  {
+    printf("Warning: Failed to parse the record of %s in file %s\n", key, (const char *)data);
+    return;
+  }
+
+  set_item_with_ttl(key, json, expires_at != 0 ? (unsigned long)(expires_at - now) : 0);
+}
+
+void static free_item(DBItem *item)
+{
+  if (item->extra != NULL)
+  {
+    DBStalePointer *stale = item->extra->stale;
+    DBStalePointer *next = NULL;
+    while (stale != NULL)
+    {
+      next = stale->next;
+      stale->free_pointer(stale->pointer);
+      free(stale);
+      stale = next;
+    }
+    free(item->extra);
+    __atomic_sub_fetch(&item_extras, 1, __ATOMIC_RELAXED);
+  }
+
+  cJSON_Delete(item->json);
+  if (item->key != item->inline_key)
+    deallocate_key(item->key);
+  deallocate_item(item);
+}
+
+void static release_table_reference(void *item)
+{
+  if (__atomic_sub_fetch(&((DBItem *)item)->references, ITEM_TABLE_REFERENCE, __ATOMIC_ACQ_REL) == 0)
+    free_item((DBItem *)item);
+}
+
+// Drops the reference of the table once no reader can see the item anymore,
+// the item is freed when the last handle is released too.
+void static retire_item(DBItem *item)
+{
+  retire_pointer(item, release_table_reference);
+}
+
+// Frees a pointer replaced in a linked item. Handles may still be using it,
+// so it is kept with the item until they are all released.
+void static retire_from_item(DBItem *item, void *pointer, void (*free_pointer)(void *pointer))
+{
+  // the replacement must be visible before the handles are counted
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&item->references, __ATOMIC_SEQ_CST) == ITEM_TABLE_REFERENCE)
+  {
+    retire_pointer(pointer, free_pointer);
+    return;
+  }
+
+  DBItemExtra *extra = get_item_extra(item);
+  DBStalePointer *stale = (DBStalePointer *)malloc(sizeof(DBStalePointer));
+
+  if (!stale)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  stale->pointer = pointer;
+  stale->free_pointer = free_pointer;
+  stale->next = __atomic_load_n(&extra->stale, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&extra->stale, &stale->next, stale, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+}
+
+// Called when the last handle of a linked item is released.
+void static retire_stale_pointers(DBItem *item)
+{
+  DBItemExtra *extra = __atomic_load_n(&item->extra, __ATOMIC_ACQUIRE);
+
+  if (extra == NULL)
+    return;
+
+  DBStalePointer *stale = __atomic_exchange_n(&extra->stale, NULL, __ATOMIC_ACQ_REL);
+  DBStalePointer *next = NULL;
+  while (stale != NULL)
+  {
+    next = stale->next;
+    retire_pointer(stale->pointer, stale->free_pointer);
+    free(stale);
+    stale = next;
+  }
+}
+
+// The hash of the key is stored in the item, so it is never computed again
+// when the item is rehashed or looked up.
+// A short key is copied inside the item when it is created. Readers may be
+// comparing the old key, so a renamed key is always allocated and the old
+// one is retired instead of being overwritten.
+DBItem static *set_item_key(DBItem *item, const DBHashedKey *key)
+{
+  if (item == NULL || key->string == NULL)
+    return NULL;
+
+  char *old_key = item->key;
+  char *new_key = NULL;
+
+  if (old_key == NULL && key->length < DATABASE_INLINE_KEY_SIZE)
+    new_key = item->inline_key;
+  else
+    new_key = allocate_key(key->length);
+
+  memcpy(new_key, key->string, key->length + 1);
+  __atomic_store_n(&item->key, new_key, __ATOMIC_RELEASE);
+  __atomic_store_n(&item->hash, key->hash, __ATOMIC_RELEASE);
+  __atomic_store_n(&item->key_length, key->length, __ATOMIC_RELEASE);
+
+  if (old_key != NULL && old_key != item->inline_key)
+    retire_from_item(item, old_key, deallocate_key);
+
+  return item;
+}
+
+// The json is not read, so an evicted item stays evicted.
+bool exists(const char *key)
+{
+  if (key == NULL)
+    return false;
+
+  DBHashedKey hashed_key = hash_key(key);
+  DBShard *shard = get_shard(hashed_key.hash);
+  enter_epoch();
+  bool found = find_item(shard, &hashed_key) != NULL;
+  exit_epoch();
+
+  return found;
+}
+
+DBItem *get_item(const char *key)
+{
+  if (key == NULL)
+    return NULL;
+
+  // the budget is enforced before the json is read back, so that the clock
+  // hand does not evict it again before it is returned
+  enforce_memory_budget();
+
+  // lookups do not lock the shard
+  DBHashedKey hashed_key = hash_key(key);
+  DBShard *shard = get_shard(hashed_key.hash);
+  enter_epoch();
+  DBItem *item = find_item(shard, &hashed_key);
+  if (item != NULL)
+    load_item_json(item);
+  exit_epoch();
+
+  return item;
+}
+
+DBItem *acquire_item(const char *key)
+{
+  if (key == NULL)
+    return NULL;
+
+  DBHashedKey hashed_key = hash_key(key);
+  DBShard *shard = get_shard(hashed_key.hash);
+  enter_epoch();
+  DBItem *item = find_item(shard, &hashed_key);
+  // the table reference can not be dropped before the epoch is exited
+  if (item != NULL)
+    __atomic_add_fetch(&item->references, ITEM_HANDLE_REFERENCE, __ATOMIC_SEQ_CST);
+  exit_epoch();
+
+  // the clock hand skips the item from now on, and if it was evicting it
+  // meanwhile, the json it read stays valid until the handle is released
+  if (item != NULL)
+  {
+    load_item_json(item);
+    enforce_memory_budget();
+  }
+
+  return item;
+}
+
+void release_item(DBItem *item)
+{
+  if (item == NULL)
+    return;
+
+  unsigned long references = __atomic_sub_fetch(&item->references, ITEM_HANDLE_REFERENCE, __ATOMIC_ACQ_REL);
+
+  if (references == 0)
+    free_item(item);
+  else if (references == ITEM_TABLE_REFERENCE)
+    retire_stale_pointers(item);
+}
+
+// Replaces the json of the item in place if the key exists. Setting the json
+// that the item already has keeps it, it may have been edited in place. The
+// expiry replaces the one of the item, 0 for none.
+// Must be called with the shard locked, the key is not added to the key index.
+DBItem static *upsert_item_in_shard(DBShard *shard, const DBHashedKey *key, cJSON *json, const DBJsonSize *json_size, uint64_t expires_at, bool *created)
+{
+  DBItemCreation creation = {json, false};
+  DBItem *item = upsert_item_in_hash_table(&shard->hash_table, key, create_item_for_upsert, &creation);
+  cJSON *old_json = item->json;
+
+  if (creation.created)
+  {
+    add_to_shard_filter(shard, key->hash);
+    COUNT_OPERATIONS(inserts, 1);
+  }
+  else
+  {
+    COUNT_OPERATIONS(updates, 1);
+  }
+
+  // the json may also have been edited in place, so its spilled copy is
+  // stale either way
+  remove_json_size_from_shard(shard, item);
+  if (old_json != json)
+    __atomic_store_n(&item->json, json, __ATOMIC_RELEASE);
+  item->dirty = true;
+  item->json_nodes = (unsigned int)json_size->nodes;
+  item->json_string_bytes = (unsigned int)json_size->string_bytes;
+  if (item->extra != NULL)
+    item->extra->spilled.offset = -1;
+  add_json_size_to_shard(shard, item);
+  __atomic_store_n(&item->referenced, true, __ATOMIC_RELAXED);
+  set_item_expiry(shard, item, expires_at);
+
+  // the item can only be deleted once the lock is released, an evicted item
+  // has no json to retire
+  if (!creation.created && old_json != NULL && old_json != json)
+    retire_from_item(item, old_json, (void (*)(void *))cJSON_Delete);
+  *created = creation.created;
+
+  return item;
+}
+
+DBItem *set_item(const char *key, cJSON *json)
+{
+  return set_item_with_ttl(key, json, 0);
+}
+
+DBItem *set_item_with_ttl(const char *key, cJSON *json, unsigned long ttl)
+{
+  if (key == NULL || json == NULL)
+    return NULL;
+
+  DBHashedKey hashed_key = hash_key(key);
+  DBShard *shard = get_shard(hashed_key.hash);
+  intern_json_keys(json);
+  DBJsonSize json_size = measure_json(json);
+  char *logged_json = print_json_for_log(json);
+  uint64_t now = get_time_ms();
+  // logged on the wall clock, see get_wall_clock_offset()
+  uint64_t logged_expiry = logged_json != NULL && ttl != 0 ? get_wall_time_ms() + ttl : 0;
+  bool created = false;
+  uint64_t logged = 0;
+  pthread_mutex_lock(&shard->mutex);
+  expire_shard_items(shard, now);
+  purge_expired_item(shard, &hashed_key, now);
+  DBItem *item = upsert_item_in_shard(shard, &hashed_key, json, &json_size, ttl != 0 ? now + ttl : 0, &created);
+  if (created)
+    insert_into_skip_list(&shard->key_index, key);
+  // logged with the shard locked, so that the records of a key are in the
+  // order of its writes, and waited for once it is unlocked
+  if (logged_json != NULL)
+    logged = append_write_log_record(DBLogRecord_Set, key, logged_json, logged_expiry);
+  pthread_mutex_unlock(&shard->mutex);
+  free(logged_json);
+  wait_for_write_log(logged);
+  enforce_memory_budget();
+
+  return item;
+}
+
+DBItem *rename_item(const char *old_key, const char *new_key)
+{
+  if (old_key == NULL || new_key == NULL)
+    return NULL;
+
+  DBHashedKey hashed_old_key = hash_key(old_key);
+  DBHashedKey hashed_new_key = hash_key(new_key);
+  DBShard *old_shard = get_shard(hashed_old_key.hash);
+  DBShard *new_shard = get_shard(hashed_new_key.hash);
+  uint64_t now = get_time_ms();
+
+  lock_shard_pair(old_shard, new_shard);
+  expire_shard_items(old_shard, now);
+  expire_shard_items(new_shard, now);
+  purge_expired_item(old_shard, &hashed_old_key, now);
+  purge_expired_item(new_shard, &hashed_new_key, now);
+  if (find_item_in_hash_table(&new_shard->hash_table, &hashed_new_key) != NULL)
+  {
+    unlock_shard_pair(old_shard, new_shard);
+    return NULL;
+  }
+
+  // remove item with old key
+  DBItem *item = remove_item_from_hash_table(&old_shard->hash_table, &hashed_old_key);
+  if (item == NULL)
+  {
+    unlock_shard_pair(old_shard, new_shard);
+    return NULL;
+  }
+  remove_from_shard_filter(old_shard, hashed_old_key.hash);
+  remove_json_size_from_shard(old_shard, item);
+  uint64_t expires_at = item->expires_at;
+  remove_item_timer(old_shard, item);
+
+  add_deleted_key(old_shard, old_key);
+
+  // rename item
+  set_item_key(item, &hashed_new_key);
+  item->dirty = true;
+
+  // add item with new key
+  move_item_to_hash_table(&old_shard->hash_table, &new_shard->hash_table, item);
+  add_to_shard_filter(new_shard, hashed_new_key.hash);
+  add_json_size_to_shard(new_shard, item);
+  if (expires_at != 0)
+    set_item_expiry(new_shard, item, expires_at);
+  remove_from_skip_list(&old_shard->key_index, old_key);
+  insert_into_skip_list(&new_shard->key_index, new_key);
+
+  // logged as a delete and a set, which can be applied again on a save
+  // that already has the new key, with the expiry kept by the rename
+  uint64_t logged = 0;
+  if (is_write_log_open())
+  {
+    char *logged_json = print_item_json_for_log(item);
+    append_write_log_record(DBLogRecord_Delete, old_key, NULL, 0);
+    logged = append_write_log_record(DBLogRecord_Set, new_key, logged_json,
+                                     expires_at != 0 ? expires_at + get_wall_clock_offset() : 0);
+    free(logged_json);
+  }
+  unlock_shard_pair(old_shard, new_shard);
+  wait_for_write_log(logged);
+  COUNT_OPERATIONS(renames, 1);
+
+  return item;
+}
+
+// Return true if success, false if fail.
+bool delete_item(const char *key)
+{
+  DBHashedKey hashed_key = hash_key(key);
+  DBShard *shard = get_shard(hashed_key.hash);
+  uint64_t now = get_time_ms();
+  uint64_t logged = 0;
+  pthread_mutex_lock(&shard->mutex);
+  expire_shard_items(shard, now);
+  purge_expired_item(shard, &hashed_key, now);
+  DBItem *item = remove_item_from_hash_table(&shard->hash_table, &hashed_key);
+  if (item != NULL)
+  {
+    remove_from_shard_filter(shard, hashed_key.hash);
+    remove_json_size_from_shard(shard, item);
+    remove_item_timer(shard, item);
+    remove_from_skip_list(&shard->key_index, key);
+    add_deleted_key(shard, key);
+    if (is_write_log_open())
+      logged = append_write_log_record(DBLogRecord_Delete, key, NULL, 0);
+  }
+  pthread_mutex_unlock(&shard->mutex);
+
+  if (item == NULL)
+    return false;
+
+  wait_for_write_log(logged);
+  COUNT_OPERATIONS(deletes, 1);
+  retire_item(item);
+
+  return true;
+}
+
+// Hashes every key and sorts the positions by shard, keeping the order of the
+// batch inside a shard so that repeated keys are applied in order.
+DBBatch static create_batch(const char **keys, int count)
+{
+  DBBatch batch;
+  int shard_counts[DATABASE_SHARD_COUNT] = {0};
+  int *shard_indexes = (int *)malloc(count * sizeof(int));
+  batch.hashed_keys = (DBHashedKey *)malloc(count * sizeof(DBHashedKey));
+  batch.order = (int *)malloc(count * sizeof(int));
+
+  if (!shard_indexes || !batch.hashed_keys || !batch.order)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  for (int i = 0; i < count; i++)
+  {
+    batch.hashed_keys[i] = hash_key(keys[i]);
+    shard_indexes[i] = (int)(get_shard(batch.hashed_keys[i].hash) - shards);
+    shard_counts[shard_indexes[i]]++;
+  }
+
+  batch.shard_starts[0] = 0;
+  for (int i = 0; i < DATABASE_SHARD_COUNT; i++)
+    batch.shard_starts[i + 1] = batch.shard_starts[i] + shard_counts[i];
+
+  // shard_counts is reused as the next free position of each shard
+  for (int i = 0; i < DATABASE_SHARD_COUNT; i++)
+    shard_counts[i] = batch.shard_starts[i];
+  for (int i = 0; i < count; i++)
+    batch.order[shard_counts[shard_indexes[i]]++] = i;
+
+  free(shard_indexes);
+  return batch;
+}
+
+void static free_batch(DBBatch *batch)
+{
+  free(batch->hashed_keys);
+  free(batch->order);
+}
+
+// Lookups do not lock, the whole batch is read in one epoch.
+// items[i] is the item of keys[i] or NULL, returns the number of items found.
+int get_items(const char **keys, int count, DBItem **items)
+{
+  int found = 0;
+  DBHashedKey hashed_key;
+
+  // before the jsons are read back, as in get_item
+  enforce_memory_budget();
+  enter_epoch();
+  for (int i = 0; i < count; i++)
+  {
+    items[i] = NULL;
+    if (keys[i] == NULL)
+      continue;
+
+    hashed_key = hash_key(keys[i]);
+    items[i] = find_item(get_shard(hashed_key.hash), &hashed_key);
+    if (items[i] != NULL)
+    {
+      load_item_json(items[i]);
+      found++;
+    }
+  }
+  exit_epoch();
+
+  return found;
+}
+
+// Each shard is locked once for all of its keys. items[i] is the item of
+// keys[i], or NULL if the key or the json is NULL. Returns the number of
+// items set.
+int set_items(const char **keys, cJSON **jsons, int count, DBItem **items)
+{
+  if (count <= 0)
+    return 0;
+
+  DBBatch batch = create_batch(keys, count);
+  bool *created = (bool *)malloc(count * sizeof(bool));
+  DBJsonSize *json_sizes = (DBJsonSize *)malloc(count * sizeof(DBJsonSize));
+  char **logged_jsons = (char **)malloc(count * sizeof(char *));
+  uint64_t now = get_time_ms();
+  uint64_t logged = 0;
+  int set_count = 0;
+
+  if (!created || !json_sizes || !logged_jsons)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  // pooled, measured and printed before the shards are locked
+  for (int i = 0; i < count; i++)
+  {
+    intern_json_keys(jsons[i]);
+    json_sizes[i] = measure_json(jsons[i]);
+    logged_jsons[i] = keys[i] != NULL ? print_json_for_log(jsons[i]) : NULL;
+  }
+
+  for (int s = 0; s < DATABASE_SHARD_COUNT; s++)
+  {
+    if (batch.shard_starts[s] == batch.shard_starts[s + 1])
+      continue;
+
+    DBShard *shard = &shards[s];
+    pthread_mutex_lock(&shard->mutex);
+    expire_shard_items(shard, now);
+    for (int j = batch.shard_starts[s]; j < batch.shard_starts[s + 1]; j++)
+    {
+      int i = batch.order[j];
+      items[i] = NULL;
+      created[i] = false;
+      if (keys[i] == NULL || jsons[i] == NULL)
+        continue;
+
+      purge_expired_item(shard, &batch.hashed_keys[i], now);
+      items[i] = upsert_item_in_shard(shard, &batch.hashed_keys[i], jsons[i], &json_sizes[i], 0, &created[i]);
+      if (created[i])
+        insert_into_skip_list(&shard->key_index, keys[i]);
+      if (logged_jsons[i] != NULL)
+        logged = append_write_log_record(DBLogRecord_Set, keys[i], logged_jsons[i], 0);
+      set_count++;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+  }
+
+  // the whole batch shares the wait for its last record
+  wait_for_write_log(logged);
+  for (int i = 0; i < count; i++)
+    free(logged_jsons[i]);
+  free(created);
+  free(json_sizes);
+  free(logged_jsons);
+  free_batch(&batch);
+  enforce_memory_budget();
+
+  return set_count;
+}
+
+// Each shard is locked once for all of its keys. results[i] is true if
+// keys[i] was deleted. Returns the number of items deleted.
+int delete_items(const char **keys, int count, bool *results)
+{
+  if (count <= 0)
+    return 0;
+
+  DBBatch batch = create_batch(keys, count);
+  DBItem **items = (DBItem **)malloc(count * sizeof(DBItem *));
+  uint64_t now = get_time_ms();
+  uint64_t logged = 0;
+  int deleted_count = 0;
+
+  if (!items)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  for (int s = 0; s < DATABASE_SHARD_COUNT; s++)
+  {
+    if (batch.shard_starts[s] == batch.shard_starts[s + 1])
+      continue;
+
+    DBShard *shard = &shards[s];
+    pthread_mutex_lock(&shard->mutex);
+    expire_shard_items(shard, now);
+    for (int j = batch.shard_starts[s]; j < batch.shard_starts[s + 1]; j++)
+    {
+      int i = batch.order[j];
+      purge_expired_item(shard, &batch.hashed_keys[i], now);
+      items[i] = remove_item_from_hash_table(&shard->hash_table, &batch.hashed_keys[i]);
+      if (items[i] != NULL)
+      {
+        remove_from_shard_filter(shard, batch.hashed_keys[i].hash);
+        remove_json_size_from_shard(shard, items[i]);
+        remove_item_timer(shard, items[i]);
+        remove_from_skip_list(&shard->key_index, keys[i]);
+        add_deleted_key(shard, keys[i]);
+        if (is_write_log_open())
+          logged = append_write_log_record(DBLogRecord_Delete, keys[i], NULL, 0);
+      }
+    }
+    pthread_mutex_unlock(&shard->mutex);
+  }
+
+  wait_for_write_log(logged);
+  for (int i = 0; i < count; i++)
+  {
+    results[i] = items[i] != NULL;
+    if (items[i] != NULL)
+    {
+      retire_item(items[i]);
+      deleted_count++;
+    }
+  }
+
+  free(items);
+  free_batch(&batch);
+  COUNT_OPERATIONS(deletes, deleted_count);
+
+  return deleted_count;
+}
+
+// Returns the attribute Model.
+DBModel *def_model(DBModel *parent, const char *key, DBModelType type)
+{
+  DBModel *model = (DBModel *)malloc(sizeof(DBModel));
+
+  if (!model)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  model->key = key;
+  model->type = type;
+  model->intvalue = 0;
+  model->attributes = NULL;
+
+  if (parent == NULL)
+    return model;
+
+  parent->attributes = (DBModel **)realloc(parent->attributes, (parent->intvalue + 1) * sizeof(DBModel *));
+
+  if (!parent->attributes)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  parent->attributes[parent->intvalue] = model;
+  parent->intvalue++;
+
+  return model;
+}
+
+// Returns the Model with the property set.
+DBModel *def_model_attr(DBModel *model, DBModelType attr, int value)
+{
+  DBModel *attribute = def_model(model, NULL, attr);
+  attribute->intvalue = value;
+
+  return model;
+}
+
+DBModel *get_model_attr(DBModel *model, DBModelType type)
+{
+  if (model == NULL)
+    return NULL;
+
+  int attributes_length = model->intvalue;
+
+  if (type == DBModelAttr_ArrayTypeGetter)
+  {
+    for (int i = 0; i < attributes_length; i++)
+    {
+      if (model->attributes[i]->key == DBModel_ArrayTypeSymbol)
+        return model->attributes[i];
+    }
+  }
+  else
+  {
+    for (int i = 0; i < attributes_length; i++)
+    {
+      if (model->attributes[i]->type == type)
+        return model->attributes[i];
+    }
+  }
+
+  return NULL;
+}
+
+DBKeys *get_model_keys(DBModel *model)
+{
+  DBKeys *keys = (DBKeys *)malloc(sizeof(DBKeys));
+
+  if (!keys)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  keys->length = 0;
+  keys->keys = NULL;
+
+  if (model->type != DBModelType_Object)
+    return keys;
+
+  int length = model->intvalue;
+
+  keys->keys = (const char **)malloc(length * sizeof(const char *));
+
+  if (!keys->keys)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  keys->length = length;
+
+  for (int i = 0; i < length; i++)
+  {
+    keys->keys[i] = model->attributes[i]->key;
+  }
+
+  return keys;
+}
+
+#define GET_KEYS_CHUNK_SIZE 8
+
+DBKeys *get_cjson_keys(cJSON *json)
+{
+  DBKeys *keys = (DBKeys *)malloc(sizeof(DBKeys));
+
+  if (!keys)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  keys->length = 0;
+  keys->keys = NULL;
+  int count = 0;
+
+  cJSON *cursor = json->child;
+  while (cursor != NULL)
+  {
+    count++;
+    if (keys->length < count)
+    {
+      keys->length += GET_KEYS_CHUNK_SIZE;
+      keys->keys = (const char **)realloc(keys->keys, keys->length * sizeof(const char *));
+
+      if (!keys->keys)
+        memory_error_handler(__FILE__, __LINE__, __func__);
+    }
+    keys->keys[count - 1] = cursor->string;
+    cursor = cursor->next;
+  }
+
+  if (keys->length != count)
+  {
+    keys->length = count;
+    keys->keys = (const char **)realloc(keys->keys, count * sizeof(const char *));
+    if (!keys->keys)
+      memory_error_handler(__FILE__, __LINE__, __func__);
+  }
+
+  return keys;
+}
+
+DBKeys *get_database_keys()
+{
+  pthread_once(&shards_once, init_shards);
+
+  DBKeys *keys = (DBKeys *)malloc(sizeof(DBKeys));
+
+  if (!keys)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  // sized for the current keys, it only grows if keys are added meanwhile
+  size_t capacity = 0;
+  for (int i = 0; i < DATABASE_SHARD_COUNT; i++)
+    capacity += __atomic_load_n(&shards[i].key_index.count, __ATOMIC_RELAXED);
+  size_t *offsets = capacity > 0 ? (size_t *)malloc(capacity * sizeof(size_t)) : NULL;
+  char *text = NULL;
+  size_t text_length = 0;
+  size_t text_capacity = 0;
+  size_t count = 0;
+  size_t size = 0;
+  const char *key = NULL;
+
+  if (capacity > 0 && !offsets)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  // the keys are listed in order from the key index, and copied since the
+  // iterator only keeps the last one
+  DBKeyIterator iterator = scan_database_range(NULL, NULL);
+  while ((key = next_database_key(&iterator)) != NULL)
+  {
+    if (count == capacity)
+    {
+      capacity = capacity * 2 + GET_KEYS_CHUNK_SIZE;
+      offsets = (size_t *)realloc(offsets, capacity * sizeof(size_t));
+      if (!offsets)
+        memory_error_handler(__FILE__, __LINE__, __func__);
+    }
+    size = strlen(key) + 1;
+    if (text_length + size > text_capacity)
+    {
+      text_capacity = (text_length + size) * 2;
+      text = (char *)realloc(text, text_capacity);
+      if (!text)
+        memory_error_handler(__FILE__, __LINE__, __func__);
+    }
+    offsets[count++] = text_length;
+    memcpy(text + text_length, key, size);
+    text_length += size;
+  }
+
+  // the keys are stored after the pointers, so that free_keys() frees them
+  keys->length = (int)count;
+  keys->keys = NULL;
+  if (count > 0)
+  {
+    keys->keys = (const char **)malloc(count * sizeof(const char *) + text_length);
+    if (!keys->keys)
+      memory_error_handler(__FILE__, __LINE__, __func__);
+    char *copies = (char *)(keys->keys + count);
+    memcpy(copies, text, text_length);
+    for (size_t i = 0; i < count; i++)
+      keys->keys[i] = copies + offsets[i];
+  }
+  free(offsets);
+  free(text);
+
+  return keys;
+}
+
+DBFilterStats get_filter_stats()
+{
+  DBFilterStats stats = {0};
+
+  for (DBLookupCounters *counters = __atomic_load_n(&lookup_counters, __ATOMIC_ACQUIRE); counters != NULL; counters = counters->next)
+  {
+    stats.lookups += __atomic_load_n(&counters->filter.lookups, __ATOMIC_RELAXED);
+    stats.rejected += __atomic_load_n(&counters->filter.rejected, __ATOMIC_RELAXED);
+    stats.false_positives += __atomic_load_n(&counters->filter.false_positives, __ATOMIC_RELAXED);
+  }
+
+  return stats;
+}
+
+long get_item_ttl(const char *key)
+{
+  if (key == NULL)
+    return -2;
+
+  DBHashedKey hashed_key = hash_key(key);
+  DBShard *shard = get_shard(hashed_key.hash);
+  long ttl = -2;
+  enter_epoch();
+  DBItem *item = find_item(shard, &hashed_key);
+  if (item != NULL)
+  {
+    uint64_t expires_at = __atomic_load_n(&item->expires_at, __ATOMIC_ACQUIRE);
+    uint64_t now = get_time_ms();
+    ttl = expires_at == 0 ? -1 : (long)(expires_at > now ? expires_at - now : 0);
+  }
+  exit_epoch();
+
+  return ttl;
+}
+
+unsigned long expire_items()
+{
+  pthread_once(&shards_once, init_shards);
+
+  uint64_t now = get_time_ms();
+  unsigned long expired = 0;
+
+  for (int i = 0; i < DATABASE_SHARD_COUNT; i++)
+  {
+    pthread_mutex_lock(&shards[i].mutex);
+    expired += expire_shard_items(&shards[i], now);
+    pthread_mutex_unlock(&shards[i].mutex);
+  }
+
+  return expired;
+}
+
+bool set_memory_budget(unsigned long bytes)
+{
+  pthread_once(&shards_once, init_shards);
+
+  // the clock hand can not write to the file while it is opened
+  pthread_mutex_lock(&clock_mutex);
+  if (bytes > 0 && !is_spill_file_open() &&
+      !open_spill_file(memory_spill_filename != NULL ? memory_spill_filename : DATABASE_SPILL_FILENAME))
+  {
+    pthread_mutex_unlock(&clock_mutex);
+    return false;
+  }
+  __atomic_store_n(&memory_budget, bytes, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&clock_mutex);
+
+  enforce_memory_budget();
+  return true;
+}
+
+void set_memory_spill_file(const char *filename)
+{
+  char *copy = (char *)malloc(strlen(filename) + 1);
+
+  if (!copy)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  strcpy(copy, filename);
+
+  pthread_mutex_lock(&clock_mutex);
+  free(memory_spill_filename);
+  memory_spill_filename = copy;
+  pthread_mutex_unlock(&clock_mutex);
+}
+
+// Each shard is locked in turn, so the totals of different shards may be
+// from slightly different moments.
+DBStats db_stats()
+{
+  DBStats stats;
+  DBHashTableStats table_stats;
+  DBBloomFilter *filter = NULL;
+
+  pthread_once(&shards_once, init_shards);
+  memset(&stats, 0, sizeof(DBStats));
+  memset(&table_stats, 0, sizeof(DBHashTableStats));
+
+  for (int i = 0; i < DATABASE_SHARD_COUNT; i++)
+  {
+    pthread_mutex_lock(&shards[i].mutex);
+    add_hash_table_stats(&shards[i].hash_table, &table_stats);
+    stats.json_nodes += shards[i].json_nodes;
+    stats.json_string_bytes += shards[i].json_string_bytes;
+    stats.evicted_items += shards[i].evicted_items;
+    stats.expiring_items += shards[i].expiry_wheel.count;
+    stats.dirty_items += shards[i].dirty_items;
+    stats.deleted_keys += shards[i].deleted_count;
+    filter = shards[i].bloom_filter;
+    if (filter != NULL)
+      stats.filter_bytes += sizeof(DBBloomFilter) + filter->size;
+    stats.index_bytes += shards[i].key_index.bytes;
+    pthread_mutex_unlock(&shards[i].mutex);
+  }
+
+  stats.items = table_stats.items;
+  stats.table_positions = table_stats.positions;
+  stats.rehashing_tables = table_stats.rehashing;
+  stats.sampled_positions = table_stats.sampled_positions;
+  for (int i = 0; i < DATABASE_STATS_PROBE_LENGTHS; i++)
+    stats.probe_lengths[i] = table_stats.probe_lengths[i];
+  stats.table_bytes = table_stats.bytes;
+  stats.json_bytes = JSON_BYTES(stats.json_nodes, stats.json_string_bytes);
+  stats.spill_bytes = get_spill_file_bytes();
+
+  DBAllocatorStats allocator_stats = get_allocator_stats();
+  stats.item_bytes = allocator_stats.items_used * sizeof(DBItem) +
+                     __atomic_load_n(&item_extras, __ATOMIC_RELAXED) * sizeof(DBItemExtra);
+  stats.key_bytes = allocator_stats.key_bytes_used + allocator_stats.large_key_bytes;
+  stats.reserved_bytes = allocator_stats.reserved_bytes;
+
+  DBInternStats intern_stats = get_intern_stats();
+  stats.interned_names = intern_stats.strings;
+  stats.intern_bytes = intern_stats.bytes;
+
+  stats.lookups = 0;
+  for (DBLookupCounters *counters = __atomic_load_n(&lookup_counters, __ATOMIC_ACQUIRE); counters != NULL; counters = counters->next)
+    stats.lookups += __atomic_load_n(&counters->lookups, __ATOMIC_RELAXED);
+  stats.inserts = __atomic_load_n(&operation_counters.inserts, __ATOMIC_RELAXED);
+  stats.updates = __atomic_load_n(&operation_counters.updates, __ATOMIC_RELAXED);
+  stats.renames = __atomic_load_n(&operation_counters.renames, __ATOMIC_RELAXED);
+  stats.deletes = __atomic_load_n(&operation_counters.deletes, __ATOMIC_RELAXED);
+  stats.evictions = __atomic_load_n(&operation_counters.evictions, __ATOMIC_RELAXED);
+  stats.reloads = __atomic_load_n(&operation_counters.reloads, __ATOMIC_RELAXED);
+  stats.expirations = __atomic_load_n(&operation_counters.expirations, __ATOMIC_RELAXED);
+  stats.checkpoints = __atomic_load_n(&operation_counters.checkpoints, __ATOMIC_RELAXED);
+  stats.filter = get_filter_stats();
+  stats.write_log = get_write_log_stats();
+
+  return stats;
+}
+
+// The cursor holds the shard in its low bits and the cursor of the tables of
+// the shard in the others. Each shard is locked once per call.
+unsigned long scan_database(unsigned long cursor, int count, void (*callback)(DBItem *item, void *data), void *data)
+{
+  pthread_once(&shards_once, init_shards);
+
+  unsigned long shard_index = cursor & (DATABASE_SHARD_COUNT - 1);
+  unsigned long table_cursor = cursor >> DATABASE_SHARD_BITS;
+  uint64_t now = get_time_ms();
+
+  while (count > 0)
+  {
+    DBShard *shard = &shards[shard_index];
+    pthread_mutex_lock(&shard->mutex);
+    expire_shard_items(shard, now);
+    do
+    {
+      table_cursor = scan_hash_table(&shard->hash_table, table_cursor, callback, data);
+      count--;
+    } while (count > 0 && table_cursor != 0);
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (table_cursor == 0 && ++shard_index == DATABASE_SHARD_COUNT)
+      return 0;
+  }
+
+  return (table_cursor << DATABASE_SHARD_BITS) | shard_index;
+}
+
+DBKeyIterator scan_database_range(const char *start, const char *end)
+{
+  pthread_once(&shards_once, init_shards);
+  return scan_skip_lists_range(key_indexes, DATABASE_SHARD_COUNT, start, end);
+}
+
+DBKeyIterator scan_database_prefix(const char *prefix)
+{
+  pthread_once(&shards_once, init_shards);
+  return scan_skip_lists_prefix(key_indexes, DATABASE_SHARD_COUNT, prefix);
+}
+
+const char *next_database_key(DBKeyIterator *iterator)
+{
+  return next_skip_list_key(iterator);
+}
+
+void close_database_iterator(DBKeyIterator *iterator)
+{
+  close_skip_list_iterator(iterator);
+}
+
+void free_keys(DBKeys *keys)
+{
+  if (keys == NULL)
+    return;
+
+  free(keys->keys);
+  free(keys);
+}
+
+// The file is parsed from a read only mapping of it, so that its text is
+// never copied to the heap, and the pages are dropped by the system as the
+// parser moves on. With more than one thread, `threads` or
+// get_load_threads() when 0, the records are split into as many chunks,
+// parsed in place. Returns the number of chunks parsed, at most
+// DATABASE_LOAD_MAX_THREADS, or 0 if the file can not be opened, `found` set
+// to false, or if it is empty or not valid json.
+int static parse_database_file(const char *filename, bool *found, int threads, DBLoadChunk *chunks)
+{
+  int file = open(filename, O_RDONLY);
+  struct stat status;
+  int count = 0;
+
+  *found = file != -1;
+  if (file == -1)
+    return 0;
+
+  if (fstat(file, &status) == 0 && status.st_size > 0)
+  {
+    void *data = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    if (data != MAP_FAILED)
+    {
+      madvise(data, (size_t)status.st_size, MADV_SEQUENTIAL);
+      if (threads == 0)
+        threads = get_load_threads((size_t)status.st_size);
+      if (threads > 1)
+        count = split_database_records((const char *)data, (size_t)status.st_size, threads, chunks);
+
+      // parsed whole when it is not split, so that an invalid file fails
+      // as it always did
+      if (count <= 1)
+      {
+        count = 1;
+        chunks[0].json = cJSON_ParseWithLength((const char *)data, (size_t)status.st_size);
+      }
+      else
+      {
+        run_load_workers(parse_load_chunk, chunks, count);
+      }
+      munmap(data, (size_t)status.st_size);
+
+      for (int i = 0; i < count; i++)
+      {
+        if (chunks[i].json == NULL)
+        {
+          for (int j = 0; j < count; j++)
+            cJSON_Delete(chunks[j].json);
+          count = 0;
+          break;
+        }
+      }
+    }
+    else
+    {
+      printf("Warning: Failed to map file %s\n", filename);
+    }
+  }
+  close(file);
+
+  return count;
+}
+
+int static get_load_threads(size_t length)
+{
+  int threads = __atomic_load_n(&load_threads, __ATOMIC_RELAXED);
+
+  if (threads == 0)
+  {
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t chunks = length / DATABASE_LOAD_CHUNK_BYTES;
+
+    threads = processors < 1 ? 1 : (int)(processors < DATABASE_LOAD_MAX_THREADS ? processors : DATABASE_LOAD_MAX_THREADS);
+    if (chunks < (size_t)threads)
+      threads = chunks < 1 ? 1 : (int)chunks;
+  }
+
+  return threads < DATABASE_LOAD_MAX_THREADS ? threads : DATABASE_LOAD_MAX_THREADS;
+}
+
+// Splits the records of the object in `data` into up to `count` chunks of
+// about the same size, at the commas between the records. Only the strings
+// and the nesting are followed, the chunks are checked by the parser.
+// Returns the number of chunks, 0 if `data` is not an object.
+int static split_database_records(const char *data, size_t length, int count, DBLoadChunk *chunks)
+{
+  size_t start = 0;
+  int depth = 0;
+  int chunk_count = 0;
+  bool in_string = false;
+
+  start = (size_t)(skip_json_whitespace(data, data + length) - data);
+  if (start == length || data[start] != '{')
+    return 0;
+  start++;
+
+  size_t first = start;
+  size_t chunk_length = (length - first) / (size_t)count;
+
+  for (size_t i = start; i < length; i++)
+  {
+    if (in_string)
+    {
+      if (data[i] == '\\')
+        i++;
+      else if (data[i] == '"')
+        in_string = false;
+    }
+    else if (data[i] == '"')
+    {
+      in_string = true;
+    }
+    else if (data[i] == '{' || data[i] == '[')
+    {
+      depth++;
+    }
+    else if ((data[i] == '}' || data[i] == ']') && depth > 0)
+    {
+      depth--;
+    }
+    else if (data[i] == '}' || data[i] == ']')
+    {
+      // the end of the object
+      if (data[i] != '}')
+        return 0;
+      chunks[chunk_count].data = data + start;
+      chunks[chunk_count].length = i - start;
+      chunks[chunk_count].json = NULL;
+      return chunk_count + 1;
+    }
+    else if (data[i] == ',' && depth == 0 && chunk_count < count - 1 &&
+             i - first >= chunk_length * (size_t)(chunk_count + 1))
+    {
+      chunks[chunk_count].data = data + start;
+      chunks[chunk_count].length = i - start;
+      chunks[chunk_count].json = NULL;
+      chunk_count++;
+      start = i + 1;
+    }
+  }
+
+  return 0;
+}
+
+// Runs `work` on every chunk, each one on its own thread except the first
+// one, which is run by the calling thread with those that could not be
+// started.
+void static run_load_workers(void *(*work)(void *chunk), DBLoadChunk *chunks, int count)
+{
+  pthread_t threads[DATABASE_LOAD_MAX_THREADS];
+  bool started[DATABASE_LOAD_MAX_THREADS];
+
+  for (int i = 1; i < count; i++)
+    started[i] = pthread_create(&threads[i], NULL, work, &chunks[i]) == 0;
+  work(&chunks[0]);
+  for (int i = 1; i < count; i++)
+  {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+    else
+      work(&chunks[i]);
+  }
+}
+
+const char static *skip_json_whitespace(const char *data, const char *end)
+{
+  while (data < end && (*data == ' ' || *data == '\t' || *data == '\n' || *data == '\r'))
+    data++;
+
+  return data;
+}
+
+// The records are parsed from the mapping one key and one value at a time,
+// each parse stopping at the end of its value, so that the chunk is never
+// copied. The key is parsed as a string and becomes the name of the value.
+void static *parse_load_chunk(void *chunk)
+{
+  DBLoadChunk *load_chunk = (DBLoadChunk *)chunk;
+  const char *end = load_chunk->data + load_chunk->length;
+  const char *data = skip_json_whitespace(load_chunk->data, end);
+  const char *parse_end = NULL;
+  cJSON *object = cJSON_CreateObject();
+  cJSON *key = NULL;
+  cJSON *value = NULL;
+  // a chunk is only empty after a trailing comma
+  bool valid = object != NULL && data < end;
+
+  while (valid && data < end)
+  {
+    key = cJSON_ParseWithLengthOpts(data, (size_t)(end - data), &parse_end, false);
+    valid = cJSON_IsString(key);
+    data = valid ? skip_json_whitespace(parse_end, end) : end;
+    valid = valid && data < end && *data == ':';
+    value = valid ? cJSON_ParseWithLengthOpts(data + 1, (size_t)(end - data - 1), &parse_end, false) : NULL;
+    valid = value != NULL;
+    if (valid)
+    {
+      value->string = key->valuestring;
+      key->valuestring = NULL;
+      cJSON_AddItemToArray(object, value);
+      data = skip_json_whitespace(parse_end, end);
+    }
+    cJSON_Delete(key);
+
+    // a comma is followed by another record
+    if (valid && data < end)
+    {
+      valid = *data == ',';
+      data = skip_json_whitespace(data + 1, end);
+      valid = valid && data < end;
+    }
+  }
+
+  if (!valid)
+  {
+    cJSON_Delete(object);
+    object = NULL;
+  }
+  load_chunk->json = object;
+
+  return NULL;
+}
+
+// Each record is detached from the object of the chunk and kept as it was
+// parsed. The chunks are inserted concurrently, each record locks its shard,
+// and nothing else is shared: the member names are pooled once for the
+// chunk, and the key indexes are built once every chunk is in, see
+// build_key_indexes().
+void static *load_records(void *chunk)
+{
+  DBLoadChunk *load_chunk = (DBLoadChunk *)chunk;
+  cJSON *json_root = load_chunk->json;
   cJSON *json_cursor = json_root->child;
+  cJSON *json_next = NULL;
+  char *key = NULL;
+  size_t dollars = 0;
   DBItem *item = NULL;
+  DBHashedKey hashed_key;
+  DBShard *shard = NULL;
+  DBJsonSize json_size;
+  DBInternTable names;
+
+  init_intern_table(&names);
+  for (; json_cursor != NULL; json_cursor = json_cursor->next)
+  {
+    if (match_expiry_member(json_cursor->string) != 1)
+      collect_json_keys(&names, json_cursor);
+  }
+  merge_intern_table(&names);
 
-  pthread_mutex_lock(db_mutex);
+  load_chunk->expiries = NULL;
+  json_cursor = json_root->child;
   while (json_cursor != NULL)
   {
-    item = create_item_with_json(json_cursor->string, cJSON_Duplicate(json_cursor, true));
-    add_item_to_hash_table(json_cursor->string, item);
-    json_cursor = json_cursor->next;
+    json_next = json_cursor->next;
+    key = detach_record(json_root, json_cursor);
+
+    // the expiries are set once every record is in, see restore_expiries()
+    dollars = match_expiry_member(key);
+    if (dollars == 1)
+    {
+      cJSON_Delete(load_chunk->expiries);
+      load_chunk->expiries = json_cursor;
+      cJSON_free(key);
+      json_cursor = json_next;
+      continue;
+    }
+
+    hashed_key = hash_key(dollars > 1 ? key + 1 : key);
+    item = create_item_with_json(&hashed_key, json_cursor);
+    cJSON_free(key);
+    apply_intern_table(&names, item->json);
+    json_size = measure_json(item->json);
+    item->json_nodes = (unsigned int)json_size.nodes;
+    item->json_string_bytes = (unsigned int)json_size.string_bytes;
+    shard = get_shard(hashed_key.hash);
+    pthread_mutex_lock(&shard->mutex);
+    add_item_to_hash_table(&shard->hash_table, item);
+    add_json_size_to_shard(shard, item);
+    add_to_shard_filter(shard, hashed_key.hash);
+    pthread_mutex_unlock(&shard->mutex);
+    json_cursor = json_next;
   }
-  pthread_mutex_unlock(db_mutex);
 
   cJSON_Delete(json_root);
+  free_intern_table(&names);
+  // the records were all parsed before, so enforcing the budget for each of
+  // them would not lower the peak
+  enforce_memory_budget();
+
+  return NULL;
 }
 
-void save_database(const char *filename)
+int static compare_keys(const void *a, const void *b)
+{
+  return strcmp(*(const char **)a, *(const char **)b);
+}
+
+// The loaded keys of the shard are sorted and appended to its index at once,
+// with the shard locked.
+void static build_shard_key_index(DBShard *shard)
+{
+  pthread_mutex_lock(&shard->mutex);
+  unsigned long count = count_hash_table_items(&shard->hash_table);
+  const char **keys = count > 0 ? (const char **)malloc(count * sizeof(const char *)) : NULL;
+  unsigned long length = 0;
+  DBHashTableIterator iterator = iterate_hash_table(&shard->hash_table);
+  DBItem *item = NULL;
+
+  if (count > 0 && !keys)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  while (length < count && (item = next_hash_table_item(&iterator)) != NULL)
+    keys[length++] = item->key;
+  qsort(keys, length, sizeof(const char *), compare_keys);
+  build_skip_list(&shard->key_index, keys, length);
+  pthread_mutex_unlock(&shard->mutex);
+  free(keys);
+}
+
+// Run by the threads of the load, which take the shards in turn.
+void static *build_key_indexes(void *chunk)
 {
-  FILE *file = fopen(filename, "w");
-  if (file == NULL)
+  int *next_shard = ((DBLoadChunk *)chunk)->next_shard;
+  int s = 0;
+
+  while ((s = __atomic_fetch_add(next_shard, 1, __ATOMIC_RELAXED)) < DATABASE_SHARD_COUNT)
+    build_shard_key_index(&shards[s]);
+
+  return NULL;
+}
+
+void load_database(const char *filename)
+{
+  // parse the JSON file
+  bool loaded = false;
+  DBLoadChunk chunks[DATABASE_LOAD_MAX_THREADS];
+  int count = parse_database_file(filename, &loaded, 0, chunks);
+
+  if (!loaded)
+    printf("Warning: Failed to open file %s\n", filename);
+
+  // clear tables and create empty ones, the clock hand can not write to the
+  // spill file meanwhile
+  pthread_once(&shards_once, init_shards);
+  pthread_mutex_lock(&clock_mutex);
+  for (int i = 0; i < DATABASE_SHARD_COUNT; i++)
+  {
+    pthread_mutex_lock(&shards[i].mutex);
+    clear_hash_table(&shards[i].hash_table, retire_item);
+    init_hash_table(&shards[i].hash_table);
+    if (shards[i].bloom_filter != NULL)
+    {
+      retire_pointer(shards[i].bloom_filter, free_bloom_filter);
+      __atomic_store_n(&shards[i].bloom_filter, NULL, __ATOMIC_RELEASE);
+    }
+    __atomic_sub_fetch(&resident_json_bytes, JSON_BYTES(shards[i].json_nodes, shards[i].json_string_bytes), __ATOMIC_RELAXED);
+    shards[i].json_nodes = 0;
+    shards[i].json_string_bytes = 0;
+    shards[i].evicted_items = 0;
+    clear_timing_wheel(&shards[i].expiry_wheel, free_timer);
+    shards[i].dirty_items = 0;
+    clear_deleted_keys(&shards[i]);
+    clear_skip_list(&shards[i].key_index);
+    pthread_mutex_unlock(&shards[i].mutex);
+  }
+  reset_spill_file();
+  clock_shard = 0;
+  clock_cursor = 0;
+  pthread_mutex_unlock(&clock_mutex);
+
+  // the chunks are inserted concurrently too
+  int next_shard = 0;
+  for (int i = 0; i < count; i++)
+    chunks[i].next_shard = &next_shard;
+  if (count > 0)
+  {
+    run_load_workers(load_records, chunks, count);
+    run_load_workers(build_key_indexes, chunks, count);
+  }
+  for (int i = 0; i < count; i++)
+  {
+    restore_expiries(chunks[i].expiries);
+    cJSON_Delete(chunks[i].expiries);
+  }
+
+  // the changes are tracked from the file, and its saved changes are
+  // applied as new ones
+  pthread_mutex_lock(&snapshot_mutex);
+  free(base_filename);
+  base_filename = NULL;
+  if (loaded)
+  {
+    base_filename = (char *)malloc(strlen(filename) + 1);
+    if (!base_filename)
+      memory_error_handler(__FILE__, __LINE__, __func__);
+    strcpy(base_filename, filename);
+  }
+  pthread_mutex_unlock(&snapshot_mutex);
+  if (loaded)
+    load_database_changes(filename);
+}
+
+void set_database_load_threads(int threads)
+{
+  __atomic_store_n(&load_threads, threads < 0 ? 0 : threads, __ATOMIC_RELAXED);
+}
+
+// Must be called with the shard locked.
+void static add_deleted_key(DBShard *shard, const char *key)
+{
+  if (shard->deleted_overflowed)
     return;
 
-  cJSON *json_root = cJSON_CreateObject();
+  if (shard->deleted_count == DATABASE_DELTA_MAX_DELETED_KEYS)
+  {
+    clear_deleted_keys(shard);
+    shard->deleted_overflowed = true;
+    return;
+  }
+
+  if (shard->deleted_keys == NULL)
+  {
+    shard->deleted_keys = (char **)malloc(DATABASE_DELTA_MAX_DELETED_KEYS * sizeof(char *));
+    if (!shard->deleted_keys)
+      memory_error_handler(__FILE__, __LINE__, __func__);
+  }
+
+  char *copy = (char *)malloc(strlen(key) + 1);
+
+  if (!copy)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  strcpy(copy, key);
+  shard->deleted_keys[shard->deleted_count++] = copy;
+}
+
+// Must be called with the shard locked.
+void static clear_deleted_keys(DBShard *shard)
+{
+  for (unsigned long i = 0; i < shard->deleted_count; i++)
+    free(shard->deleted_keys[i]);
+  free(shard->deleted_keys);
+  shard->deleted_keys = NULL;
+  shard->deleted_count = 0;
+  shard->deleted_overflowed = false;
+}
+
+bool static has_few_changes()
+{
+  unsigned long items = 0;
+  unsigned long changes = 0;
+  bool overflowed = false;
+
+  for (int i = 0; i < DATABASE_SHARD_COUNT; i++)
+  {
+    pthread_mutex_lock(&shards[i].mutex);
+    items += count_hash_table_items(&shards[i].hash_table);
+    changes += shards[i].dirty_items + shards[i].deleted_count;
+    overflowed = overflowed || shards[i].deleted_overflowed;
+    pthread_mutex_unlock(&shards[i].mutex);
+  }
+
+  return !overflowed && changes * DATABASE_DELTA_MAX_RATIO <= items;
+}
+
+char static *get_delta_filename(const char *filename)
+{
+  char *delta_filename = (char *)malloc(strlen(filename) + sizeof(DATABASE_DELTA_SUFFIX));
+
+  if (!delta_filename)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  strcpy(delta_filename, filename);
+  strcat(delta_filename, DATABASE_DELTA_SUFFIX);
+
+  return delta_filename;
+}
+
+// Detaches a record from the object it was parsed in and takes its member
+// name, which the item copies as its key, so that the record does not keep
+// a second copy of the key. The name is freed with cJSON_free().
+char static *detach_record(cJSON *parent, cJSON *record)
+{
+  char *key = record->string;
+
+  cJSON_DetachItemViaPointer(parent, record);
+  record->string = NULL;
+
+  return key;
+}
+
+// The changes are only applied to the file they were saved from, which is
+// replaced by each full save. Changes left by a full save that did not
+// finish are removed.
+void static load_database_changes(const char *filename)
+{
+  char *delta_filename = get_delta_filename(filename);
+  bool found = false;
+  DBLoadChunk chunk;
+  cJSON *delta = parse_database_file(delta_filename, &found, 1, &chunk) == 1 ? chunk.json : NULL;
+
+  if (delta == NULL)
+  {
+    free(delta_filename);
+    return;
+  }
+
+  struct stat status;
+  cJSON *base = cJSON_GetObjectItem(delta, "base");
+  cJSON *deleted = cJSON_GetObjectItem(delta, "delete");
+  cJSON *set = cJSON_GetObjectItem(delta, "set");
+  cJSON *json = NULL;
+
+  if (stat(filename, &status) != 0 || !cJSON_IsNumber(cJSON_GetObjectItem(base, "inode")) ||
+      !cJSON_IsNumber(cJSON_GetObjectItem(base, "size")) ||
+      cJSON_GetObjectItem(base, "inode")->valuedouble != (double)status.st_ino ||
+      cJSON_GetObjectItem(base, "size")->valuedouble != (double)status.st_size)
+  {
+    printf("Warning: Ignored file %s, it does not match file %s\n", delta_filename, filename);
+    unlink(delta_filename);
+    cJSON_Delete(delta);
+    free(delta_filename);
+    return;
+  }
+
+  cJSON_ArrayForEach(json, deleted)
+  {
+    if (cJSON_IsString(json))
+      delete_item(json->valuestring);
+  }
+  char *key = NULL;
+  while (set != NULL && set->child != NULL)
+  {
+    json = set->child;
+    key = detach_record(set, json);
+    set_item(key, json);
+    cJSON_free(key);
+  }
+  restore_expiries(cJSON_GetObjectItem(delta, "expire"));
+
+  cJSON_Delete(delta);
+  free(delta_filename);
+}
+
+// Must be called with the shard locked.
+void static add_snapshot_entry(DBSnapshot *snapshot, DBItem *item)
+{
+  if (snapshot->count == snapshot->capacity)
+  {
+    snapshot->capacity = snapshot->capacity != 0 ? snapshot->capacity * 2 : 1024;
+    snapshot->entries = (DBSnapshotEntry *)realloc(snapshot->entries, snapshot->capacity * sizeof(DBSnapshotEntry));
+    if (!snapshot->entries)
+      memory_error_handler(__FILE__, __LINE__, __func__);
+  }
+
+  DBSnapshotEntry *entry = &snapshot->entries[snapshot->count];
+  entry->order = snapshot->count++;
+  entry->owned = false;
+  entry->item = item;
+  entry->expires_at = 0;
+  if (item == NULL)
+  {
+    entry->json = NULL;
+    return;
+  }
+
+  // a json replaced meanwhile is kept for the handle, see retire_from_item()
+  __atomic_add_fetch(&item->references, ITEM_HANDLE_REFERENCE, __ATOMIC_SEQ_CST);
+  entry->key = item->key;
+  entry->json = item->json;
+  entry->expires_at = item->expires_at;
+
+  // an evicted json is only read for the save, it stays evicted
+  if (entry->json == NULL)
+  {
+    char *spilled_data = read_spill_record(&__atomic_load_n(&item->extra, __ATOMIC_ACQUIRE)->spilled);
+    entry->json = spilled_data != NULL ? cJSON_Parse(spilled_data) : NULL;
+    entry->owned = true;
+    free(spilled_data);
+    if (entry->json == NULL)
+      file_error_handler(get_spill_filename(), __FILE__, __LINE__, __func__);
+  }
+}
 
-  pthread_mutex_lock(db_mutex);
+void static add_snapshot_deletion(DBSnapshot *snapshot, const char *key)
+{
+  char *copy = (char *)malloc(strlen(key) + 1);
+
+  if (!copy)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  strcpy(copy, key);
+  add_snapshot_entry(snapshot, NULL);
+  snapshot->entries[snapshot->count - 1].key = copy;
+}
+
+// Called by scan_hash_table() with the shard of the item locked. A full
+// snapshot clears the dirty items it takes.
+void static add_to_snapshot(DBItem *item, void *snapshot)
+{
+  DBSnapshot *entries = (DBSnapshot *)snapshot;
+
+  if (is_item_expired(item, entries->now))
+  {
+    if (entries->changes)
+      add_snapshot_deletion(entries, item->key);
+    return;
+  }
+
+  if (entries->changes && !item->dirty)
+    return;
+
+  if (!entries->changes && item->dirty)
+  {
+    item->dirty = false;
+    entries->shard->dirty_items--;
+  }
+  add_snapshot_entry(entries, item);
+}
 
-  // iter hash table and get items, then set to json root
+// The deleted keys of the shard are taken when its scan starts. A key set
+// again since is taken as it is now, with its json.
+void static scan_shard_for_snapshot(DBShard *shard, DBSnapshot *snapshot, int buckets_per_scan, unsigned long pause_us)
+{
+  unsigned long cursor = 0;
+  DBHashedKey hashed_key;
   DBItem *item = NULL;
-  for (int i = 0; i < HASH_TABLE_SIZE; i++)
+
+  snapshot->shard = shard;
+  do
+  {
+    pthread_mutex_lock(&shard->mutex);
+    expire_shard_items(shard, get_time_ms());
+    if (cursor == 0 && snapshot->changes)
+    {
+      for (unsigned long i = 0; i < shard->deleted_count; i++)
+      {
+        hashed_key = hash_key(shard->deleted_keys[i]);
+        item = find_item_in_hash_table(&shard->hash_table, &hashed_key);
+        if (item != NULL && !is_item_expired(item, snapshot->now))
+          add_snapshot_entry(snapshot, item);
+        else
+          add_snapshot_deletion(snapshot, shard->deleted_keys[i]);
+      }
+    }
+    else if (cursor == 0)
+    {
+      clear_deleted_keys(shard);
+    }
+
+    for (int i = 0; i < buckets_per_scan; i++)
+    {
+      cursor = scan_hash_table(&shard->hash_table, cursor, add_to_snapshot, snapshot);
+      if (cursor == 0)
+        break;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (cursor != 0 && pause_us != 0)
+      usleep(pause_us);
+  } while (cursor != 0);
+}
+
+int static compare_snapshot_entries(const void *a, const void *b)
+{
+  const DBSnapshotEntry *entry_a = (const DBSnapshotEntry *)a;
+  const DBSnapshotEntry *entry_b = (const DBSnapshotEntry *)b;
+  int result = strcmp(entry_a->key, entry_b->key);
+
+  if (result != 0)
+    return result;
+
+  return entry_a->order < entry_b->order ? -1 : entry_a->order > entry_b->order;
+}
+
+// The entries are sorted by key, so that a key visited twice by the scan is
+// saved once, as it was last seen. The changes are saved with the inode and
+// the size of the file they apply to, `base_status`, NULL for a full save.
+// The expiries are saved on the wall clock after the records, in
+// DATABASE_EXPIRY_MEMBER for a full save, whose keys that look like it are
+// saved with one more '$', see match_expiry_member().
+cJSON static *build_snapshot_json(DBSnapshot *snapshot, const struct stat *base_status)
+{
+  cJSON *json_root = cJSON_CreateObject();
+  cJSON *set = json_root;
+  cJSON *deleted = NULL;
+  cJSON *expiries = cJSON_CreateObject();
+  DBSnapshotEntry *entry = NULL;
+  uint64_t offset = get_wall_clock_offset();
+  char *name = NULL;
+
+  if (base_status != NULL)
+  {
+    cJSON *base = cJSON_AddObjectToObject(json_root, "base");
+    cJSON_AddNumberToObject(base, "inode", (double)base_status->st_ino);
+    cJSON_AddNumberToObject(base, "size", (double)base_status->st_size);
+    set = cJSON_AddObjectToObject(json_root, "set");
+    deleted = cJSON_AddArrayToObject(json_root, "delete");
+  }
+
+  qsort(snapshot->entries, snapshot->count, sizeof(DBSnapshotEntry), compare_snapshot_entries);
+  for (unsigned long i = 0; i < snapshot->count; i++)
   {
-    item = hash_table[i];
-    while (item != NULL)
+    entry = &snapshot->entries[i];
+    name = (char *)entry->key;
+    if (entry->json != NULL && base_status == NULL && match_expiry_member(entry->key) != 0)
+    {
+      name = (char *)malloc(strlen(entry->key) + 2);
+      if (!name)
+        memory_error_handler(__FILE__, __LINE__, __func__);
+      name[0] = '$';
+      strcpy(name + 1, entry->key);
+    }
+
+    if (i + 1 < snapshot->count && strcmp(entry->key, snapshot->entries[i + 1].key) == 0)
+    {
+      if (entry->owned)
+        cJSON_Delete(entry->json);
+    }
+    else if (entry->json == NULL)
     {
-      cJSON_AddItemReferenceToObject(json_root, item->key, item->json);
-      item = item->next;
+      cJSON_AddItemToArray(deleted, cJSON_CreateString(entry->key));
     }
+    else
+    {
+      if (entry->owned)
+        cJSON_AddItemToObject(set, name, entry->json);
+      else
+        cJSON_AddItemReferenceToObject(set, name, entry->json);
+      if (entry->expires_at != 0)
+        cJSON_AddNumberToObject(expiries, entry->key, (double)(entry->expires_at + offset));
+    }
+
+    if (name != entry->key)
+      free(name);
+    if (entry->json == NULL)
+      free((char *)entry->key);
+  }
+
+  if (expiries->child != NULL)
+    cJSON_AddItemToObject(json_root, base_status != NULL ? "expire" : DATABASE_EXPIRY_MEMBER, expiries);
+  else
+    cJSON_Delete(expiries);
+
+  return json_root;
+}
+
+// The data is written to a temporary file that replaces the file once it is
+// on disk, so that a crash keeps the previous one.
+bool static write_file_atomically(const char *filename, const char *data)
+{
+  char *temporary_filename = (char *)malloc(strlen(filename) + sizeof(DATABASE_TEMPORARY_SUFFIX));
+
+  if (!temporary_filename)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  strcpy(temporary_filename, filename);
+  strcat(temporary_filename, DATABASE_TEMPORARY_SUFFIX);
+
+  FILE *file = fopen(temporary_filename, "w");
+  bool saved = file != NULL && data != NULL && fputs(data, file) >= 0;
+  if (file != NULL)
+  {
+    saved = fflush(file) == 0 && saved && fsync(fileno(file)) == 0;
+    saved = fclose(file) == 0 && saved && rename(temporary_filename, filename) == 0;
+    if (!saved)
+      unlink(temporary_filename);
   }
-  pthread_mutex_unlock(db_mutex);
+  if (!saved)
+    printf("Warning: Failed to write file %s\n", filename);
 
+  free(temporary_filename);
+  return saved;
+}
+
+// The writes logged until the save are moved aside first, and removed once
+// it is done. The scan locks a shard for `buckets_per_scan` buckets at a
+// time, so the save is not a single view of the database: a write made
+// during the save may or may not be in it, and is replayed from the log on
+// top of it.
+//
+// The items and their jsons are only referenced, the handles taken by the
+// scan keep those replaced or deleted meanwhile until the save is printed.
+// Nothing else is kept from being freed while the scan pauses between
+// batches, each of which holds the lock of its shard.
+void static write_snapshot(const char *filename, bool changes, int buckets_per_scan, unsigned long pause_us)
+{
+  struct stat base_status;
+
+  pthread_once(&shards_once, init_shards);
+  pthread_mutex_lock(&snapshot_mutex);
+  changes = changes && base_filename != NULL && strcmp(base_filename, filename) == 0 &&
+            stat(filename, &base_status) == 0 && has_few_changes();
+
+  bool log_rotated = is_write_log_open() && rotate_write_log();
+  DBSnapshot snapshot = {NULL, 0, 0, get_time_ms(), changes, NULL};
+
+  for (int i = 0; i < DATABASE_SHARD_COUNT; i++)
+    scan_shard_for_snapshot(&shards[i], &snapshot, buckets_per_scan, pause_us);
+
+  cJSON *json_root = build_snapshot_json(&snapshot, changes ? &base_status : NULL);
   char *data = cJSON_Print(json_root);
   cJSON_Delete(json_root);
-  if (data)
+  for (unsigned long i = 0; i < snapshot.count; i++)
+    release_item(snapshot.entries[i].item);
+  free(snapshot.entries);
+
+  char *delta_filename = get_delta_filename(filename);
+  bool saved = write_file_atomically(changes ? delta_filename : filename, data);
+  free(data);
+
+  // the dirty items were cleared by the scan, the changes are tracked from
+  // the new file
+  if (!changes)
   {
-    fprintf(file, "%s", data);
-    free(data);
+    free(base_filename);
+    base_filename = NULL;
+  }
+  if (!changes && saved)
+  {
+    unlink(delta_filename);
+    base_filename = (char *)malloc(strlen(filename) + 1);
+    if (!base_filename)
+      memory_error_handler(__FILE__, __LINE__, __func__);
+    strcpy(base_filename, filename);
+  }
+  if (saved && log_rotated)
+    remove_rotated_write_log();
+  pthread_mutex_unlock(&snapshot_mutex);
+  free(delta_filename);
+}
+
+void save_database(const char *filename)
+{
+  write_snapshot(filename, false, INT_MAX, 0);
+}
+
+void save_database_changes(const char *filename)
+{
+  write_snapshot(filename, true, INT_MAX, 0);
+}
+
+// The waits of the checkpointer are timed on the monotonic clock.
+void static init_checkpointer()
+{
+  pthread_condattr_t attributes;
+
+  pthread_condattr_init(&attributes);
+  pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+  pthread_cond_init(&checkpointer_cond, &attributes);
+  pthread_condattr_destroy(&attributes);
+}
+
+// A checkpoint is skipped when nothing was logged since the previous one.
+void static *run_checkpointer(void *data)
+{
+  struct timespec deadline;
+  unsigned long checkpointed_records = get_write_log_stats().records;
+  unsigned long records = 0;
+
+  pthread_mutex_lock(&checkpointer_mutex);
+  get_deadline(&deadline, checkpoint_interval_ms);
+  while (!checkpointer_stopping)
+  {
+    if (pthread_cond_timedwait(&checkpointer_cond, &checkpointer_mutex, &deadline) != ETIMEDOUT)
+      continue;
+
+    records = get_write_log_stats().records;
+    if (records != checkpointed_records)
+    {
+      pthread_mutex_unlock(&checkpointer_mutex);
+      write_snapshot(checkpoint_filename, true, DATABASE_CHECKPOINT_SCAN_BUCKETS, DATABASE_CHECKPOINT_PAUSE_US);
+      COUNT_OPERATIONS(checkpoints, 1);
+      pthread_mutex_lock(&checkpointer_mutex);
+      checkpointed_records = records;
+    }
+    get_deadline(&deadline, checkpoint_interval_ms);
+  }
+  pthread_mutex_unlock(&checkpointer_mutex);
+
+  return data;
+}
+
+bool start_checkpointer(const char *filename, unsigned long interval_ms)
+{
+  stop_checkpointer();
+  pthread_once(&checkpointer_once, init_checkpointer);
+
+  char *copy = (char *)malloc(strlen(filename) + 1);
+
+  if (!copy)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  strcpy(copy, filename);
+
+  pthread_mutex_lock(&checkpointer_mutex);
+  checkpoint_filename = copy;
+  checkpoint_interval_ms = interval_ms;
+  checkpointer_stopping = false;
+  checkpointer_running = pthread_create(&checkpointer_thread, NULL, run_checkpointer, NULL) == 0;
+  if (!checkpointer_running)
+  {
+    printf("Warning: Failed to start the checkpointer of file %s\n", filename);
+    free(checkpoint_filename);
+    checkpoint_filename = NULL;
+  }
+  pthread_mutex_unlock(&checkpointer_mutex);
+
+  return checkpointer_running;
+}
+
+// Waits for a checkpoint being written.
+void stop_checkpointer()
+{
+  pthread_mutex_lock(&checkpointer_mutex);
+  if (!checkpointer_running)
+  {
+    pthread_mutex_unlock(&checkpointer_mutex);
+    return;
   }
-  fclose(file);
+
+  checkpointer_stopping = true;
+  pthread_cond_signal(&checkpointer_cond);
+  pthread_mutex_unlock(&checkpointer_mutex);
+  pthread_join(checkpointer_thread, NULL);
+
+  pthread_mutex_lock(&checkpointer_mutex);
+  checkpointer_running = false;
+  free(checkpoint_filename);
+  checkpoint_filename = NULL;
+  pthread_mutex_unlock(&checkpointer_mutex);
+}
+
+bool open_database_log(const char *filename)
+{
+  char *rotated_filename = (char *)malloc(strlen(filename) + sizeof(WRITE_LOG_ROTATED_SUFFIX));
+
+  if (!rotated_filename)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  strcpy(rotated_filename, filename);
+  strcat(rotated_filename, WRITE_LOG_ROTATED_SUFFIX);
+
+  // the writes of a save that did not finish come first
+  close_write_log();
+  replay_write_log(rotated_filename, apply_log_record, rotated_filename);
+  replay_write_log(filename, apply_log_record, (void *)filename);
+  free(rotated_filename);
+
+  return open_write_log(filename);
+}
+
+void close_database_log()
+{
+  close_write_log();
 }
@@ -2,28 +2,135 @@
 #define CCH137_DATABASE_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <pthread.h>
 #include "./cJSON.h"
+#include "./skiplist.h"
+#include "./spill.h"
+#include "./wal.h"
 
 #define DATABASE_FILENAME "database.json"
-
-extern pthread_mutex_t *db_mutex;
+// The expiries of the items are saved in this member of the file, as wall
+// clock times. A key made of '$' characters followed by "expire" is saved
+// with one more '$'.
+#define DATABASE_EXPIRY_MEMBER "$expire"
+// The writes made since the last save are logged there.
+#define DATABASE_LOG_FILENAME "database.wal"
+// A save is written there first, next to the file it replaces.
+#define DATABASE_TEMPORARY_SUFFIX ".tmp"
+// The database is checkpointed by the program at this interval.
+#define DATABASE_CHECKPOINT_INTERVAL_MS 60000
+// A checkpoint locks a shard for this many buckets at a time, and pauses
+// between them, so that the writes wait little for it.
+#define DATABASE_CHECKPOINT_SCAN_BUCKETS 256
+#define DATABASE_CHECKPOINT_PAUSE_US 200
+// The changes saved since the last full save are written there, next to it.
+#define DATABASE_DELTA_SUFFIX ".delta"
+// The database is saved in full once more than 1 / this of its items changed.
+#define DATABASE_DELTA_MAX_RATIO 4
+// Past this many deleted keys in a shard, the next save is a full one.
+#define DATABASE_DELTA_MAX_DELETED_KEYS 4096
+// A file is loaded by up to this many threads, each one parsing and
+// inserting a chunk of at least DATABASE_LOAD_CHUNK_BYTES of its records.
+#define DATABASE_LOAD_MAX_THREADS 16
+#define DATABASE_LOAD_CHUNK_BYTES (4 << 20)
+// Json payloads evicted by the memory budget are written there.
+#define DATABASE_SPILL_FILENAME "database.spill"
+// The items are partitioned into independently locked shards by key hash.
+#define DATABASE_SHARD_BITS 4
+#define DATABASE_SHARD_COUNT (1 << DATABASE_SHARD_BITS)
+// Keys shorter than this are stored inside the item.
+#define DATABASE_INLINE_KEY_SIZE 24
 
 // items
 
+// The fields of the few items that were evicted, that expire, or that had a
+// pointer replaced while handles were out, so that the other items do not
+// carry them.
+typedef struct DBItemExtra
+{
+  // the json as written in the spill file, until it is replaced
+  DBSpillRecord spilled;
+  // in the timing wheel of the shard while the item expires
+  struct DBTimer *timer;
+  // replaced keys that a handle may still be reading
+  struct DBStalePointer *stale;
+} DBItemExtra;
+
 typedef struct DBItem
 {
   char *key;
+  // the full hash and the length of the key, compared before the key bytes
+  uint64_t hash;
+  size_t key_length;
+  // key points here when the item was created with a short key
+  char inline_key[DATABASE_INLINE_KEY_SIZE];
+  // NULL while the json is evicted, it is read back from `extra->spilled`
   cJSON *json;
   struct DBItem *next;
+  // size of the json, for the stats
+  unsigned int json_nodes;
+  unsigned int json_string_bytes;
+  // monotonic time in milliseconds, 0 if the item does not expire
+  uint64_t expires_at;
+  // 1 while the item is in the table plus 2 per handle, freed at zero
+  unsigned long references;
+  // NULL until one of its fields is needed, created with the shard locked
+  DBItemExtra *extra;
+  // set by the lookups and cleared by the clock hand of the memory budget
+  bool referenced;
+  // set or renamed since the last full save, see save_database_changes()
+  bool dirty;
 } DBItem;
 
 bool exists(const char *key);
+// The returned item may be freed by a concurrent delete_item, and its json
+// evicted again by the memory budget, use acquire_item to keep them valid.
 DBItem *get_item(const char *key);
+// Returns the item with a handle that keeps it, its key and its json valid
+// until release_item is called, even if it is deleted meanwhile.
+DBItem *acquire_item(const char *key);
+void release_item(DBItem *item);
 DBItem *set_item(const char *key, cJSON *json);
 DBItem *rename_item(const char *old_key, const char *new_key);
 bool delete_item(const char *key);
 
+// expiry
+
+// Sets the item like set_item, and deletes it once `ttl` milliseconds have
+// passed, 0 for no expiry. set_item and set_items remove the expiry, a
+// rename keeps it. An expired item is absent for every operation, and it is
+// freed by the timing wheel of its shard, which is moved on by the writers
+// of the shard and by expire_items(). Keys listed from the key index may
+// still include expired items that were not freed yet. The expiry is saved
+// and logged on the wall clock, so it is kept across a restart, and an item
+// that expired meanwhile is deleted when it is loaded.
+DBItem *set_item_with_ttl(const char *key, cJSON *json, unsigned long ttl);
+// Milliseconds left before the item expires, -1 if it does not expire and
+// -2 if it does not exist.
+long get_item_ttl(const char *key);
+// Frees the expired items of every shard, returns their number.
+unsigned long expire_items();
+
+// Lookups of get_item, exists, acquire_item and get_items check a Bloom
+// filter of the shard first. Among the absent keys that were looked up, the
+// false positive rate is false_positives / (rejected + false_positives).
+typedef struct DBFilterStats
+{
+  unsigned long lookups;
+  unsigned long rejected;
+  unsigned long false_positives;
+} DBFilterStats;
+
+DBFilterStats get_filter_stats();
+
+// Batch variants, every key is hashed once and the keys are grouped by shard
+// so that each shard is locked once. The result of keys[i] is stored at i.
+int get_items(const char **keys, int count, DBItem **items);
+int set_items(const char **keys, cJSON **jsons, int count, DBItem **items);
+int delete_items(const char **keys, int count, bool *results);
+
 // models
 
 #define DBModel_ArrayTypeSymbol NULL
@@ -63,12 +170,154 @@ typedef struct DBKeys
 
 DBKeys *get_model_keys(DBModel *model);
 DBKeys *get_cjson_keys(cJSON *json);
+// The keys of the database are listed in order, and copied so that they stay
+// valid until free_keys().
 DBKeys *get_database_keys();
 void free_keys(DBKeys *keys);
 
+// Visits the items of `count` buckets starting at `cursor`, 0 to start, and
+// returns the cursor of the next call, 0 when every item was visited. Items
+// that stay in the database during the whole scan are visited at least once,
+// others may or may not be, and an item may be visited twice if the tables
+// are resized meanwhile. The callback is called with the shard of the item
+// locked, so it must not modify the database. The json of an evicted item is
+// NULL.
+unsigned long scan_database(unsigned long cursor, int count, void (*callback)(DBItem *item, void *data), void *data);
+
+// ordered keys
+
+// Iterates the keys of the database in byte order, see DBSkipListIterator.
+typedef DBSkipListIterator DBKeyIterator;
+
+// Keys from `start` included to `end` excluded, NULL for no bound.
+DBKeyIterator scan_database_range(const char *start, const char *end);
+DBKeyIterator scan_database_prefix(const char *prefix);
+// Returns NULL when the iteration is done.
+const char *next_database_key(DBKeyIterator *iterator);
+// Only needed when the iteration is stopped before the last key.
+void close_database_iterator(DBKeyIterator *iterator);
+
+// stats
+
+#define DATABASE_STATS_PROBE_LENGTHS 8
+
+// Computed from counters kept up to date by the writers and from a sample of
+// the positions of each table, so that it is cheap enough to be polled. The
+// lookups are counted by each reading thread on its own cache line, and
+// added up here.
+typedef struct DBStats
+{
+  unsigned long items;
+
+  // tables
+  unsigned long table_positions;
+  unsigned long rehashing_tables;
+  // probe_lengths[i] is the number of sampled positions with i items in the
+  // chain, or for open addressing with an item i - 1 slots after the slot of
+  // its hash, 0 for a free slot. The last one counts every longer length.
+  unsigned long sampled_positions;
+  unsigned long probe_lengths[DATABASE_STATS_PROBE_LENGTHS];
+
+  // bytes in use by category, the extra fields counted with the items
+  unsigned long item_bytes;
+  unsigned long key_bytes;
+  unsigned long json_nodes;
+  unsigned long json_string_bytes;
+  // nodes and strings, evicted jsons and pooled names are not counted
+  unsigned long json_bytes;
+  unsigned long table_bytes;
+  unsigned long filter_bytes;
+  unsigned long index_bytes;
+  // member names of the jsons, shared by every item
+  unsigned long interned_names;
+  unsigned long intern_bytes;
+  // bytes of the chunks of the item and key allocators, used or not
+  unsigned long reserved_bytes;
+
+  // memory budget
+  unsigned long evicted_items;
+  unsigned long spill_bytes;
+  unsigned long evictions;
+  unsigned long reloads;
+
+  // expiry
+  unsigned long expiring_items;
+  unsigned long expirations;
+
+  // changes since the last full save
+  unsigned long dirty_items;
+  unsigned long deleted_keys;
+
+  // operations since the start
+  unsigned long lookups;
+  unsigned long inserts;
+  unsigned long updates;
+  unsigned long renames;
+  unsigned long deletes;
+  DBFilterStats filter;
+  DBWriteLogStats write_log;
+  unsigned long checkpoints;
+} DBStats;
+
+DBStats db_stats();
+
+// memory budget
+
+// Evicts the json of the items to a spill file, see set_memory_spill_file(),
+// while the json of the database takes more than `bytes`, as counted by
+// db_stats(), 0 for no budget. A clock hand over the shards picks items that
+// were not looked up since its last pass, so that cold items go first. Keys
+// stay in memory, so exists() never reads the file, and get_item,
+// acquire_item and get_items read an evicted json back. Items with a handle
+// are never evicted. The budget is enforced before a lookup reads a json
+// back, so that the json returned is not evicted by the same call, and it
+// may be exceeded by the jsons read back until the next call.
+// Returns false if the spill file can not be opened.
+bool set_memory_budget(unsigned long bytes);
+// The evicted jsons are written to `filename` instead of
+// DATABASE_SPILL_FILENAME. The spill file is created by the first budget set
+// and kept until the program exits, so it must be called before.
+void set_memory_spill_file(const char *filename);
+
 // database
 
+// The file is split between threads at the commas between its records, see
+// set_database_load_threads(), and the chunks are parsed and inserted
+// concurrently. Nothing is loaded if a chunk can not be parsed. The changes
+// saved by save_database_changes() are applied on top of the file, unless it
+// was fully saved again since.
 void load_database(const char *filename);
+// 0, the default, for a thread per online processor, as long as each one
+// loads DATABASE_LOAD_CHUNK_BYTES of the file. Capped at
+// DATABASE_LOAD_MAX_THREADS.
+void set_database_load_threads(int threads);
 void save_database(const char *filename);
+// Only writes the items set, renamed and deleted since `filename` was last
+// fully saved or loaded, to `filename` with DATABASE_DELTA_SUFFIX. Each call
+// writes all of them again, and save_database() removes them. Saves in full
+// when `filename` is not the last file fully saved or loaded, or when there
+// are too many changes, see DATABASE_DELTA_MAX_RATIO.
+void save_database_changes(const char *filename);
+
+// Replays the writes logged in `filename` onto the loaded database, then logs
+// every set, rename and delete there until it is closed, so that they are not
+// lost if the program stops before the next save. The log only holds the
+// writes made since the last save, so the database must be saved to the
+// file it was loaded from while the log is open. An item is logged as
+// deleted when it expires. With DBLogSync_Always, the writes
+// return once their record is on disk, see set_write_log_sync_policy().
+// Returns false if the log can not be opened.
+bool open_database_log(const char *filename);
+void close_database_log();
+
+// Saves the database to `filename` with save_database_changes() from a
+// background thread every `interval_ms` while something was logged since the
+// previous checkpoint, so that the log to replay stays short. The checkpoints
+// are throttled, see DATABASE_CHECKPOINT_SCAN_BUCKETS, and are serialized
+// with the other saves.
+// Returns false if the thread can not be started.
+bool start_checkpointer(const char *filename, unsigned long interval_ms);
+// Waits for the checkpoint being written, if any.
+void stop_checkpointer();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "./utils.h"
+#include "./epoch.h"
+
+// Try to advance the epoch after this many pointers were retired.
+#define EPOCH_RECLAIM_THRESHOLD 64
+// Pointers retired in epoch e are freed when the epoch reaches e + 2, so
+// three lists are enough.
+#define EPOCH_LIST_COUNT 3
+
+typedef struct DBEpochRecord
+{
+  // (epoch << 1) | 1 while the thread is inside an epoch, 0 otherwise
+  unsigned long state;
+  // 1 while the record is owned by a thread
+  int in_use;
+  struct DBEpochRecord *next;
+} DBEpochRecord;
+
+typedef struct DBRetiredPointer
+{
+  void *pointer;
+  void (*free_pointer)(void *pointer);
+  struct DBRetiredPointer *next;
+} DBRetiredPointer;
+
+unsigned long global_epoch = 0;
+// Records are never freed, a record released by an exited thread is reused.
+DBEpochRecord *epoch_records = NULL;
+pthread_mutex_t epoch_records_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t epoch_record_key;
+pthread_once_t epoch_record_key_once = PTHREAD_ONCE_INIT;
+
+// The retired lists are only touched with the mutex locked.
+DBRetiredPointer *retired_lists[EPOCH_LIST_COUNT] = {NULL};
+int retired_since_reclaim = 0;
+pthread_mutex_t retired_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+__thread DBEpochRecord *current_record = NULL;
+__thread int current_nesting = 0;
+
+void static release_record(void *record);
+void static init_record_key();
+DBEpochRecord static *acquire_record();
+bool static try_advance_epoch();
+void static free_retired_list(DBRetiredPointer *list);
+
+void static release_record(void *record)
+{
+  __atomic_store_n(&((DBEpochRecord *)record)->state, 0, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&((DBEpochRecord *)record)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+void static init_record_key()
+{
+  pthread_key_create(&epoch_record_key, release_record);
+}
+
+DBEpochRecord static *acquire_record()
+{
+  pthread_once(&epoch_record_key_once, init_record_key);
+
+  // reuse the record of an exited thread if there is one
+  DBEpochRecord *record = __atomic_load_n(&epoch_records, __ATOMIC_ACQUIRE);
+  int expected = 0;
+  while (record != NULL)
+  {
+    expected = 0;
+    if (__atomic_compare_exchange_n(&record->in_use, &expected, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      break;
+    record = record->next;
+  }
+
+  if (record == NULL)
+  {
+    record = (DBEpochRecord *)malloc(sizeof(DBEpochRecord));
+
+    if (!record)
+      memory_error_handler(__FILE__, __LINE__, __func__);
+
+    record->state = 0;
+    record->in_use = 1;
+    pthread_mutex_lock(&epoch_records_mutex);
+    record->next = epoch_records;
+    __atomic_store_n(&epoch_records, record, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&epoch_records_mutex);
+  }
+
+  pthread_setspecific(epoch_record_key, record);
+  return record;
+}
+
+void enter_epoch()
+{
+  if (current_nesting++ > 0)
+    return;
+
+  if (current_record == NULL)
+    current_record = acquire_record();
+
+  unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&current_record->state, (epoch << 1) | 1, __ATOMIC_SEQ_CST);
+  // the shared pointers must not be read before the record is published
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void exit_epoch()
+{
+  if (--current_nesting > 0)
+    return;
+
+  __atomic_store_n(&current_record->state, 0, __ATOMIC_RELEASE);
+}
+
+// The epoch can only advance when every thread inside an epoch has seen the
+// current one. Must be called with the retired mutex locked.
+bool static try_advance_epoch()
+{
+  unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+  unsigned long state = 0;
+
+  for (DBEpochRecord *record = __atomic_load_n(&epoch_records, __ATOMIC_ACQUIRE); record != NULL; record = record->next)
+  {
+    state = __atomic_load_n(&record->state, __ATOMIC_SEQ_CST);
+    if ((state & 1) && (state >> 1) != epoch)
+      return false;
+  }
+
+  __atomic_store_n(&global_epoch, epoch + 1, __ATOMIC_SEQ_CST);
+  return true;
+}
+
+void static free_retired_list(DBRetiredPointer *list)
+{
+  DBRetiredPointer *next = NULL;
+  while (list != NULL)
+  {
+    next = list->next;
+    list->free_pointer(list->pointer);
+    free(list);
+    list = next;
+  }
+}
+
+void retire_pointer(void *pointer, void (*free_pointer)(void *pointer))
+{
+  if (pointer == NULL)
+    return;
+
+  DBRetiredPointer *retired = (DBRetiredPointer *)malloc(sizeof(DBRetiredPointer));
+
+  if (!retired)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  retired->pointer = pointer;
+  retired->free_pointer = free_pointer;
+
+  pthread_mutex_lock(&retired_mutex);
+  unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+  retired->next = retired_lists[epoch % EPOCH_LIST_COUNT];
+  retired_lists[epoch % EPOCH_LIST_COUNT] = retired;
+  bool should_reclaim = ++retired_since_reclaim >= EPOCH_RECLAIM_THRESHOLD;
+  pthread_mutex_unlock(&retired_mutex);
+
+  if (should_reclaim)
+    reclaim_retired_pointers();
+}
+
+// Frees every retired pointer that can no longer be seen by any reader.
+void reclaim_retired_pointers()
+{
+  DBRetiredPointer *freeable = NULL;
+
+  pthread_mutex_lock(&retired_mutex);
+  retired_since_reclaim = 0;
+  if (try_advance_epoch())
+  {
+    // the list of epoch - 2 is the one that the new epoch will reuse
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    freeable = retired_lists[epoch % EPOCH_LIST_COUNT];
+    retired_lists[epoch % EPOCH_LIST_COUNT] = NULL;
+  }
+  pthread_mutex_unlock(&retired_mutex);
+
+  // free outside of the lock, freeing may retire more pointers
+  free_retired_list(freeable);
+}
@@ -0,0 +1,15 @@
+#ifndef CCH137_EPOCH_H
+#define CCH137_EPOCH_H
+
+// Epoch based reclamation.
+// Readers call enter_epoch() before reading shared pointers without a lock
+// and exit_epoch() when done. Writers unlink a pointer first and then pass it
+// to retire_pointer(), it is freed once every reader that could have seen it
+// has exited its epoch.
+
+void enter_epoch();
+void exit_epoch();
+void retire_pointer(void *pointer, void (*free_pointer)(void *pointer));
+void reclaim_retired_pointers();
+
+#endif
@@ -0,0 +1,909 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "./utils.h"
+#include "./epoch.h"
+#include "./database.h"
+#include "./hashtable.h"
+
+// Odd constants with well mixed bits, used to spread the words of the key.
+#define HASH_PRIME_0 0xa0761d6478bd642fULL
+#define HASH_PRIME_1 0xe7037ed1a0b428dbULL
+#define HASH_PRIME_2 0x8ebc6af09c88c6e3ULL
+#define HASH_WORD_SIZE sizeof(uint64_t)
+// The end of the key is found in the words it is hashed with, a byte of
+// HASH_HIGHS is set in (word - HASH_ONES) & ~word for each zero byte.
+#define HASH_ONES 0x0101010101010101ULL
+#define HASH_HIGHS 0x8080808080808080ULL
+// The smallest page size, a word read within one can not fault.
+#define HASH_PAGE_SIZE 4096
+
+// The table size is always a power of two so that positions can be selected
+// with a mask instead of a modulo.
+#define HASH_TABLE_INITIAL_SIZE 16
+#ifdef DB_OPEN_ADDRESSING
+// Grow when more than 7/8 of the slots are used or deleted, so that probing
+// always reaches an empty slot quickly.
+#define HASH_TABLE_MAX_LOAD_NUMERATOR 7
+#define HASH_TABLE_MAX_LOAD_DENOMINATOR 8
+#else
+// Grow when there is more than one item per bucket on average.
+#define HASH_TABLE_MAX_LOAD_NUMERATOR 1
+#define HASH_TABLE_MAX_LOAD_DENOMINATOR 1
+#endif
+// Shrink when less than 1/HASH_TABLE_SHRINK_RATIO of the positions are used.
+#define HASH_TABLE_SHRINK_RATIO 10
+// Number of positions moved from the old table to the new one per operation.
+#define HASH_TABLE_REHASH_STEP 1
+// Max number of empty positions visited per rehash step, so that a sparse old
+// table can not make a single operation slow.
+#ifdef DB_OPEN_ADDRESSING
+// empty slots are skipped by their control byte, a cache line per step
+#define HASH_TABLE_REHASH_EMPTY_VISITS (HASH_TABLE_REHASH_STEP * 64)
+#else
+#define HASH_TABLE_REHASH_EMPTY_VISITS (HASH_TABLE_REHASH_STEP * 10)
+#endif
+
+#ifdef DB_OPEN_ADDRESSING
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xFE
+// full slots store a 7-bit fingerprint, so the high bit is clear
+#define IS_CONTROL_FULL(control) (((control) & 0x80) == 0)
+#endif
+
+// Everything that lookups read without a lock is published with these.
+#define LOAD_SHARED(pointer) __atomic_load_n(pointer, __ATOMIC_ACQUIRE)
+#define STORE_SHARED(pointer, value) __atomic_store_n(pointer, value, __ATOMIC_RELEASE)
+
+uint64_t static mix_hash(uint64_t a, uint64_t b);
+uint64_t static read_hash_word(const unsigned char *bytes);
+void static init_hash_seed();
+bool static is_item_key(DBItem *item, const DBHashedKey *key);
+DBTable static *create_table(unsigned long size);
+void static free_table(void *table);
+unsigned long static get_table_load(DBTable *table);
+bool static is_table_overloaded(DBTable *table, unsigned long extra);
+DBItem static *find_in_table(DBTable *table, const DBHashedKey *key);
+DBItem static *probe_table(DBTable *table, const DBHashedKey *key, unsigned long *insert_index);
+void static insert_into_table_at(DBTable *table, unsigned long index, DBItem *item);
+void static insert_into_table(DBTable *table, DBItem *item);
+DBItem static *remove_from_table(DBTable *table, const DBHashedKey *key);
+DBItem static *first_item_at(DBTable *table, unsigned long index);
+void static scan_bucket(DBTable *table, unsigned long bucket, void (*callback)(DBItem *item, void *data), void *data);
+unsigned long static get_probe_length(DBTable *table, unsigned long index);
+size_t static get_table_bytes(DBTable *table);
+unsigned long static reverse_bits(unsigned long value);
+unsigned long static next_scan_cursor(unsigned long cursor, unsigned long mask);
+DBItem static *take_items_at(DBTable *table, unsigned long index);
+bool static is_rehashing(DBHashTable *hash_table);
+void static rehash_step(DBHashTable *hash_table, int steps);
+unsigned long static get_target_size(unsigned long used);
+void static resize_hash_table_if_needed(DBHashTable *hash_table);
+DBTable static *prepare_insert(DBHashTable *hash_table);
+
+// Keys of the database may come from untrusted imports, so the hash is seeded
+// per process and a set of colliding keys can not be prepared in advance.
+uint64_t hash_seed = 0;
+pthread_once_t hash_seed_once = PTHREAD_ONCE_INIT;
+// set once the seed is ready, so that hashing does not call pthread_once
+bool hash_seed_ready = false;
+
+// Multiplies into 128 bits and folds the halves, so that every bit of the
+// inputs affects every bit of the result.
+uint64_t static mix_hash(uint64_t a, uint64_t b)
+{
+  __uint128_t product = (__uint128_t)a * b;
+  return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+// Reads a word of the key with a single load, which may go past its end
+// but never into the next page, so the sanitizers are told not to check
+// it. At the end of a page, the bytes are read one at a time up to the
+// end of the key, and the missing ones are zero. The first byte of the key
+// is the lowest byte of the word.
+__attribute__((no_sanitize_address, no_sanitize_thread)) uint64_t static read_hash_word(const unsigned char *bytes)
+{
+  uint64_t word = 0;
+
+  if (((uintptr_t)bytes & (HASH_PAGE_SIZE - 1)) <= HASH_PAGE_SIZE - HASH_WORD_SIZE)
+  {
+    memcpy(&word, bytes, HASH_WORD_SIZE);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+  }
+
+  for (size_t i = 0; i < HASH_WORD_SIZE && bytes[i] != '\0'; i++)
+    word |= (uint64_t)bytes[i] << (i * 8);
+  return word;
+}
+
+void static init_hash_seed()
+{
+  FILE *random_file = fopen("/dev/urandom", "rb");
+
+  if (random_file == NULL || fread(&hash_seed, sizeof(hash_seed), 1, random_file) != 1)
+    hash_seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32) ^ (uint64_t)(uintptr_t)&hash_seed;
+
+  if (random_file != NULL)
+    fclose(random_file);
+
+  hash_seed = mix_hash(hash_seed ^ HASH_PRIME_0, HASH_PRIME_1);
+  __atomic_store_n(&hash_seed_ready, true, __ATOMIC_RELEASE);
+}
+
+// Seeded hash that reads the key a word at a time, in a single pass that
+// finds its length too. The word holding the end of the key is masked to
+// the bytes before it, and mixed with the length.
+DBHashedKey hash_key(const char *key)
+{
+  DBHashedKey hashed_key = {key, 0, 0};
+
+  if (key == NULL)
+    return hashed_key;
+
+  if (!__atomic_load_n(&hash_seed_ready, __ATOMIC_ACQUIRE))
+    pthread_once(&hash_seed_once, init_hash_seed);
+
+  const unsigned char *cursor = (const unsigned char *)key;
+  uint64_t seed = hash_seed;
+  uint64_t hash_value = seed;
+  uint64_t word = read_hash_word(cursor);
+  uint64_t zeros = (word - HASH_ONES) & ~word & HASH_HIGHS;
+
+  while (zeros == 0)
+  {
+    hash_value = mix_hash(word ^ seed, hash_value ^ HASH_PRIME_1);
+    cursor += HASH_WORD_SIZE;
+    word = read_hash_word(cursor);
+    zeros = (word - HASH_ONES) & ~word & HASH_HIGHS;
+  }
+
+  // the lowest byte flagged is the first zero byte
+  size_t tail = (size_t)__builtin_ctzll(zeros) / 8;
+  size_t length = (size_t)(cursor - (const unsigned char *)key) + tail;
+  word &= tail == 0 ? 0 : ~0ULL >> (64 - tail * 8);
+  hash_value = mix_hash(word ^ seed ^ HASH_PRIME_2, hash_value ^ (length * HASH_PRIME_0));
+
+  hashed_key.length = length;
+  hashed_key.hash = hash_value;
+
+  return hashed_key;
+}
+
+// Compares the hash and the length before touching the key bytes.
+// A renamed item publishes a new key string, so the string is compared up to
+// its own terminator and never by the length read from the item.
+bool static is_item_key(DBItem *item, const DBHashedKey *key)
+{
+  return LOAD_SHARED(&item->hash) == key->hash &&
+         LOAD_SHARED(&item->key_length) == key->length &&
+         strcmp(LOAD_SHARED(&item->key), key->string) == 0;
+}
+
+#ifdef DB_OPEN_ADDRESSING
+
+// The low bits of the hash select the slot, so the fingerprint is taken
+// from the high bits of a mixed hash to stay independent of the slot.
+unsigned char static fingerprint(uint64_t hash_value)
+{
+  return (unsigned char)(((hash_value * 0x9E3779B97F4A7C15ULL) >> 57) & 0x7F);
+}
+
+// The table and both arrays are one allocation.
+DBTable static *create_table(unsigned long size)
+{
+  DBTable *table = (DBTable *)malloc(sizeof(DBTable) + size * sizeof(DBItem *) + size * sizeof(unsigned char));
+
+  if (!table)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  table->slots = (DBItem **)(table + 1);
+  table->controls = (unsigned char *)(table->slots + size);
+  memset(table->slots, 0, size * sizeof(DBItem *));
+  memset(table->controls, CONTROL_EMPTY, size * sizeof(unsigned char));
+  table->tombstones = 0;
+  table->size = size;
+  table->used = 0;
+
+  return table;
+}
+
+unsigned long static get_table_load(DBTable *table)
+{
+  return table->used + table->tombstones;
+}
+
+DBItem static *find_in_table(DBTable *table, const DBHashedKey *key)
+{
+  unsigned long mask = table->size - 1;
+  unsigned char control = fingerprint(key->hash);
+  unsigned char current_control;
+  DBItem *item = NULL;
+
+  for (unsigned long i = key->hash & mask;; i = (i + 1) & mask)
+  {
+    current_control = LOAD_SHARED(&table->controls[i]);
+    if (current_control == CONTROL_EMPTY)
+      return NULL;
+    if (current_control != control)
+      continue;
+    // the slot may have been cleared since its control byte was read
+    item = LOAD_SHARED(&table->slots[i]);
+    if (item != NULL && is_item_key(item, key))
+      return item;
+  }
+}
+
+// Looks for the key with a writer's view of the table. On a miss the index
+// of the first free slot of the probe sequence is returned in `insert_index`.
+DBItem static *probe_table(DBTable *table, const DBHashedKey *key, unsigned long *insert_index)
+{
+  unsigned long mask = table->size - 1;
+  unsigned char control = fingerprint(key->hash);
+  bool found_free = false;
+
+  for (unsigned long i = key->hash & mask;; i = (i + 1) & mask)
+  {
+    if (!found_free && !IS_CONTROL_FULL(table->controls[i]))
+    {
+      *insert_index = i;
+      found_free = true;
+    }
+    if (table->controls[i] == CONTROL_EMPTY)
+      return NULL;
+    if (table->controls[i] == control && is_item_key(table->slots[i], key))
+      return table->slots[i];
+  }
+}
+
+void static insert_into_table_at(DBTable *table, unsigned long index, DBItem *item)
+{
+  if (table->controls[index] == CONTROL_DELETED)
+    table->tombstones--;
+
+  // the item must be in the slot before the slot is marked as full
+  STORE_SHARED(&table->slots[index], item);
+  STORE_SHARED(&table->controls[index], fingerprint(item->hash));
+  table->used++;
+}
+
+void static insert_into_table(DBTable *table, DBItem *item)
+{
+  unsigned long mask = table->size - 1;
+  unsigned long i = item->hash & mask;
+
+  while (IS_CONTROL_FULL(table->controls[i]))
+    i = (i + 1) & mask;
+
+  insert_into_table_at(table, i, item);
+}
+
+// Marks the slot as empty if nothing probes past it, else leaves a tombstone.
+void static clear_slot(DBTable *table, unsigned long index)
+{
+  unsigned long mask = table->size - 1;
+
+  if (table->controls[(index + 1) & mask] == CONTROL_EMPTY)
+  {
+    STORE_SHARED(&table->controls[index], CONTROL_EMPTY);
+  }
+  else
+  {
+    STORE_SHARED(&table->controls[index], CONTROL_DELETED);
+    table->tombstones++;
+  }
+  STORE_SHARED(&table->slots[index], NULL);
+  table->used--;
+}
+
+DBItem static *remove_from_table(DBTable *table, const DBHashedKey *key)
+{
+  unsigned long mask = table->size - 1;
+  unsigned char control = fingerprint(key->hash);
+
+  for (unsigned long i = key->hash & mask;; i = (i + 1) & mask)
+  {
+    if (table->controls[i] == CONTROL_EMPTY)
+      return NULL;
+    if (table->controls[i] == control && is_item_key(table->slots[i], key))
+    {
+      DBItem *item = table->slots[i];
+      clear_slot(table, i);
+      return item;
+    }
+  }
+}
+
+DBItem static *first_item_at(DBTable *table, unsigned long index)
+{
+  return IS_CONTROL_FULL(table->controls[index]) ? table->slots[index] : NULL;
+}
+
+// The distance of the item in the slot from the slot its hash selects, plus
+// one, or 0 for a free slot.
+unsigned long static get_probe_length(DBTable *table, unsigned long index)
+{
+  if (!IS_CONTROL_FULL(table->controls[index]))
+    return 0;
+
+  return ((index - table->slots[index]->hash) & (table->size - 1)) + 1;
+}
+
+size_t static get_table_bytes(DBTable *table)
+{
+  return sizeof(DBTable) + table->size * (sizeof(DBItem *) + sizeof(unsigned char));
+}
+
+// Visits the items whose hash selects the slot, they are in the run of
+// slots that starts there.
+void static scan_bucket(DBTable *table, unsigned long bucket, void (*callback)(DBItem *item, void *data), void *data)
+{
+  unsigned long mask = table->size - 1;
+
+  for (unsigned long i = bucket; table->controls[i] != CONTROL_EMPTY; i = (i + 1) & mask)
+  {
+    if (IS_CONTROL_FULL(table->controls[i]) && (table->slots[i]->hash & mask) == bucket)
+      callback(table->slots[i], data);
+  }
+}
+
+// Removes the item in the slot and returns it.
+DBItem static *take_items_at(DBTable *table, unsigned long index)
+{
+  DBItem *item = first_item_at(table, index);
+
+  if (item == NULL)
+    return NULL;
+
+  // always leave a tombstone, the table may still be probed past this slot
+  STORE_SHARED(&table->controls[index], CONTROL_DELETED);
+  STORE_SHARED(&table->slots[index], NULL);
+  table->tombstones++;
+  table->used--;
+  item->next = NULL;
+
+  return item;
+}
+
+#else
+
+// The table and the buckets are one allocation.
+DBTable static *create_table(unsigned long size)
+{
+  DBTable *table = (DBTable *)malloc(sizeof(DBTable) + size * sizeof(DBItem *));
+
+  if (!table)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  table->buckets = (DBItem **)(table + 1);
+  memset(table->buckets, 0, size * sizeof(DBItem *));
+  table->size = size;
+  table->used = 0;
+
+  return table;
+}
+
+unsigned long static get_table_load(DBTable *table)
+{
+  return table->used;
+}
+
+DBItem static *find_in_table(DBTable *table, const DBHashedKey *key)
+{
+  DBItem *item = LOAD_SHARED(&table->buckets[key->hash & (table->size - 1)]);
+
+  while (item != NULL)
+  {
+    if (is_item_key(item, key))
+      return item;
+    item = LOAD_SHARED(&item->next);
+  }
+
+  return NULL;
+}
+
+// Looks for the key with a writer's view of the table. On a miss the index
+// of the bucket of the key is returned in `insert_index`.
+DBItem static *probe_table(DBTable *table, const DBHashedKey *key, unsigned long *insert_index)
+{
+  *insert_index = key->hash & (table->size - 1);
+
+  for (DBItem *item = table->buckets[*insert_index]; item != NULL; item = item->next)
+  {
+    if (is_item_key(item, key))
+      return item;
+  }
+
+  return NULL;
+}
+
+void static insert_into_table_at(DBTable *table, unsigned long index, DBItem *item)
+{
+  // the item must point to the chain before it becomes its head
+  STORE_SHARED(&item->next, table->buckets[index]);
+  STORE_SHARED(&table->buckets[index], item);
+  table->used++;
+}
+
+void static insert_into_table(DBTable *table, DBItem *item)
+{
+  insert_into_table_at(table, item->hash & (table->size - 1), item);
+}
+
+// The removed item keeps its next pointer, so a lookup standing on it can
+// still walk the rest of the chain.
+DBItem static *remove_from_table(DBTable *table, const DBHashedKey *key)
+{
+  unsigned long index = key->hash & (table->size - 1);
+  DBItem *prev = NULL;
+  DBItem *curr = table->buckets[index];
+
+  while (curr != NULL)
+  {
+    if (is_item_key(curr, key))
+    {
+      if (prev == NULL)
+        STORE_SHARED(&table->buckets[index], curr->next);
+      else
+        STORE_SHARED(&prev->next, curr->next);
+
+      table->used--;
+      return curr;
+    }
+    prev = curr;
+    curr = curr->next;
+  }
+
+  return NULL;
+}
+
+DBItem static *first_item_at(DBTable *table, unsigned long index)
+{
+  return table->buckets[index];
+}
+
+// The length of the chain of the bucket.
+unsigned long static get_probe_length(DBTable *table, unsigned long index)
+{
+  unsigned long length = 0;
+
+  for (DBItem *item = table->buckets[index]; item != NULL; item = item->next)
+    length++;
+
+  return length;
+}
+
+size_t static get_table_bytes(DBTable *table)
+{
+  return sizeof(DBTable) + table->size * sizeof(DBItem *);
+}
+
+void static scan_bucket(DBTable *table, unsigned long bucket, void (*callback)(DBItem *item, void *data), void *data)
+{
+  for (DBItem *item = table->buckets[bucket]; item != NULL; item = item->next)
+    callback(item, data);
+}
+
+// Removes the whole chain of the bucket and returns it.
+DBItem static *take_items_at(DBTable *table, unsigned long index)
+{
+  DBItem *items = table->buckets[index];
+  STORE_SHARED(&table->buckets[index], NULL);
+
+  for (DBItem *item = items; item != NULL; item = item->next)
+    table->used--;
+
+  return items;
+}
+
+#endif
+
+void static free_table(void *table)
+{
+  free(table);
+}
+
+bool static is_table_overloaded(DBTable *table, unsigned long extra)
+{
+  return (get_table_load(table) + extra) * HASH_TABLE_MAX_LOAD_DENOMINATOR > table->size * HASH_TABLE_MAX_LOAD_NUMERATOR;
+}
+
+bool static is_rehashing(DBHashTable *hash_table)
+{
+  return hash_table->rehash_index != -1;
+}
+
+// Moves up to `steps` non-empty positions from tables[0] to tables[1].
+// Moved items may be missed by concurrent lookups, so the version is odd
+// until the step is done.
+void static rehash_step(DBHashTable *hash_table, int steps)
+{
+  if (!is_rehashing(hash_table))
+    return;
+
+  DBTable *old_table = hash_table->tables[0];
+  DBTable *new_table = hash_table->tables[1];
+  int empty_visits = HASH_TABLE_REHASH_EMPTY_VISITS;
+
+  STORE_SHARED(&hash_table->version, hash_table->version + 1);
+
+  while (steps-- && old_table->used != 0)
+  {
+    while (first_item_at(old_table, hash_table->rehash_index) == NULL && empty_visits > 0)
+    {
+      hash_table->rehash_index++;
+      empty_visits--;
+    }
+    if (empty_visits == 0)
+      break;
+
+    DBItem *item = take_items_at(old_table, hash_table->rehash_index);
+    DBItem *next = NULL;
+    while (item != NULL)
+    {
+      next = item->next;
+      insert_into_table(new_table, item);
+      item = next;
+    }
+    hash_table->rehash_index++;
+  }
+
+  // the whole table has been moved, swap the new table in
+  if (old_table->used == 0)
+  {
+    STORE_SHARED(&hash_table->tables[0], new_table);
+    STORE_SHARED(&hash_table->tables[1], NULL);
+    hash_table->rehash_index = -1;
+    retire_pointer(old_table, free_table);
+  }
+
+  STORE_SHARED(&hash_table->version, hash_table->version + 1);
+}
+
+// Smallest size that leaves the table half loaded after the resize.
+unsigned long static get_target_size(unsigned long used)
+{
+  unsigned long size = HASH_TABLE_INITIAL_SIZE;
+
+  while (size * HASH_TABLE_MAX_LOAD_NUMERATOR < used * 2 * HASH_TABLE_MAX_LOAD_DENOMINATOR)
+    size <<= 1;
+
+  return size;
+}
+
+// Starts an incremental rehash when the load factor is out of range.
+void static resize_hash_table_if_needed(DBHashTable *hash_table)
+{
+  if (is_rehashing(hash_table))
+    return;
+
+  DBTable *table = hash_table->tables[0];
+  bool overloaded = is_table_overloaded(table, 1);
+  unsigned long new_size = get_target_size(table->used);
+
+  // a table with too many tombstones is rehashed to the same size
+  if (!overloaded && (table->size <= HASH_TABLE_INITIAL_SIZE || table->used * HASH_TABLE_SHRINK_RATIO >= table->size))
+    return;
+
+  if (!overloaded && new_size == table->size)
+    return;
+
+#ifdef DB_OPEN_ADDRESSING
+  // Every add performs a rehash step and then goes to the new table, so the
+  // new table must never fill up before the old one is empty.
+  unsigned long max_steps = table->used + table->size / HASH_TABLE_REHASH_EMPTY_VISITS + 1;
+  while (new_size <= table->used + max_steps)
+    new_size <<= 1;
+#endif
+
+  STORE_SHARED(&hash_table->tables[1], create_table(new_size));
+  hash_table->rehash_index = 0;
+}
+
+void init_hash_table(DBHashTable *hash_table)
+{
+  STORE_SHARED(&hash_table->tables[0], create_table(HASH_TABLE_INITIAL_SIZE));
+  STORE_SHARED(&hash_table->tables[1], NULL);
+  hash_table->rehash_index = -1;
+}
+
+// Removes every item from the tables and passes it to `free_item`.
+void clear_hash_table(DBHashTable *hash_table, void (*free_item)(DBItem *item))
+{
+  STORE_SHARED(&hash_table->version, hash_table->version + 1);
+
+  for (int t = 0; t <= 1; t++)
+  {
+    DBTable *table = hash_table->tables[t];
+
+    if (table == NULL)
+      continue;
+
+    STORE_SHARED(&hash_table->tables[t], NULL);
+    for (unsigned long i = 0; i < table->size; i++)
+    {
+      DBItem *item = take_items_at(table, i);
+      DBItem *next = NULL;
+      while (item != NULL)
+      {
+        next = item->next;
+        free_item(item);
+        item = next;
+      }
+    }
+    retire_pointer(table, free_table);
+  }
+  hash_table->rehash_index = -1;
+
+  STORE_SHARED(&hash_table->version, hash_table->version + 1);
+}
+
+unsigned long count_hash_table_items(DBHashTable *hash_table)
+{
+  unsigned long count = 0;
+
+  for (int t = 0; t <= 1; t++)
+  {
+    if (hash_table->tables[t] != NULL)
+      count += hash_table->tables[t]->used;
+  }
+
+  return count;
+}
+
+// Safe to call without a lock from inside an epoch. A miss is retried if
+// items were moved between the tables during the lookup.
+DBItem *find_item_in_hash_table(DBHashTable *hash_table, const DBHashedKey *key)
+{
+  unsigned long version = 0;
+  DBTable *table = NULL;
+  DBItem *item = NULL;
+
+  do
+  {
+    version = LOAD_SHARED(&hash_table->version);
+
+    for (int t = 0; t <= 1; t++)
+    {
+      table = LOAD_SHARED(&hash_table->tables[t]);
+      if (table != NULL && (item = find_in_table(table, key)) != NULL)
+        return item;
+    }
+  } while ((version & 1) || LOAD_SHARED(&hash_table->version) != version);
+
+  return NULL;
+}
+
+// Moves the rehash on and returns the table a new item goes to.
+DBTable static *prepare_insert(DBHashTable *hash_table)
+{
+  if (hash_table->tables[0] == NULL)
+    init_hash_table(hash_table);
+
+  rehash_step(hash_table, HASH_TABLE_REHASH_STEP);
+  resize_hash_table_if_needed(hash_table);
+
+  // new items always go to the new table while rehashing
+  return hash_table->tables[is_rehashing(hash_table) ? 1 : 0];
+}
+
+DBItem *add_item_to_hash_table(DBHashTable *hash_table, DBItem *item)
+{
+  if (item == NULL)
+    return NULL;
+
+  insert_into_table(prepare_insert(hash_table), item);
+
+  return item;
+}
+
+// Returns the item of the key, or adds the item returned by `create_item` if
+// there is none. Each table is probed once, and a miss inserts at the free
+// position found by the probe.
+DBItem *upsert_item_in_hash_table(DBHashTable *hash_table, const DBHashedKey *key, DBItem *(*create_item)(const DBHashedKey *key, void *data), void *data)
+{
+  if (key->string == NULL)
+    return NULL;
+
+  if (hash_table->tables[0] == NULL)
+    init_hash_table(hash_table);
+
+  rehash_step(hash_table, HASH_TABLE_REHASH_STEP);
+  resize_hash_table_if_needed(hash_table);
+
+  // new items always go to the new table while rehashing
+  int target = is_rehashing(hash_table) ? 1 : 0;
+  unsigned long index = 0;
+  unsigned long insert_index = 0;
+
+  for (int t = 0; t <= target; t++)
+  {
+    DBItem *item = probe_table(hash_table->tables[t], key, &index);
+    if (item != NULL)
+      return item;
+    if (t == target)
+      insert_index = index;
+  }
+
+  DBItem *item = create_item(key, data);
+  if (item != NULL)
+    insert_into_table_at(hash_table->tables[target], insert_index, item);
+
+  return item;
+}
+
+DBItem *remove_item_from_hash_table(DBHashTable *hash_table, const DBHashedKey *key)
+{
+  if (key->string == NULL || hash_table->tables[0] == NULL)
+    return NULL;
+
+  rehash_step(hash_table, HASH_TABLE_REHASH_STEP);
+
+  for (int t = 0; t <= 1; t++)
+  {
+    DBTable *table = hash_table->tables[t];
+
+    if (table != NULL)
+    {
+      DBItem *item = remove_from_table(table, key);
+      if (item != NULL)
+      {
+        resize_hash_table_if_needed(hash_table);
+        return item;
+      }
+    }
+
+    if (!is_rehashing(hash_table))
+      break;
+  }
+
+  return NULL;
+}
+
+// A lookup in `from` may still stand on the item, adding it overwrites its
+// next pointer, so the version of `from` is odd meanwhile and a lookup that
+// misses is retried. The rehash step of `to` is done first, it makes the
+// version odd itself.
+DBItem *move_item_to_hash_table(DBHashTable *from, DBHashTable *to, DBItem *item)
+{
+  DBTable *table = prepare_insert(to);
+
+  STORE_SHARED(&from->version, from->version + 1);
+  insert_into_table(table, item);
+  STORE_SHARED(&from->version, from->version + 1);
+
+  return item;
+}
+
+unsigned long static reverse_bits(unsigned long value)
+{
+  unsigned long reversed = 0;
+
+  for (unsigned long i = 0; i < sizeof(value) * 8; i++)
+  {
+    reversed = (reversed << 1) | (value & 1);
+    value >>= 1;
+  }
+
+  return reversed;
+}
+
+// Increments the high bits of the cursor first, so that the buckets visited
+// with a mask are still visited when the table doubles or halves.
+unsigned long static next_scan_cursor(unsigned long cursor, unsigned long mask)
+{
+  cursor |= ~mask;
+  cursor = reverse_bits(cursor);
+  cursor++;
+  return reverse_bits(cursor);
+}
+
+// Visits the items of a bucket, 0 for the first one, and returns the cursor
+// of the next call, 0 when done. While rehashing, the bucket of the smaller
+// table and every bucket of the larger one that its items can move to are
+// visited together. Items that stay in the table during the whole scan are
+// visited at least once, whatever resizes happen between the calls.
+// Writers must be serialized with the scan.
+unsigned long scan_hash_table(DBHashTable *hash_table, unsigned long cursor, void (*callback)(DBItem *item, void *data), void *data)
+{
+  DBTable *small_table = hash_table->tables[0];
+  DBTable *large_table = hash_table->tables[1];
+
+  if (small_table == NULL)
+    return 0;
+
+  if (large_table == NULL)
+  {
+    scan_bucket(small_table, cursor & (small_table->size - 1), callback, data);
+    return next_scan_cursor(cursor, small_table->size - 1);
+  }
+
+  if (small_table->size > large_table->size)
+  {
+    large_table = hash_table->tables[0];
+    small_table = hash_table->tables[1];
+  }
+
+  unsigned long small_mask = small_table->size - 1;
+  unsigned long large_mask = large_table->size - 1;
+
+  scan_bucket(small_table, cursor & small_mask, callback, data);
+  do
+  {
+    scan_bucket(large_table, cursor & large_mask, callback, data);
+    cursor = next_scan_cursor(cursor, large_mask);
+  } while (cursor & (small_mask ^ large_mask));
+
+  return cursor;
+}
+
+// Adds the stats of the tables to `stats`. Only HASH_TABLE_STATS_SAMPLES
+// evenly spaced positions of each table are visited, so that it is cheap
+// enough to be called often. Writers must be serialized with it.
+void add_hash_table_stats(DBHashTable *hash_table, DBHashTableStats *stats)
+{
+  for (int t = 0; t <= 1; t++)
+  {
+    DBTable *table = hash_table->tables[t];
+
+    if (table == NULL)
+      continue;
+
+    unsigned long step = table->size > HASH_TABLE_STATS_SAMPLES ? table->size / HASH_TABLE_STATS_SAMPLES : 1;
+    unsigned long length = 0;
+    for (unsigned long i = 0; i < table->size; i += step)
+    {
+      length = get_probe_length(table, i);
+      stats->probe_lengths[length < HASH_TABLE_STATS_LENGTHS ? length : HASH_TABLE_STATS_LENGTHS - 1]++;
+      stats->sampled_positions++;
+    }
+    stats->positions += table->size;
+    stats->items += table->used;
+    stats->bytes += get_table_bytes(table);
+  }
+
+  if (is_rehashing(hash_table))
+    stats->rehashing++;
+}
+
+DBHashTableIterator iterate_hash_table(DBHashTable *hash_table)
+{
+  DBHashTableIterator iterator = {hash_table, 0, 0, NULL};
+  return iterator;
+}
+
+// Returns the next item of the table, or NULL when all items were visited.
+// The table must not be modified during the iteration.
+DBItem *next_hash_table_item(DBHashTableIterator *iterator)
+{
+#ifndef DB_OPEN_ADDRESSING
+  if (iterator->item != NULL && iterator->item->next != NULL)
+  {
+    iterator->item = iterator->item->next;
+    return iterator->item;
+  }
+#endif
+
+  while (iterator->table <= 1)
+  {
+    DBTable *table = iterator->hash_table->tables[iterator->table];
+    while (table != NULL && iterator->index < table->size)
+    {
+      iterator->item = first_item_at(table, iterator->index++);
+      if (iterator->item != NULL)
+        return iterator->item;
+    }
+    iterator->table++;
+    iterator->index = 0;
+  }
+
+  iterator->item = NULL;
+  return NULL;
+}
@@ -0,0 +1,98 @@
+#ifndef CCH137_HASHTABLE_H
+#define CCH137_HASHTABLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "./database.h"
+
+// The storage behind the database items. Chaining is used by default,
+// build with -DDB_OPEN_ADDRESSING to use the open addressing table instead.
+
+// A key with its hash and length computed once, so that they can be reused
+// by every table probed during an operation.
+typedef struct DBHashedKey
+{
+  const char *string;
+  size_t length;
+  uint64_t hash;
+} DBHashedKey;
+
+typedef struct DBTable
+{
+  unsigned long size;
+  unsigned long used;
+#ifdef DB_OPEN_ADDRESSING
+  unsigned long tombstones;
+  // one control byte per slot: empty, deleted or a 7-bit fingerprint of the hash
+  unsigned char *controls;
+  DBItem **slots;
+#else
+  DBItem **buckets;
+#endif
+} DBTable;
+
+// tables[0] is the main table, tables[1] is only used while rehashing.
+// Items are moved from tables[0] to tables[1] a few at a time during the
+// following operations, and tables[1] becomes the main table when done.
+//
+// Writers must be serialized by the caller. find_item_in_hash_table() can be
+// called without a lock from inside an epoch: tables are replaced and retired
+// instead of being resized in place, and removed items must be retired too.
+typedef struct DBHashTable
+{
+  DBTable *tables[2];
+  // index of the next position of tables[0] to be rehashed, -1 if not rehashing
+  long rehash_index;
+  // odd while items are being moved between the tables, a lookup that misses
+  // while it changes is retried
+  unsigned long version;
+} DBHashTable;
+
+// Positions of each table visited by add_hash_table_stats().
+#define HASH_TABLE_STATS_SAMPLES 256
+#define HASH_TABLE_STATS_LENGTHS DATABASE_STATS_PROBE_LENGTHS
+
+typedef struct DBHashTableStats
+{
+  unsigned long items;
+  unsigned long positions;
+  unsigned long bytes;
+  // tables that are being rehashed
+  unsigned long rehashing;
+  // probe_lengths[i] is the number of sampled positions with i items in the
+  // chain, or for open addressing with an item i - 1 slots after the slot of
+  // its hash, 0 for a free slot. The last one counts every longer length.
+  unsigned long sampled_positions;
+  unsigned long probe_lengths[HASH_TABLE_STATS_LENGTHS];
+} DBHashTableStats;
+
+typedef struct DBHashTableIterator
+{
+  DBHashTable *hash_table;
+  int table;
+  unsigned long index;
+  DBItem *item;
+} DBHashTableIterator;
+
+DBHashedKey hash_key(const char *key);
+
+void init_hash_table(DBHashTable *hash_table);
+void clear_hash_table(DBHashTable *hash_table, void (*free_item)(DBItem *item));
+unsigned long count_hash_table_items(DBHashTable *hash_table);
+
+DBItem *find_item_in_hash_table(DBHashTable *hash_table, const DBHashedKey *key);
+DBItem *add_item_to_hash_table(DBHashTable *hash_table, DBItem *item);
+DBItem *upsert_item_in_hash_table(DBHashTable *hash_table, const DBHashedKey *key, DBItem *(*create_item)(const DBHashedKey *key, void *data), void *data);
+DBItem *remove_item_from_hash_table(DBHashTable *hash_table, const DBHashedKey *key);
+// Adds an item removed from `from`, which may be the same table, to `to`,
+// so that the lookups in `from` that were on the item do not miss.
+DBItem *move_item_to_hash_table(DBHashTable *from, DBHashTable *to, DBItem *item);
+
+void add_hash_table_stats(DBHashTable *hash_table, DBHashTableStats *stats);
+unsigned long scan_hash_table(DBHashTable *hash_table, unsigned long cursor, void (*callback)(DBItem *item, void *data), void *data);
+
+DBHashTableIterator iterate_hash_table(DBHashTable *hash_table);
+DBItem *next_hash_table_item(DBHashTableIterator *iterator);
+
+#endif
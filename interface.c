@@ -408,20 +408,21 @@ void read_person()
 {
   printf("Enter the name of the person: ");
   char *name = input_string();
-  DBItem *item = get_item(name);
+  DBItem *item = acquire_item(name);
   free(name);
 
   if (item == NULL)
     printf("Person not found.\n");
   else
     print_person(item);
+  release_item(item);
 }
 
 void update_person(DBModel *person_model)
 {
   printf("Enter the name of the person to update: ");
   char *name_buffer = input_string();
-  DBItem *item = get_item(name_buffer);
+  DBItem *item = acquire_item(name_buffer);
   free(name_buffer);
 
   if (item == NULL)
@@ -430,32 +431,39 @@ void update_person(DBModel *person_model)
     return;
   }
 
+  // the json of the item may be read meanwhile, it is edited as a copy
+  cJSON *json = cJSON_Duplicate(item->json, true);
+  if (!json)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
   // record name before edit
-  name_buffer = cJSON_GetObjectItem(item->json, "name")->valuestring;
-  char *before_name = (char *)calloc(strlen(name_buffer), sizeof(char));
+  name_buffer = cJSON_GetObjectItem(json, "name")->valuestring;
+  char *before_name = (char *)calloc(strlen(name_buffer) + 1, sizeof(char));
   if (!before_name)
     memory_error_handler(__FILE__, __LINE__, __func__);
   strcpy(before_name, name_buffer);
 
   // edit cjson
-  edit_cjson_with_model(person_model, item->json, 0);
-  char *after_name = cJSON_GetObjectItem(item->json, "name")->valuestring;
+  edit_cjson_with_model(person_model, json, 0);
+  char *after_name = cJSON_GetObjectItem(json, "name")->valuestring;
 
   // if name changed, check if it exists, cancel the update
   if (strcmp(before_name, after_name) != 0)
   {
     if (exists(after_name))
     {
-      // restore name
       printf("Person with this name already exists. Operation canceled.\n");
-      cJSON_SetValuestring(cJSON_GetObjectItem(item->json, "name"), before_name);
+      cJSON_Delete(json);
       free(before_name);
+      release_item(item);
       return;
     }
     rename_item(before_name, after_name);
   }
 
+  set_item(after_name, json);
   free(before_name);
+  release_item(item);
   printf("Person has been successfully updated.\n");
 }
 
@@ -472,6 +480,64 @@ void delete_person()
     printf("Person not found.\n");
 }
 
+void print_key(DBItem *item, void *count)
+{
+  printf("%d) %s\n", ++*(int *)count, item->key);
+}
+
+// Pages through the keys with a cursor, so that they are never all copied.
+void list_keys()
+{
+  unsigned long cursor = 0;
+  int count = 0;
+  int page_end = LIST_KEYS_PAGE_SIZE;
+
+  do
+  {
+    cursor = scan_database(cursor, LIST_KEYS_SCAN_BUCKETS, print_key, &count);
+    if (cursor != 0 && count >= page_end)
+    {
+      printf("N - Next page, other - Back to menu: ");
+      char choice = input_char();
+      if (choice != 'N' && choice != 'n')
+        return;
+      page_end = count + LIST_KEYS_PAGE_SIZE;
+    }
+  } while (cursor != 0);
+}
+
+void print_database_stats()
+{
+  DBStats stats = db_stats();
+
+  printf("Items: %lu\n", stats.items);
+  printf("Table positions: %lu (%lu being rehashed)\n", stats.table_positions, stats.rehashing_tables);
+  printf("Probe lengths of %lu sampled positions:", stats.sampled_positions);
+  for (int i = 0; i < DATABASE_STATS_PROBE_LENGTHS; i++)
+    printf(" %lu", stats.probe_lengths[i]);
+  printf("\n");
+  printf("Memory (bytes):\n");
+  printf("  items: %lu\n", stats.item_bytes);
+  printf("  keys: %lu\n", stats.key_bytes);
+  printf("  json: %lu (%lu nodes, %lu string bytes)\n", stats.json_bytes, stats.json_nodes, stats.json_string_bytes);
+  printf("  tables: %lu\n", stats.table_bytes);
+  printf("  filters: %lu\n", stats.filter_bytes);
+  printf("  key index: %lu\n", stats.index_bytes);
+  printf("  member names: %lu (%lu names)\n", stats.intern_bytes, stats.interned_names);
+  printf("  reserved by the allocators: %lu\n", stats.reserved_bytes);
+  printf("Evicted items: %lu (%lu evictions, %lu reloads, %lu bytes spilled)\n", stats.evicted_items, stats.evictions, stats.reloads, stats.spill_bytes);
+  printf("Expiring items: %lu (%lu expired)\n", stats.expiring_items, stats.expirations);
+  printf("Changes since the last full save: %lu items, %lu deleted keys\n", stats.dirty_items, stats.deleted_keys);
+  printf("Operations:\n");
+  printf("  lookups: %lu\n", stats.lookups);
+  printf("  inserts: %lu\n", stats.inserts);
+  printf("  updates: %lu\n", stats.updates);
+  printf("  renames: %lu\n", stats.renames);
+  printf("  deletes: %lu\n", stats.deletes);
+  printf("Filter: %lu lookups, %lu rejected, %lu false positives\n", stats.filter.lookups, stats.filter.rejected, stats.filter.false_positives);
+  printf("Write log: %lu records, %lu writes, %lu syncs, %lu checkpoints\n", stats.write_log.records, stats.write_log.writes, stats.write_log.syncs, stats.checkpoints);
+}
+
 void main_menu()
 {
   // ################ Person Model ################
@@ -495,6 +561,9 @@ void main_menu()
 
   while (1)
   {
+    // the shards that were not written meanwhile may hold expired items
+    expire_items();
+
     printf("\n################ Main Menu ################\n");
     printf("Welcome to CCH's address book!!!\n");
     printf("Choose an option:\n");
@@ -503,6 +572,7 @@ void main_menu()
     printf("U - Update a person\n");
     printf("D - Delete a person\n");
     printf("K - List keys\n");
+    printf("I - Database info\n");
     printf("S - Save database\n");
     printf("X - Exit\n");
     printf("Your choice: ");
@@ -537,13 +607,13 @@ void main_menu()
 
     case 'K':
     case 'k':
-    {
-      DBKeys *keys = get_database_keys();
-      for (int i = 0; i < keys->length; i++)
-        printf("%d) %s\n", i + 1, keys->keys[i]);
-      free_keys(keys);
+      list_keys();
+      break;
+
+    case 'I':
+    case 'i':
+      print_database_stats();
       break;
-    }
 
     case 'X':
     case 'x':
@@ -13,6 +13,15 @@ void read_person();
 void update_person(DBModel *person_model);
 void delete_person();
 
+#define LIST_KEYS_PAGE_SIZE 20
+// Buckets visited per step of the cursor, a page may be a bit longer.
+#define LIST_KEYS_SCAN_BUCKETS 4
+
+void print_key(DBItem *item, void *count);
+void list_keys();
+
+void print_database_stats();
+
 cJSON *input_cjson_with_model(DBModel *model, int depth);
 cJSON *edit_cjson_with_model(DBModel *model, cJSON *json, int depth);
 
@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "./cJSON.h"
+#include "./utils.h"
+#include "./hashtable.h"
+#include "./intern.h"
+
+// Open addressing with linear probing, at most half full.
+#define INTERN_POOL_MIN_SIZE 64
+
+char **intern_slots = NULL;
+unsigned long intern_size = 0;
+DBInternStats intern_stats = {0, 0};
+pthread_mutex_t intern_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+char static **find_intern_slot(char **slots, unsigned long size, const DBHashedKey *key);
+void static grow_intern_pool();
+const char static *intern_string_locked(const char *string);
+void static intern_json_keys_locked(cJSON *json);
+DBInternSlot static *find_table_slot(DBInternSlot *slots, unsigned long size, const DBHashedKey *key);
+void static grow_intern_table(DBInternTable *table);
+
+char static **find_intern_slot(char **slots, unsigned long size, const DBHashedKey *key)
+{
+  unsigned long index = key->hash & (size - 1);
+
+  while (slots[index] != NULL && strcmp(slots[index], key->string) != 0)
+    index = (index + 1) & (size - 1);
+
+  return &slots[index];
+}
+
+void static grow_intern_pool()
+{
+  unsigned long size = intern_size == 0 ? INTERN_POOL_MIN_SIZE : intern_size * 2;
+  char **slots = (char **)calloc(size, sizeof(char *));
+
+  if (!slots)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  DBHashedKey key;
+  for (unsigned long i = 0; i < intern_size; i++)
+  {
+    if (intern_slots[i] == NULL)
+      continue;
+
+    key = hash_key(intern_slots[i]);
+    *find_intern_slot(slots, size, &key) = intern_slots[i];
+  }
+
+  free(intern_slots);
+  intern_stats.bytes += (size - intern_size) * sizeof(char *);
+  intern_slots = slots;
+  intern_size = size;
+}
+
+const char static *intern_string_locked(const char *string)
+{
+  DBHashedKey key = hash_key(string);
+
+  if (key.length > INTERN_MAX_LENGTH)
+    return NULL;
+
+  if (intern_size == 0)
+    grow_intern_pool();
+
+  char **slot = find_intern_slot(intern_slots, intern_size, &key);
+
+  if (*slot != NULL)
+    return *slot;
+
+  if (intern_stats.strings >= INTERN_POOL_MAX_STRINGS)
+    return NULL;
+
+  char *copy = (char *)malloc(key.length + 1);
+
+  if (!copy)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  memcpy(copy, string, key.length + 1);
+  *slot = copy;
+  intern_stats.strings++;
+  intern_stats.bytes += key.length + 1;
+
+  if (intern_stats.strings * 2 > intern_size)
+    grow_intern_pool();
+
+  return copy;
+}
+
+const char *intern_string(const char *string)
+{
+  if (string == NULL)
+    return NULL;
+
+  pthread_mutex_lock(&intern_mutex);
+  const char *interned = intern_string_locked(string);
+  pthread_mutex_unlock(&intern_mutex);
+
+  return interned;
+}
+
+void static intern_json_keys_locked(cJSON *json)
+{
+  const char *interned = NULL;
+
+  for (; json != NULL; json = json->next)
+  {
+    if (json->string != NULL && !(json->type & cJSON_StringIsConst))
+    {
+      interned = intern_string_locked(json->string);
+      if (interned != NULL)
+      {
+        cJSON_free(json->string);
+        json->string = (char *)interned;
+        json->type |= cJSON_StringIsConst;
+      }
+    }
+
+    if (json->child != NULL)
+      intern_json_keys_locked(json->child);
+  }
+}
+
+void intern_json_keys(cJSON *json)
+{
+  if (json == NULL)
+    return;
+
+  pthread_mutex_lock(&intern_mutex);
+  intern_json_keys_locked(json->child);
+  pthread_mutex_unlock(&intern_mutex);
+}
+
+DBInternSlot static *find_table_slot(DBInternSlot *slots, unsigned long size, const DBHashedKey *key)
+{
+  unsigned long index = key->hash & (size - 1);
+
+  while (slots[index].name != NULL &&
+         (slots[index].hash != key->hash || strcmp(slots[index].name, key->string) != 0))
+    index = (index + 1) & (size - 1);
+
+  return &slots[index];
+}
+
+void static grow_intern_table(DBInternTable *table)
+{
+  unsigned long size = table->size == 0 ? INTERN_POOL_MIN_SIZE : table->size * 2;
+  DBInternSlot *slots = (DBInternSlot *)calloc(size, sizeof(DBInternSlot));
+
+  if (!slots)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  DBHashedKey key;
+  for (unsigned long i = 0; i < table->size; i++)
+  {
+    if (table->slots[i].name == NULL)
+      continue;
+
+    key.string = table->slots[i].name;
+    key.hash = table->slots[i].hash;
+    *find_table_slot(slots, size, &key) = table->slots[i];
+  }
+
+  free(table->slots);
+  table->slots = slots;
+  table->size = size;
+}
+
+void init_intern_table(DBInternTable *table)
+{
+  table->slots = NULL;
+  table->size = 0;
+  table->count = 0;
+  grow_intern_table(table);
+}
+
+void collect_json_keys(DBInternTable *table, cJSON *json)
+{
+  DBHashedKey key;
+  DBInternSlot *slot = NULL;
+
+  for (json = json != NULL ? json->child : NULL; json != NULL; json = json->next)
+  {
+    // the pool can not hold more names than that
+    if (json->string != NULL && !(json->type & cJSON_StringIsConst) && table->count < INTERN_POOL_MAX_STRINGS)
+    {
+      key = hash_key(json->string);
+      slot = find_table_slot(table->slots, table->size, &key);
+      if (key.length <= INTERN_MAX_LENGTH && slot->name == NULL)
+      {
+        slot->name = json->string;
+        slot->hash = key.hash;
+        slot->pooled = NULL;
+        if (++table->count * 2 > table->size)
+          grow_intern_table(table);
+      }
+    }
+
+    if (json->child != NULL)
+      collect_json_keys(table, json);
+  }
+}
+
+// The names that are pooled are replaced by their pooled copies, and the
+// others are copied, so that the table outlives the jsons it was filled from.
+void merge_intern_table(DBInternTable *table)
+{
+  DBInternSlot *slot = NULL;
+
+  pthread_mutex_lock(&intern_mutex);
+  for (unsigned long i = 0; i < table->size; i++)
+  {
+    slot = &table->slots[i];
+    if (slot->name != NULL)
+      slot->pooled = intern_string_locked(slot->name);
+  }
+  pthread_mutex_unlock(&intern_mutex);
+
+  for (unsigned long i = 0; i < table->size; i++)
+  {
+    slot = &table->slots[i];
+    if (slot->name != NULL && slot->pooled != NULL)
+    {
+      slot->name = slot->pooled;
+    }
+    else if (slot->name != NULL)
+    {
+      char *copy = (char *)malloc(strlen(slot->name) + 1);
+      if (!copy)
+        memory_error_handler(__FILE__, __LINE__, __func__);
+      strcpy(copy, slot->name);
+      slot->name = copy;
+    }
+  }
+}
+
+void apply_intern_table(DBInternTable *table, cJSON *json)
+{
+  DBHashedKey key;
+  DBInternSlot *slot = NULL;
+
+  for (json = json != NULL ? json->child : NULL; json != NULL; json = json->next)
+  {
+    if (json->string != NULL && !(json->type & cJSON_StringIsConst))
+    {
+      key = hash_key(json->string);
+      slot = find_table_slot(table->slots, table->size, &key);
+      if (slot->pooled != NULL)
+      {
+        cJSON_free(json->string);
+        json->string = (char *)slot->pooled;
+        json->type |= cJSON_StringIsConst;
+      }
+    }
+
+    if (json->child != NULL)
+      apply_intern_table(table, json);
+  }
+}
+
+// The names that were not pooled are the copies of the table.
+void free_intern_table(DBInternTable *table)
+{
+  for (unsigned long i = 0; i < table->size; i++)
+  {
+    if (table->slots[i].name != NULL && table->slots[i].pooled == NULL)
+      free((char *)table->slots[i].name);
+  }
+  free(table->slots);
+  table->slots = NULL;
+  table->size = 0;
+  table->count = 0;
+}
+
+DBInternStats get_intern_stats()
+{
+  pthread_mutex_lock(&intern_mutex);
+  DBInternStats stats = intern_stats;
+  pthread_mutex_unlock(&intern_mutex);
+
+  return stats;
+}
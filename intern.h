@@ -0,0 +1,63 @@
+#ifndef CCH137_INTERN_H
+#define CCH137_INTERN_H
+
+#include <stdint.h>
+#include "./cJSON.h"
+
+// Pool of the member names of the jsons, so that every record refers to a
+// single copy of "name", "jobTitle" and the others instead of its own. The
+// names are flagged cJSON_StringIsConst, so cJSON_Delete and cJSON_Duplicate
+// leave them to the pool. Pooled names are never freed, so the pool stops
+// growing at INTERN_POOL_MAX_STRINGS names and names longer than
+// INTERN_MAX_LENGTH are not pooled.
+
+#define INTERN_POOL_MAX_STRINGS 4096
+#define INTERN_MAX_LENGTH 64
+
+typedef struct DBInternStats
+{
+  unsigned long strings;
+  // the names and the table
+  unsigned long bytes;
+} DBInternStats;
+
+// Returns the pooled copy of the string, NULL if it can not be pooled.
+const char *intern_string(const char *string);
+// Replaces the member names of every object inside the json with their
+// pooled copies and frees the copies they owned. The name of the json itself
+// is left as it is, it is the key of a record. The pool is locked once per
+// json.
+void intern_json_keys(cJSON *json);
+
+// The member names of many jsons, gathered without a lock and pooled at once,
+// so that threads loading records do not lock the pool for each of them.
+typedef struct DBInternSlot
+{
+  const char *name;
+  uint64_t hash;
+  // the pooled copy of the name once merged, NULL if it can not be pooled
+  const char *pooled;
+} DBInternSlot;
+
+typedef struct DBInternTable
+{
+  DBInternSlot *slots;
+  unsigned long size;
+  unsigned long count;
+} DBInternTable;
+
+void init_intern_table(DBInternTable *table);
+// Adds the member names of every object inside the json, the name of the
+// json itself left out as in intern_json_keys(). The names are not copied,
+// so the json must not be freed before the table is merged.
+void collect_json_keys(DBInternTable *table, cJSON *json);
+// Pools every name of the table, with the pool locked once.
+void merge_intern_table(DBInternTable *table);
+// Like intern_json_keys(), from a merged table and without a lock. Names
+// that are not in the table are left as they are.
+void apply_intern_table(DBInternTable *table, cJSON *json);
+void free_intern_table(DBInternTable *table);
+
+DBInternStats get_intern_stats();
+
+#endif
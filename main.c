@@ -4,8 +4,12 @@
 int main()
 {
   load_database(DATABASE_FILENAME);
+  open_database_log(DATABASE_LOG_FILENAME);
+  start_checkpointer(DATABASE_FILENAME, DATABASE_CHECKPOINT_INTERVAL_MS);
   main_menu();
+  stop_checkpointer();
   save_database(DATABASE_FILENAME);
+  close_database_log();
 
   return 0;
 }
@@ -0,0 +1,340 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "./utils.h"
+#include "./epoch.h"
+#include "./skiplist.h"
+
+// A node is promoted to the next level with a probability of 1/4.
+#define SKIP_LIST_PROMOTION_MASK 3
+#define SKIP_LIST_PROMOTION_BITS 2
+
+#define LOAD_SHARED(pointer) __atomic_load_n(pointer, __ATOMIC_ACQUIRE)
+#define STORE_SHARED(pointer, value) __atomic_store_n(pointer, value, __ATOMIC_RELEASE)
+
+DBSkipListNode static *create_node(const char *key, int height);
+size_t static get_node_bytes(DBSkipListNode *node);
+int static random_height(DBSkipList *skip_list);
+DBSkipListNode static *find_predecessors(DBSkipList *skip_list, const char *key, DBSkipListNode **predecessors);
+DBSkipListNode static *seek_skip_list(DBSkipList *skip_list, const char *key);
+void static copy_key(DBSkipListKey *copy, const char *key);
+void static copy_next_key(DBSkipList *skip_list, const char *key, bool included, DBSkipListKey *copy);
+void static finish_iterator(DBSkipListIterator *iterator);
+
+// The key is copied after the next pointers, so a node is one allocation.
+DBSkipListNode static *create_node(const char *key, int height)
+{
+  size_t key_size = key != NULL ? strlen(key) + 1 : 0;
+  DBSkipListNode *node = (DBSkipListNode *)malloc(sizeof(DBSkipListNode) + height * sizeof(DBSkipListNode *) + key_size);
+
+  if (!node)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  node->height = height;
+  node->key = NULL;
+  memset(node->next, 0, height * sizeof(DBSkipListNode *));
+
+  if (key != NULL)
+  {
+    node->key = (char *)(node->next + height);
+    memcpy(node->key, key, key_size);
+  }
+
+  return node;
+}
+
+size_t static get_node_bytes(DBSkipListNode *node)
+{
+  return sizeof(DBSkipListNode) + node->height * sizeof(DBSkipListNode *) + (node->key != NULL ? strlen(node->key) + 1 : 0);
+}
+
+// xorshift64, the state is only touched by the serialized writers.
+int static random_height(DBSkipList *skip_list)
+{
+  uint64_t random_value = skip_list->random_state;
+  random_value ^= random_value << 13;
+  random_value ^= random_value >> 7;
+  random_value ^= random_value << 17;
+  skip_list->random_state = random_value;
+
+  int height = 1;
+  while (height < SKIP_LIST_MAX_HEIGHT && (random_value & SKIP_LIST_PROMOTION_MASK) == 0)
+  {
+    height++;
+    random_value >>= SKIP_LIST_PROMOTION_BITS;
+  }
+
+  return height;
+}
+
+// Fills the last node before the key at every level, and returns the first
+// node at or after the key.
+DBSkipListNode static *find_predecessors(DBSkipList *skip_list, const char *key, DBSkipListNode **predecessors)
+{
+  DBSkipListNode *node = skip_list->head;
+
+  for (int level = SKIP_LIST_MAX_HEIGHT - 1; level >= skip_list->height; level--)
+    predecessors[level] = node;
+
+  for (int level = skip_list->height - 1; level >= 0; level--)
+  {
+    while (node->next[level] != NULL && strcmp(node->next[level]->key, key) < 0)
+      node = node->next[level];
+    predecessors[level] = node;
+  }
+
+  return node->next[0];
+}
+
+// Returns the first node at or after the key, without a lock.
+DBSkipListNode static *seek_skip_list(DBSkipList *skip_list, const char *key)
+{
+  DBSkipListNode *node = skip_list->head;
+  DBSkipListNode *next = NULL;
+
+  if (key == NULL)
+    return LOAD_SHARED(&node->next[0]);
+
+  for (int level = LOAD_SHARED(&skip_list->height) - 1; level >= 0; level--)
+  {
+    while ((next = LOAD_SHARED(&node->next[level])) != NULL && strcmp(next->key, key) < 0)
+      node = next;
+  }
+
+  return LOAD_SHARED(&node->next[0]);
+}
+
+void init_skip_list(DBSkipList *skip_list)
+{
+  skip_list->head = create_node(NULL, SKIP_LIST_MAX_HEIGHT);
+  skip_list->height = 1;
+  skip_list->count = 0;
+  skip_list->bytes = get_node_bytes(skip_list->head);
+  skip_list->random_state = 0x9E3779B97F4A7C15ULL;
+}
+
+// Removes every key, iterators that are still running keep the old nodes.
+void clear_skip_list(DBSkipList *skip_list)
+{
+  DBSkipListNode *node = skip_list->head->next[0];
+  DBSkipListNode *next = NULL;
+
+  for (int level = 0; level < SKIP_LIST_MAX_HEIGHT; level++)
+    STORE_SHARED(&skip_list->head->next[level], NULL);
+  STORE_SHARED(&skip_list->height, 1);
+  __atomic_store_n(&skip_list->count, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&skip_list->bytes, get_node_bytes(skip_list->head), __ATOMIC_RELAXED);
+
+  while (node != NULL)
+  {
+    next = node->next[0];
+    retire_pointer(node, free);
+    node = next;
+  }
+}
+
+// Returns false if the key is already in the list.
+bool insert_into_skip_list(DBSkipList *skip_list, const char *key)
+{
+  DBSkipListNode *predecessors[SKIP_LIST_MAX_HEIGHT];
+  DBSkipListNode *next = find_predecessors(skip_list, key, predecessors);
+
+  if (next != NULL && strcmp(next->key, key) == 0)
+    return false;
+
+  int height = random_height(skip_list);
+  DBSkipListNode *node = create_node(key, height);
+
+  // the node is linked from the bottom, so it is in the lower levels before
+  // an iterator can reach it from the upper ones
+  for (int level = 0; level < height; level++)
+  {
+    node->next[level] = predecessors[level]->next[level];
+    STORE_SHARED(&predecessors[level]->next[level], node);
+  }
+
+  if (height > skip_list->height)
+    STORE_SHARED(&skip_list->height, height);
+  __atomic_store_n(&skip_list->count, skip_list->count + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&skip_list->bytes, skip_list->bytes + get_node_bytes(node), __ATOMIC_RELAXED);
+
+  return true;
+}
+
+// Returns false if the key is not in the list.
+bool remove_from_skip_list(DBSkipList *skip_list, const char *key)
+{
+  DBSkipListNode *predecessors[SKIP_LIST_MAX_HEIGHT];
+  DBSkipListNode *node = find_predecessors(skip_list, key, predecessors);
+
+  if (node == NULL || strcmp(node->key, key) != 0)
+    return false;
+
+  // the node keeps its next pointers for the iterators standing on it
+  for (int level = node->height - 1; level >= 0; level--)
+  {
+    if (predecessors[level]->next[level] == node)
+      STORE_SHARED(&predecessors[level]->next[level], node->next[level]);
+  }
+  __atomic_store_n(&skip_list->count, skip_list->count - 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&skip_list->bytes, skip_list->bytes - get_node_bytes(node), __ATOMIC_RELAXED);
+  retire_pointer(node, free);
+
+  return true;
+}
+
+void build_skip_list(DBSkipList *skip_list, const char **keys, unsigned long count)
+{
+  if (skip_list->count > 0)
+  {
+    for (unsigned long i = 0; i < count; i++)
+      insert_into_skip_list(skip_list, keys[i]);
+    return;
+  }
+
+  // the last node of every level
+  DBSkipListNode *tails[SKIP_LIST_MAX_HEIGHT];
+  DBSkipListNode *node = NULL;
+  unsigned long added = 0;
+  unsigned long bytes = 0;
+  int height = 0;
+
+  for (int level = 0; level < SKIP_LIST_MAX_HEIGHT; level++)
+    tails[level] = skip_list->head;
+
+  for (unsigned long i = 0; i < count; i++)
+  {
+    if (i > 0 && strcmp(keys[i - 1], keys[i]) == 0)
+      continue;
+
+    height = random_height(skip_list);
+    node = create_node(keys[i], height);
+    for (int level = 0; level < height; level++)
+    {
+      STORE_SHARED(&tails[level]->next[level], node);
+      tails[level] = node;
+    }
+    if (height > skip_list->height)
+      STORE_SHARED(&skip_list->height, height);
+    added++;
+    bytes += get_node_bytes(node);
+  }
+
+  __atomic_store_n(&skip_list->count, added, __ATOMIC_RELAXED);
+  __atomic_store_n(&skip_list->bytes, skip_list->bytes + bytes, __ATOMIC_RELAXED);
+}
+
+DBSkipListIterator scan_skip_lists_range(DBSkipList **skip_lists, int count, const char *start, const char *end)
+{
+  DBSkipListIterator iterator = {skip_lists, count, NULL, {NULL, 0}, start, false, end, NULL, 0};
+
+  return iterator;
+}
+
+DBSkipListIterator scan_skip_lists_prefix(DBSkipList **skip_lists, int count, const char *prefix)
+{
+  DBSkipListIterator iterator = {skip_lists, count, NULL, {NULL, 0}, prefix, false, NULL, prefix,
+                                 prefix != NULL ? strlen(prefix) : 0};
+
+  return iterator;
+}
+
+// The buffer only grows.
+void static copy_key(DBSkipListKey *copy, const char *key)
+{
+  size_t size = strlen(key) + 1;
+
+  if (size > copy->size)
+  {
+    char *buffer = (char *)realloc(copy->key, size);
+    if (!buffer)
+      memory_error_handler(__FILE__, __LINE__, __func__);
+    copy->key = buffer;
+    copy->size = size;
+  }
+  memcpy(copy->key, key, size);
+}
+
+// Copies the first key at or after `key`, or after it unless `included`, NULL
+// for the first key of the list. The copy is freed if there is none.
+void static copy_next_key(DBSkipList *skip_list, const char *key, bool included, DBSkipListKey *copy)
+{
+  enter_epoch();
+  DBSkipListNode *node = seek_skip_list(skip_list, key);
+  if (node != NULL && key != NULL && !included && strcmp(node->key, key) == 0)
+    node = LOAD_SHARED(&node->next[0]);
+  if (node != NULL)
+    copy_key(copy, node->key);
+  exit_epoch();
+
+  if (node == NULL)
+  {
+    free(copy->key);
+    copy->key = NULL;
+    copy->size = 0;
+  }
+}
+
+void static finish_iterator(DBSkipListIterator *iterator)
+{
+  if (iterator->next_keys != NULL)
+  {
+    for (int i = 0; i < iterator->count; i++)
+      free(iterator->next_keys[i].key);
+    free(iterator->next_keys);
+    iterator->next_keys = NULL;
+  }
+  free(iterator->key.key);
+  iterator->key.key = NULL;
+  iterator->key.size = 0;
+  iterator->done = true;
+}
+
+// Returns the next key, or NULL when the iteration is done.
+const char *next_skip_list_key(DBSkipListIterator *iterator)
+{
+  if (iterator->done)
+    return NULL;
+
+  if (iterator->next_keys == NULL)
+  {
+    iterator->next_keys = (DBSkipListKey *)calloc(iterator->count, sizeof(DBSkipListKey));
+    if (!iterator->next_keys)
+      memory_error_handler(__FILE__, __LINE__, __func__);
+    for (int i = 0; i < iterator->count; i++)
+      copy_next_key(iterator->skip_lists[i], iterator->start, true, &iterator->next_keys[i]);
+  }
+
+  int lowest = -1;
+  for (int i = 0; i < iterator->count; i++)
+  {
+    if (iterator->next_keys[i].key != NULL &&
+        (lowest == -1 || strcmp(iterator->next_keys[i].key, iterator->next_keys[lowest].key) < 0))
+      lowest = i;
+  }
+
+  if (lowest == -1 ||
+      (iterator->end != NULL && strcmp(iterator->next_keys[lowest].key, iterator->end) >= 0) ||
+      (iterator->prefix != NULL &&
+       strncmp(iterator->next_keys[lowest].key, iterator->prefix, iterator->prefix_length) != 0))
+  {
+    finish_iterator(iterator);
+    return NULL;
+  }
+
+  // the copy becomes the last key, and the buffer of the last key receives the
+  // next key of its list
+  DBSkipListKey last = iterator->key;
+  iterator->key = iterator->next_keys[lowest];
+  iterator->next_keys[lowest] = last;
+  copy_next_key(iterator->skip_lists[lowest], iterator->key.key, false, &iterator->next_keys[lowest]);
+
+  return iterator->key.key;
+}
+
+// Only needed when the iteration is stopped before the last key.
+void close_skip_list_iterator(DBSkipListIterator *iterator)
+{
+  finish_iterator(iterator);
+}
@@ -0,0 +1,84 @@
+#ifndef CCH137_SKIPLIST_H
+#define CCH137_SKIPLIST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The keys of the database in byte order, next to the hash tables, so that
+// ranges and prefixes of keys can be listed without sorting every key.
+//
+// Writers must be serialized by the caller. Readers do not lock, they seek
+// from inside an epoch: removed nodes keep their next pointers and are
+// retired, so a seek never stops on a removed key. Keys added or removed
+// during an iteration may or may not be returned.
+
+#define SKIP_LIST_MAX_HEIGHT 32
+
+typedef struct DBSkipListNode
+{
+  // stored in the same allocation, after the next pointers
+  char *key;
+  int height;
+  struct DBSkipListNode *next[];
+} DBSkipListNode;
+
+typedef struct DBSkipList
+{
+  // has no key and the max height
+  DBSkipListNode *head;
+  int height;
+  unsigned long count;
+  // bytes of the nodes, the head included
+  unsigned long bytes;
+  uint64_t random_state;
+} DBSkipList;
+
+// A copy of a key, in a buffer reused by the next copies.
+typedef struct DBSkipListKey
+{
+  // NULL when there is no key
+  char *key;
+  size_t size;
+} DBSkipListKey;
+
+// Merges the keys of several lists in byte order, a key should only be in one
+// of them. Each call of the iterator enters and exits an epoch, and no node
+// is held between calls: the iterator keeps a copy of the next key of each
+// list, and the list of the key returned is sought again from it. The
+// returned key is valid until the next call, or until the iterator is done
+// or closed.
+typedef struct DBSkipListIterator
+{
+  DBSkipList **skip_lists;
+  int count;
+  // allocated by the first call
+  DBSkipListKey *next_keys;
+  DBSkipListKey key;
+  const char *start;
+  bool done;
+  // keys are returned while they are lower than `end`, or start with `prefix`
+  const char *end;
+  const char *prefix;
+  size_t prefix_length;
+} DBSkipListIterator;
+
+void init_skip_list(DBSkipList *skip_list);
+void clear_skip_list(DBSkipList *skip_list);
+
+bool insert_into_skip_list(DBSkipList *skip_list, const char *key);
+bool remove_from_skip_list(DBSkipList *skip_list, const char *key);
+// Adds `count` keys sorted in byte order. An empty list is filled by linking
+// each node after the last one, without searching for its place.
+void build_skip_list(DBSkipList *skip_list, const char **keys, unsigned long count);
+
+// Keys of the `count` lists from `start` included to `end` excluded, NULL for
+// no bound. The array of lists, `start` and `end` must stay valid during the
+// iteration.
+DBSkipListIterator scan_skip_lists_range(DBSkipList **skip_lists, int count, const char *start, const char *end);
+// `prefix` must stay valid during the iteration.
+DBSkipListIterator scan_skip_lists_prefix(DBSkipList **skip_lists, int count, const char *prefix);
+const char *next_skip_list_key(DBSkipListIterator *iterator);
+void close_skip_list_iterator(DBSkipListIterator *iterator);
+
+#endif
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "./utils.h"
+#include "./spill.h"
+
+// -1 until the file is opened.
+int spill_file = -1;
+char *spill_filename = NULL;
+// Offset of the next record, reserved with an atomic add so that writers do
+// not need the mutex.
+unsigned long spill_file_end = 0;
+// Serializes opening and resetting the file.
+pthread_mutex_t spill_file_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+bool open_spill_file(const char *filename)
+{
+  char *copy = (char *)malloc(strlen(filename) + 1);
+
+  if (!copy)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  strcpy(copy, filename);
+
+  pthread_mutex_lock(&spill_file_mutex);
+  if (spill_file != -1)
+    close(spill_file);
+  int file = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  free(spill_filename);
+  spill_filename = copy;
+  __atomic_store_n(&spill_file_end, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&spill_file, file, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&spill_file_mutex);
+
+  if (file == -1)
+  {
+    printf("Warning: Failed to open file %s\n", filename);
+    return false;
+  }
+
+  return true;
+}
+
+bool is_spill_file_open()
+{
+  return __atomic_load_n(&spill_file, __ATOMIC_ACQUIRE) != -1;
+}
+
+const char *get_spill_filename()
+{
+  pthread_mutex_lock(&spill_file_mutex);
+  const char *filename = spill_filename;
+  pthread_mutex_unlock(&spill_file_mutex);
+
+  return filename;
+}
+
+bool write_spill_record(const char *data, size_t length, DBSpillRecord *record)
+{
+  int file = __atomic_load_n(&spill_file, __ATOMIC_ACQUIRE);
+
+  if (file == -1)
+    return false;
+
+  unsigned long offset = __atomic_fetch_add(&spill_file_end, length, __ATOMIC_RELAXED);
+  size_t written = 0;
+  ssize_t result = 0;
+
+  while (written < length)
+  {
+    result = pwrite(file, data + written, length - written, (off_t)(offset + written));
+    if (result <= 0)
+      return false;
+    written += (size_t)result;
+  }
+
+  record->offset = (long)offset;
+  record->length = (unsigned int)length;
+  return true;
+}
+
+char *read_spill_record(const DBSpillRecord *record)
+{
+  int file = __atomic_load_n(&spill_file, __ATOMIC_ACQUIRE);
+
+  if (file == -1 || record->offset < 0)
+    return NULL;
+
+  char *data = (char *)malloc(record->length + 1);
+
+  if (!data)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  size_t done = 0;
+  ssize_t result = 0;
+
+  while (done < record->length)
+  {
+    result = pread(file, data + done, record->length - done, (off_t)(record->offset + done));
+    if (result <= 0)
+    {
+      free(data);
+      return NULL;
+    }
+    done += (size_t)result;
+  }
+  data[record->length] = '\0';
+
+  return data;
+}
+
+void reset_spill_file()
+{
+  pthread_mutex_lock(&spill_file_mutex);
+  if (spill_file != -1 && ftruncate(spill_file, 0) == 0)
+    __atomic_store_n(&spill_file_end, 0, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&spill_file_mutex);
+}
+
+unsigned long get_spill_file_bytes()
+{
+  return __atomic_load_n(&spill_file_end, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,36 @@
+#ifndef CCH137_SPILL_H
+#define CCH137_SPILL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Append-only file of the json payloads evicted from memory. A record is
+// never overwritten, so an item keeps its record while its json is unchanged
+// and can be evicted again without a write. The file is only emptied by
+// reset_spill_file(), once no item refers to it anymore.
+//
+// Records are written and read with pwrite and pread at reserved offsets,
+// so they can be used from any thread without a lock.
+
+typedef struct DBSpillRecord
+{
+  // -1 when there is no record
+  long offset;
+  unsigned int length;
+} DBSpillRecord;
+
+// Creates the file, or empties it. Returns false if it can not be opened.
+bool open_spill_file(const char *filename);
+bool is_spill_file_open();
+// The name of the file last opened, NULL until then.
+const char *get_spill_filename();
+// Returns false if the file is not open or can not be written.
+bool write_spill_record(const char *data, size_t length, DBSpillRecord *record);
+// Returns the record with a terminator, to be freed by the caller, or NULL
+// if it can not be read.
+char *read_spill_record(const DBSpillRecord *record);
+void reset_spill_file();
+// Bytes of every record written since the last reset, used or not.
+unsigned long get_spill_file_bytes();
+
+#endif
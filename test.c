@@ -1,8 +1,18 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "./cJSON.h"
 #include "./database.h"
+#include "./epoch.h"
+#include "./allocator.h"
+#include "./hashtable.h"
+#include "./intern.h"
+#include "./timingwheel.h"
+#include "./wal.h"
 
 #define PASS "\033[0;32mPASS\033[0m"
 #define FAIL "\033[0;31mFAIL\033[0m"
@@ -32,6 +42,30 @@ bool test_get_item(const char *key, const char *expected_name)
   return true;
 }
 
+// The loaded records keep their key in the item only.
+bool test_loaded_records(int expected_count)
+{
+  DBKeys *keys = get_database_keys();
+  bool result = keys != NULL && keys->length == expected_count;
+
+  for (int i = 0; result && i < keys->length; i++)
+  {
+    DBItem *item = get_item(keys->keys[i]);
+    result = item != NULL && item->json != NULL && item->json->string == NULL &&
+             strcmp(cJSON_GetObjectItem(item->json, "name")->valuestring, item->key) == 0;
+  }
+  free_keys(keys);
+
+  if (!result)
+  {
+    printf("loaded_records() " FAIL "\n");
+    return false;
+  }
+
+  printf("loaded_records() " PASS "\n");
+  return true;
+}
+
 bool test_set_item(const char *key, cJSON *json)
 {
   set_item(key, json);
@@ -186,6 +220,1506 @@ bool test_get_cjson_keys(cJSON *json, int expected_count)
   }
 }
 
+bool test_bulk_items(int count)
+{
+  DBKeys *keys = get_database_keys();
+  int before_count = keys->length;
+  free_keys(keys);
+
+  char key[32];
+  for (int i = 0; i < count; i++)
+  {
+    sprintf(key, "Bulk%d", i);
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "name", key);
+    set_item(key, json);
+  }
+
+  for (int i = 0; i < count; i++)
+  {
+    sprintf(key, "Bulk%d", i);
+    DBItem *item = get_item(key);
+    if (item == NULL || strcmp(cJSON_GetObjectItem(item->json, "name")->valuestring, key) != 0)
+    {
+      printf("bulk_items(%d) " FAIL " - %s not found\n", count, key);
+      return false;
+    }
+  }
+
+  keys = get_database_keys();
+  int after_count = keys->length;
+  free_keys(keys);
+  if (after_count != before_count + count)
+  {
+    printf("bulk_items(%d) " FAIL " - expected %d keys, got %d\n", count, before_count + count, after_count);
+    return false;
+  }
+
+  for (int i = 0; i < count; i++)
+  {
+    sprintf(key, "Bulk%d", i);
+    if (!delete_item(key))
+    {
+      printf("bulk_items(%d) " FAIL " - failed to delete %s\n", count, key);
+      return false;
+    }
+  }
+
+  keys = get_database_keys();
+  after_count = keys->length;
+  free_keys(keys);
+  if (after_count != before_count)
+  {
+    printf("bulk_items(%d) " FAIL " - expected %d keys, got %d\n", count, before_count, after_count);
+    return false;
+  }
+
+  printf("bulk_items(%d) " PASS "\n", count);
+  return true;
+}
+
+#define CONCURRENT_THREADS 4
+#define CONCURRENT_ITEMS 2000
+
+void *concurrent_worker(void *arg)
+{
+  int thread_id = *(int *)arg;
+  char key[32];
+  char new_key[32];
+  long failures = 0;
+
+  for (int i = 0; i < CONCURRENT_ITEMS; i++)
+  {
+    sprintf(key, "Thread%d-%d", thread_id, i);
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "name", key);
+    set_item(key, json);
+  }
+
+  for (int i = 0; i < CONCURRENT_ITEMS; i++)
+  {
+    sprintf(key, "Thread%d-%d", thread_id, i);
+    sprintf(new_key, "Renamed%d-%d", thread_id, i);
+    if (!exists(key) || rename_item(key, new_key) == NULL || exists(key))
+      failures++;
+  }
+
+  for (int i = 0; i < CONCURRENT_ITEMS; i++)
+  {
+    sprintf(new_key, "Renamed%d-%d", thread_id, i);
+    if (!delete_item(new_key))
+      failures++;
+  }
+
+  return (void *)failures;
+}
+
+bool test_concurrent_items()
+{
+  pthread_t threads[CONCURRENT_THREADS];
+  int thread_ids[CONCURRENT_THREADS];
+  long failures = 0;
+
+  for (int i = 0; i < CONCURRENT_THREADS; i++)
+  {
+    thread_ids[i] = i;
+    pthread_create(&threads[i], NULL, concurrent_worker, &thread_ids[i]);
+  }
+
+  for (int i = 0; i < CONCURRENT_THREADS; i++)
+  {
+    void *result = NULL;
+    pthread_join(threads[i], &result);
+    failures += (long)result;
+  }
+
+  if (failures != 0)
+  {
+    printf("concurrent_items() " FAIL " - %ld failed operations\n", failures);
+    return false;
+  }
+
+  printf("concurrent_items() " PASS "\n");
+  return true;
+}
+
+#define LOCK_FREE_STABLE_ITEMS 500
+#define LOCK_FREE_CHURN_ITEMS 5000
+
+bool lock_free_writers_done = false;
+
+void *churn_writer(void *arg)
+{
+  int thread_id = *(int *)arg;
+  char key[32];
+
+  for (int round = 0; round < 3; round++)
+  {
+    for (int i = 0; i < LOCK_FREE_CHURN_ITEMS; i++)
+    {
+      sprintf(key, "Churn%d-%d", thread_id, i);
+      cJSON *json = cJSON_CreateObject();
+      cJSON_AddStringToObject(json, "name", key);
+      set_item(key, json);
+    }
+    for (int i = 0; i < LOCK_FREE_CHURN_ITEMS; i++)
+    {
+      sprintf(key, "Churn%d-%d", thread_id, i);
+      delete_item(key);
+    }
+  }
+
+  return NULL;
+}
+
+void *stable_reader(void *arg)
+{
+  char key[32];
+  long misses = 0;
+
+  (void)arg;
+
+  while (!__atomic_load_n(&lock_free_writers_done, __ATOMIC_ACQUIRE))
+  {
+    for (int i = 0; i < LOCK_FREE_STABLE_ITEMS; i++)
+    {
+      sprintf(key, "Stable%d", i);
+      if (!exists(key))
+        misses++;
+    }
+  }
+
+  return (void *)misses;
+}
+
+bool test_lock_free_reads()
+{
+  pthread_t writers[CONCURRENT_THREADS];
+  pthread_t readers[CONCURRENT_THREADS];
+  int thread_ids[CONCURRENT_THREADS];
+  char key[32];
+  long misses = 0;
+
+  for (int i = 0; i < LOCK_FREE_STABLE_ITEMS; i++)
+  {
+    sprintf(key, "Stable%d", i);
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "name", key);
+    set_item(key, json);
+  }
+
+  for (int i = 0; i < CONCURRENT_THREADS; i++)
+  {
+    thread_ids[i] = i;
+    pthread_create(&readers[i], NULL, stable_reader, NULL);
+    pthread_create(&writers[i], NULL, churn_writer, &thread_ids[i]);
+  }
+
+  for (int i = 0; i < CONCURRENT_THREADS; i++)
+    pthread_join(writers[i], NULL);
+  __atomic_store_n(&lock_free_writers_done, true, __ATOMIC_RELEASE);
+  for (int i = 0; i < CONCURRENT_THREADS; i++)
+  {
+    void *result = NULL;
+    pthread_join(readers[i], &result);
+    misses += (long)result;
+  }
+
+  for (int i = 0; i < LOCK_FREE_STABLE_ITEMS; i++)
+  {
+    sprintf(key, "Stable%d", i);
+    delete_item(key);
+  }
+
+  if (misses != 0)
+  {
+    printf("lock_free_reads() " FAIL " - %ld missed lookups\n", misses);
+    return false;
+  }
+
+  printf("lock_free_reads() " PASS "\n");
+  return true;
+}
+
+#define LOCK_FREE_RENAMES 20000
+
+void *rename_writer(void *arg)
+{
+  int thread_id = *(int *)arg;
+  char keys[2][32];
+
+  sprintf(keys[0], "Renamed%d-a", thread_id);
+  sprintf(keys[1], "Renamed%d-b", thread_id);
+  cJSON *json = cJSON_CreateObject();
+  cJSON_AddStringToObject(json, "name", keys[0]);
+  set_item(keys[0], json);
+  for (int i = 0; i < LOCK_FREE_RENAMES; i++)
+    rename_item(keys[i & 1], keys[(i + 1) & 1]);
+  delete_item(keys[LOCK_FREE_RENAMES & 1]);
+
+  return NULL;
+}
+
+// A renamed item is moved to the chain of its new key while lookups may
+// still walk the old one through it.
+bool test_lock_free_renames()
+{
+  pthread_t writers[CONCURRENT_THREADS];
+  pthread_t readers[CONCURRENT_THREADS];
+  int thread_ids[CONCURRENT_THREADS];
+  char key[32];
+  long misses = 0;
+
+  for (int i = 0; i < LOCK_FREE_STABLE_ITEMS; i++)
+  {
+    sprintf(key, "Stable%d", i);
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "name", key);
+    set_item(key, json);
+  }
+
+  __atomic_store_n(&lock_free_writers_done, false, __ATOMIC_RELEASE);
+  for (int i = 0; i < CONCURRENT_THREADS; i++)
+  {
+    thread_ids[i] = i;
+    pthread_create(&readers[i], NULL, stable_reader, NULL);
+    pthread_create(&writers[i], NULL, rename_writer, &thread_ids[i]);
+  }
+
+  for (int i = 0; i < CONCURRENT_THREADS; i++)
+    pthread_join(writers[i], NULL);
+  __atomic_store_n(&lock_free_writers_done, true, __ATOMIC_RELEASE);
+  for (int i = 0; i < CONCURRENT_THREADS; i++)
+  {
+    void *result = NULL;
+    pthread_join(readers[i], &result);
+    misses += (long)result;
+  }
+
+  for (int i = 0; i < LOCK_FREE_STABLE_ITEMS; i++)
+  {
+    sprintf(key, "Stable%d", i);
+    delete_item(key);
+  }
+
+  if (misses != 0)
+  {
+    printf("lock_free_renames() " FAIL " - %ld missed lookups\n", misses);
+    return false;
+  }
+
+  printf("lock_free_renames() " PASS "\n");
+  return true;
+}
+
+bool test_item_handles(const char *key)
+{
+  if (acquire_item("NotInDBName1") != NULL)
+  {
+    printf("item_handles(%s) " FAIL " - acquired a missing item\n", key);
+    return false;
+  }
+
+  cJSON *json = cJSON_CreateObject();
+  cJSON_AddStringToObject(json, "name", key);
+  set_item(key, json);
+
+  DBItem *item = acquire_item(key);
+  if (item == NULL || item->json != json)
+  {
+    printf("item_handles(%s) " FAIL " - wrong item acquired\n", key);
+    release_item(item);
+    return false;
+  }
+
+  // the handle keeps the item readable after it is renamed and deleted
+  rename_item(key, "HandleRenamed");
+  delete_item("HandleRenamed");
+  reclaim_retired_pointers();
+  reclaim_retired_pointers();
+  reclaim_retired_pointers();
+
+  bool result = strcmp(item->key, "HandleRenamed") == 0 &&
+                strcmp(cJSON_GetObjectItem(item->json, "name")->valuestring, key) == 0 &&
+                !exists("HandleRenamed");
+  release_item(item);
+
+  if (!result)
+  {
+    printf("item_handles(%s) " FAIL "\n", key);
+    return false;
+  }
+
+  printf("item_handles(%s) " PASS "\n", key);
+  return true;
+}
+
+bool test_upsert_item(const char *key)
+{
+  cJSON *first_json = cJSON_CreateObject();
+  cJSON_AddStringToObject(first_json, "name", key);
+  DBItem *first_item = set_item(key, first_json);
+
+  DBItem *item = acquire_item(key);
+  cJSON *second_json = cJSON_CreateObject();
+  cJSON_AddStringToObject(second_json, "name", "Replaced");
+  DBItem *second_item = set_item(key, second_json);
+  reclaim_retired_pointers();
+  reclaim_retired_pointers();
+  reclaim_retired_pointers();
+
+  // the replaced json stays readable until the handle is released
+  bool result = first_item == second_item && item == first_item &&
+                get_item(key)->json == second_json &&
+                strcmp(cJSON_GetObjectItem(first_json, "name")->valuestring, key) == 0;
+  release_item(item);
+  delete_item(key);
+
+  if (!result)
+  {
+    printf("upsert_item(%s) " FAIL "\n", key);
+    return false;
+  }
+
+  printf("upsert_item(%s) " PASS "\n", key);
+  return true;
+}
+
+#define ALLOCATOR_ITEMS 100
+
+bool test_allocator_stats()
+{
+  char key[32];
+
+  // free every item that is still waiting for a grace period
+  reclaim_retired_pointers();
+  reclaim_retired_pointers();
+  reclaim_retired_pointers();
+  DBAllocatorStats before = get_allocator_stats();
+
+  // the keys are too long to be stored inside the items
+  for (int i = 0; i < ALLOCATOR_ITEMS; i++)
+  {
+    sprintf(key, "AllocatedItemWithALongKey%d", i);
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "name", key);
+    set_item(key, json);
+  }
+  DBAllocatorStats during = get_allocator_stats();
+
+  for (int i = 0; i < ALLOCATOR_ITEMS; i++)
+  {
+    sprintf(key, "AllocatedItemWithALongKey%d", i);
+    delete_item(key);
+  }
+  reclaim_retired_pointers();
+  reclaim_retired_pointers();
+  reclaim_retired_pointers();
+  DBAllocatorStats after = get_allocator_stats();
+
+  // the deleted items and keys are kept for reuse
+  bool result = during.items_used == before.items_used + ALLOCATOR_ITEMS &&
+                after.items_used == before.items_used &&
+                after.items_free >= ALLOCATOR_ITEMS &&
+                during.key_bytes_used > before.key_bytes_used &&
+                after.key_bytes_used == before.key_bytes_used &&
+                after.reserved_bytes == during.reserved_bytes;
+
+  if (!result)
+  {
+    printf("allocator_stats() " FAIL "\n");
+    return false;
+  }
+
+  printf("allocator_stats() " PASS "\n");
+  return true;
+}
+
+bool test_inline_keys()
+{
+  const char *long_key = "A key that is too long to be stored inside the item";
+  cJSON *short_json = cJSON_CreateObject();
+  cJSON *long_json = cJSON_CreateObject();
+  DBItem *short_item = set_item("Inline", short_json);
+  DBItem *long_item = set_item(long_key, long_json);
+
+  bool result = short_item->key == short_item->inline_key &&
+                long_item->key != long_item->inline_key &&
+                strcmp(long_item->key, long_key) == 0 &&
+                get_item("Inline") == short_item;
+
+  // a renamed item keeps its inline key for the readers that may still see it
+  rename_item("Inline", "Renamed");
+  result = result && short_item->key != short_item->inline_key &&
+           strcmp(short_item->key, "Renamed") == 0 &&
+           strcmp(short_item->inline_key, "Inline") == 0 &&
+           get_item("Renamed") == short_item && !exists("Inline");
+
+  delete_item("Renamed");
+  delete_item(long_key);
+
+  if (!result)
+  {
+    printf("inline_keys() " FAIL "\n");
+    return false;
+  }
+
+  printf("inline_keys() " PASS "\n");
+  return true;
+}
+
+bool test_hash_key()
+{
+  // "Ab" and "BA" collided with the previous hash
+  DBHashedKey first = hash_key("AbAbAbAbAbAb");
+  DBHashedKey second = hash_key("BABABABABABA");
+  DBHashedKey again = hash_key("AbAbAbAbAbAb");
+  DBHashedKey empty = hash_key("");
+
+  bool result = first.hash == again.hash && first.hash != second.hash &&
+                first.length == 12 && empty.length == 0 && empty.hash != first.hash;
+
+  // the words are read past the end of the key, but not into a page that
+  // can not be read, and the key hashes the same wherever it is
+  const char *key = "ABCDEFGHIJKLMNOPQRST";
+  long page_size = sysconf(_SC_PAGESIZE);
+  char *pages = (char *)mmap(NULL, (size_t)page_size * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  char copy[32];
+  DBHashedKey expected;
+  DBHashedKey at_end;
+
+  result = result && pages != MAP_FAILED && mprotect(pages + page_size, (size_t)page_size, PROT_NONE) == 0;
+  for (size_t length = 0; result && length <= strlen(key); length++)
+  {
+    memcpy(copy + 1, key, length);
+    copy[length + 1] = '\0';
+    expected = hash_key(copy + 1);
+    memcpy(pages + page_size - length - 1, copy + 1, length + 1);
+    at_end = hash_key(pages + page_size - length - 1);
+    result = expected.length == length && at_end.length == length && at_end.hash == expected.hash;
+  }
+  if (pages != MAP_FAILED)
+    munmap(pages, (size_t)page_size * 2);
+
+  if (!result)
+  {
+    printf("hash_key() " FAIL "\n");
+    return false;
+  }
+
+  printf("hash_key() " PASS "\n");
+  return true;
+}
+
+// Returns true if the iterator returns exactly the expected keys.
+bool expect_keys(DBKeyIterator *iterator, const char **expected, int count)
+{
+  const char *key = NULL;
+  int i = 0;
+
+  while ((key = next_database_key(iterator)) != NULL)
+  {
+    if (i >= count || strcmp(key, expected[i++]) != 0)
+    {
+      close_database_iterator(iterator);
+      return false;
+    }
+  }
+
+  return i == count;
+}
+
+bool test_ordered_keys()
+{
+  const char *keys[] = {"Ordered:Sara", "Ordered:Rz", "Ordered:Sb", "Ordered:Sa1", "Ordered:Sam"};
+  const char *prefix_keys[] = {"Ordered:Sa1", "Ordered:Sam", "Ordered:Sara"};
+  const char *range_keys[] = {"Ordered:Sam", "Ordered:Sara"};
+  const char *renamed_keys[] = {"Ordered:Sa1", "Ordered:Sara"};
+
+  for (int i = 0; i < 5; i++)
+    set_item(keys[i], cJSON_CreateObject());
+
+  DBKeyIterator iterator = scan_database_prefix("Ordered:Sa");
+  bool result = expect_keys(&iterator, prefix_keys, 3);
+  iterator = scan_database_range("Ordered:Sam", "Ordered:Sb");
+  result = result && expect_keys(&iterator, range_keys, 2);
+
+  rename_item("Ordered:Sam", "Ordered:Zed");
+  delete_item("Ordered:Rz");
+  iterator = scan_database_prefix("Ordered:Sa");
+  result = result && expect_keys(&iterator, renamed_keys, 2);
+  iterator = scan_database_range("Ordered:", "Ordered:Sa");
+  result = result && next_database_key(&iterator) == NULL;
+
+  // resumed after the last key returned, deleted meanwhile, and a key added
+  // before it is not returned
+  iterator = scan_database_prefix("Ordered:Sa");
+  const char *key = next_database_key(&iterator);
+  result = result && key != NULL && strcmp(key, "Ordered:Sa1") == 0;
+  delete_item("Ordered:Sa1");
+  set_item("Ordered:Sa0", cJSON_CreateObject());
+  key = next_database_key(&iterator);
+  result = result && key != NULL && strcmp(key, "Ordered:Sara") == 0 && next_database_key(&iterator) == NULL;
+  delete_item("Ordered:Sa0");
+
+  // every key is listed in order
+  DBKeys *database_keys = get_database_keys();
+  for (int i = 1; i < database_keys->length; i++)
+  {
+    if (strcmp(database_keys->keys[i - 1], database_keys->keys[i]) >= 0)
+      result = false;
+  }
+  free_keys(database_keys);
+
+  delete_item("Ordered:Sa1");
+  delete_item("Ordered:Sara");
+  delete_item("Ordered:Sb");
+  delete_item("Ordered:Zed");
+
+  if (!result)
+  {
+    printf("ordered_keys() " FAIL "\n");
+    return false;
+  }
+
+  printf("ordered_keys() " PASS "\n");
+  return true;
+}
+
+#define BATCH_ITEMS 100
+
+bool test_batch_items()
+{
+  char key_buffers[BATCH_ITEMS][32];
+  const char *keys[BATCH_ITEMS + 1];
+  cJSON *jsons[BATCH_ITEMS + 1];
+  DBItem *items[BATCH_ITEMS + 1];
+  bool results[BATCH_ITEMS + 1];
+
+  for (int i = 0; i < BATCH_ITEMS; i++)
+  {
+    sprintf(key_buffers[i], "Batch%d", i);
+    keys[i] = key_buffers[i];
+    jsons[i] = cJSON_CreateObject();
+  }
+  // a repeated key is set in the order of the batch
+  keys[BATCH_ITEMS] = keys[0];
+  jsons[BATCH_ITEMS] = cJSON_CreateObject();
+
+  bool result = set_items(keys, jsons, BATCH_ITEMS + 1, items) == BATCH_ITEMS + 1 &&
+                items[0] == items[BATCH_ITEMS] && get_item(keys[0])->json == jsons[BATCH_ITEMS];
+
+  keys[BATCH_ITEMS] = "NotInDBName1";
+  result = result && get_items(keys, BATCH_ITEMS + 1, items) == BATCH_ITEMS && items[BATCH_ITEMS] == NULL;
+  for (int i = 1; i < BATCH_ITEMS && result; i++)
+    result = items[i] != NULL && items[i]->json == jsons[i];
+
+  result = result && delete_items(keys, BATCH_ITEMS + 1, results) == BATCH_ITEMS && !results[BATCH_ITEMS];
+  for (int i = 0; i < BATCH_ITEMS && result; i++)
+    result = results[i] && !exists(keys[i]);
+
+  if (!result)
+  {
+    printf("batch_items() " FAIL "\n");
+    return false;
+  }
+
+  printf("batch_items() " PASS "\n");
+  return true;
+}
+
+#define SCAN_STABLE_ITEMS 1000
+#define SCAN_CHURN_ITEMS 4000
+
+void mark_scanned_item(DBItem *item, void *seen)
+{
+  int index = 0;
+  if (sscanf(item->key, "ScanStable%d", &index) == 1)
+    ((bool *)seen)[index] = true;
+}
+
+// Items are added and then deleted between the steps, so the tables grow and
+// shrink during the scan.
+bool test_scan_database()
+{
+  bool seen[SCAN_STABLE_ITEMS] = {false};
+  char key[32];
+  unsigned long cursor = 0;
+  int step = 0;
+
+  for (int i = 0; i < SCAN_STABLE_ITEMS; i++)
+  {
+    sprintf(key, "ScanStable%d", i);
+    set_item(key, cJSON_CreateObject());
+  }
+
+  do
+  {
+    cursor = scan_database(cursor, 1, mark_scanned_item, seen);
+    for (int i = 0; i < 8; i++, step++)
+    {
+      sprintf(key, "ScanChurn%d", step % SCAN_CHURN_ITEMS);
+      if (step < SCAN_CHURN_ITEMS)
+        set_item(key, cJSON_CreateObject());
+      else if (step < SCAN_CHURN_ITEMS * 2)
+        delete_item(key);
+    }
+  } while (cursor != 0);
+
+  bool result = true;
+  for (int i = 0; i < SCAN_STABLE_ITEMS; i++)
+  {
+    result = result && seen[i];
+    sprintf(key, "ScanStable%d", i);
+    delete_item(key);
+  }
+  for (int i = 0; i < SCAN_CHURN_ITEMS; i++)
+  {
+    sprintf(key, "ScanChurn%d", i);
+    delete_item(key);
+  }
+
+  if (!result)
+  {
+    printf("scan_database() " FAIL " - an item was missed\n");
+    return false;
+  }
+
+  printf("scan_database() " PASS "\n");
+  return true;
+}
+
+#define FILTER_ABSENT_LOOKUPS 10000
+
+bool test_filter_stats()
+{
+  char key[32];
+  DBFilterStats before = get_filter_stats();
+
+  for (int i = 0; i < FILTER_ABSENT_LOOKUPS; i++)
+  {
+    sprintf(key, "Absent%d", i);
+    exists(key);
+  }
+  DBFilterStats after = get_filter_stats();
+
+  unsigned long lookups = after.lookups - before.lookups;
+  unsigned long rejected = after.rejected - before.rejected;
+  unsigned long false_positives = after.false_positives - before.false_positives;
+
+  // the filters are sized for 1% of false positives at most
+  if (lookups != FILTER_ABSENT_LOOKUPS || rejected + false_positives != lookups ||
+      false_positives * 100 > FILTER_ABSENT_LOOKUPS)
+  {
+    printf("filter_stats() " FAIL " - %lu false positives\n", false_positives);
+    return false;
+  }
+
+  printf("filter_stats() " PASS "\n");
+  return true;
+}
+
+#define STATS_ITEMS 10
+
+bool test_db_stats()
+{
+  char key[32];
+  DBStats before = db_stats();
+  cJSON *json = NULL;
+
+  for (int i = 0; i < STATS_ITEMS; i++)
+  {
+    sprintf(key, "StatsItem%d", i);
+    json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "a", "xyz");
+    set_item(key, json);
+  }
+  DBStats during = db_stats();
+
+  for (int i = 0; i < STATS_ITEMS; i++)
+  {
+    sprintf(key, "StatsItem%d", i);
+    delete_item(key);
+  }
+  DBStats after = db_stats();
+
+  // an object and a string, "xyz" with its terminator, "a" is pooled
+  if (during.items - before.items != STATS_ITEMS || during.inserts - before.inserts != STATS_ITEMS ||
+      during.json_nodes - before.json_nodes != 2 * STATS_ITEMS ||
+      during.json_string_bytes - before.json_string_bytes != 4 * STATS_ITEMS ||
+      during.item_bytes <= before.item_bytes || during.index_bytes <= before.index_bytes ||
+      after.items != before.items || after.json_nodes != before.json_nodes ||
+      after.json_string_bytes != before.json_string_bytes ||
+      after.deletes - before.deletes != STATS_ITEMS)
+  {
+    printf("db_stats() " FAIL "\n");
+    return false;
+  }
+
+  printf("db_stats() " PASS "\n");
+  return true;
+}
+
+bool test_interned_names()
+{
+  cJSON *first = cJSON_CreateObject();
+  cJSON *second = cJSON_CreateObject();
+  cJSON *address = cJSON_CreateObject();
+  cJSON_AddStringToObject(first, "name", "InternedFirst");
+  cJSON_AddStringToObject(second, "name", "InternedSecond");
+  cJSON_AddStringToObject(address, "city", "Taipei");
+  cJSON_AddItemToObject(second, "address", address);
+  set_item("InternedFirst", first);
+  set_item("InternedSecond", second);
+
+  cJSON *first_name = cJSON_GetObjectItem(get_item("InternedFirst")->json, "name");
+  cJSON *second_name = cJSON_GetObjectItem(get_item("InternedSecond")->json, "name");
+  cJSON *city = cJSON_GetObjectItem(cJSON_GetObjectItem(get_item("InternedSecond")->json, "address"), "city");
+
+  // the names of nested objects are pooled too, and the pool survives the items
+  bool result = first_name->string == second_name->string && (first_name->type & cJSON_StringIsConst) &&
+                city->string == intern_string("city") && intern_string("name") == first_name->string &&
+                strcmp(first_name->valuestring, "InternedFirst") == 0;
+  delete_item("InternedFirst");
+  delete_item("InternedSecond");
+  result = result && strcmp(intern_string("name"), "name") == 0;
+
+  if (!result)
+  {
+    printf("interned_names() " FAIL "\n");
+    return false;
+  }
+
+  printf("interned_names() " PASS "\n");
+  return true;
+}
+
+#define TTL_ITEMS 100
+#define TTL_MS 30
+
+bool test_item_ttl()
+{
+  char key[32];
+  DBStats before = db_stats();
+
+  for (int i = 0; i < TTL_ITEMS; i++)
+  {
+    sprintf(key, "TTLItem%d", i);
+    set_item_with_ttl(key, cJSON_CreateObject(), TTL_MS);
+  }
+  // past the range of the wheel, and an expiry removed by set_item
+  set_item_with_ttl("TTLLongItem", cJSON_CreateObject(), 30L * 24 * 3600 * 1000);
+  set_item_with_ttl("TTLClearedItem", cJSON_CreateObject(), TTL_MS);
+  set_item("TTLClearedItem", cJSON_CreateObject());
+
+  long ttl = get_item_ttl("TTLItem0");
+  // the timer is in the extra fields, that only such items have
+  bool result = ttl > 0 && ttl <= TTL_MS && get_item("TTLItem0") != NULL &&
+                get_item("TTLItem0")->extra != NULL && get_item("TTLItem0")->extra->timer != NULL &&
+                get_item_ttl("TTLLongItem") > TTL_MS && get_item_ttl("TTLClearedItem") == -1 &&
+                get_item_ttl("TTLAbsentItem") == -2 && db_stats().expiring_items == before.expiring_items + TTL_ITEMS + 1;
+
+  // absent as soon as they expire, freed by the wheel
+  usleep((TTL_MS + 20) * 1000);
+  result = result && !exists("TTLItem0") && get_item("TTLItem1") == NULL && get_item_ttl("TTLItem2") == -2 &&
+           !delete_item("TTLItem3") && rename_item("TTLItem4", "TTLRenamedItem") == NULL;
+  expire_items();
+  DBStats after = db_stats();
+
+  result = result && after.expirations - before.expirations == TTL_ITEMS &&
+           after.items == before.items + 2 && after.expiring_items == before.expiring_items + 1 &&
+           exists("TTLClearedItem") && get_item_ttl("TTLLongItem") > 0;
+
+  // a rename keeps the expiry
+  rename_item("TTLLongItem", "TTLRenamedItem");
+  result = result && get_item_ttl("TTLRenamedItem") > TTL_MS;
+  delete_item("TTLRenamedItem");
+  delete_item("TTLClearedItem");
+  result = result && db_stats().expiring_items == before.expiring_items;
+
+  if (!result)
+  {
+    printf("item_ttl() " FAIL "\n");
+    return false;
+  }
+
+  printf("item_ttl() " PASS "\n");
+  return true;
+}
+
+#define WHEEL_TIMERS 6
+
+// The tick a timer expired at is stored in its data.
+void static record_expiry(DBTimer *timer, void *wheel)
+{
+  *(uint64_t *)timer->data = ((DBTimingWheel *)wheel)->tick - 1;
+}
+
+// Timers on every level and past the last one expire at their deadline, in
+// wheels advanced by far more ticks than they could step through one by one.
+bool test_timing_wheel()
+{
+  uint64_t deadlines[WHEEL_TIMERS] = {5, 70, 4100, 300000, 20000000, (uint64_t)1 << 40};
+  uint64_t expired_at[WHEEL_TIMERS] = {0};
+  uint64_t ticks[] = {3, 69, 70, 1000000, (uint64_t)1 << 39, (uint64_t)1 << 50};
+  unsigned long expected[] = {0, 1, 1, 2, 1, 1};
+  DBTimer timers[WHEEL_TIMERS];
+  DBTimingWheel wheel;
+  bool result = true;
+
+  init_timing_wheel(&wheel, 1);
+  for (int i = 0; i < WHEEL_TIMERS; i++)
+  {
+    timers[i].deadline = deadlines[i];
+    timers[i].data = &expired_at[i];
+    add_timer(&wheel, &timers[i]);
+  }
+
+  for (int i = 0; i < (int)(sizeof(ticks) / sizeof(ticks[0])); i++)
+    result = result && advance_timing_wheel(&wheel, ticks[i], record_expiry, &wheel) == expected[i] && wheel.tick == ticks[i] + 1;
+  for (int i = 0; i < WHEEL_TIMERS; i++)
+    result = result && expired_at[i] == deadlines[i];
+  result = result && wheel.count == 0;
+
+  // a removed timer empties its slot
+  init_timing_wheel(&wheel, 0);
+  add_timer(&wheel, &timers[0]);
+  add_timer(&wheel, &timers[1]);
+  remove_timer(&wheel, &timers[0]);
+  remove_timer(&wheel, &timers[1]);
+  expired_at[0] = 0;
+  result = result && advance_timing_wheel(&wheel, (uint64_t)1 << 40, record_expiry, &wheel) == 0 && expired_at[0] == 0;
+
+  if (!result)
+  {
+    printf("timing_wheel() " FAIL "\n");
+    return false;
+  }
+
+  printf("timing_wheel() " PASS "\n");
+  return true;
+}
+
+#define WAL_FILENAME "test.wal"
+#define WAL_SAVE_FILENAME "test-wal.json"
+
+long static get_file_size(const char *filename)
+{
+  struct stat status;
+
+  return stat(filename, &status) == 0 ? (long)status.st_size : -1;
+}
+
+bool static has_number(const char *key, int number)
+{
+  DBItem *item = get_item(key);
+
+  return item != NULL && cJSON_GetObjectItem(item->json, "number") != NULL &&
+         cJSON_GetObjectItem(item->json, "number")->valueint == number;
+}
+
+bool test_write_log()
+{
+  const char *keys[] = {"WalItem4", "WalItem5"};
+  cJSON *jsons[2];
+  DBItem *items[2];
+  bool results[2];
+  cJSON *json = NULL;
+
+  // the writes return once on disk
+  set_write_log_sync_policy(DBLogSync_Always, 0);
+  unlink(WAL_FILENAME);
+  unlink(WAL_FILENAME WRITE_LOG_ROTATED_SUFFIX);
+  bool result = open_database_log(WAL_FILENAME);
+
+  for (int i = 1; i <= 2; i++)
+  {
+    json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "number", i);
+    set_item(i == 1 ? "WalItem1" : "WalItem2", json);
+  }
+  rename_item("WalItem2", "WalItem3");
+  for (int i = 0; i < 2; i++)
+  {
+    jsons[i] = cJSON_CreateObject();
+    cJSON_AddNumberToObject(jsons[i], "number", i + 4);
+  }
+  set_items(keys, jsons, 2, items);
+  delete_item("WalItem1");
+  close_database_log();
+
+  // lost without the log, and a record torn by a crash
+  delete_items(keys, 2, results);
+  delete_item("WalItem3");
+  long size = get_file_size(WAL_FILENAME);
+  FILE *file = fopen(WAL_FILENAME, "ab");
+  result = result && file != NULL && fwrite("torn", 1, 4, file) == 4;
+  if (file != NULL)
+    fclose(file);
+
+  result = result && open_database_log(WAL_FILENAME) && get_file_size(WAL_FILENAME) == size &&
+           !exists("WalItem1") && !exists("WalItem2") && has_number("WalItem3", 2) &&
+           has_number("WalItem4", 4) && has_number("WalItem5", 5);
+
+  // the records are dropped once saved
+  save_database(WAL_SAVE_FILENAME);
+  result = result && get_file_size(WAL_FILENAME) == 0 && get_file_size(WAL_FILENAME WRITE_LOG_ROTATED_SUFFIX) == -1 &&
+           get_file_size(WAL_SAVE_FILENAME) > 0;
+  delete_item("WalItem3");
+  result = result && get_file_size(WAL_FILENAME) > 0;
+
+  close_database_log();
+  delete_items(keys, 2, results);
+  unlink(WAL_FILENAME);
+  unlink(WAL_SAVE_FILENAME);
+  set_write_log_sync_policy(WRITE_LOG_DEFAULT_SYNC_POLICY, WRITE_LOG_DEFAULT_SYNC_INTERVAL_MS);
+
+  if (!result)
+  {
+    printf("write_log() " FAIL "\n");
+    return false;
+  }
+
+  printf("write_log() " PASS "\n");
+  return true;
+}
+
+#define GROUP_COMMIT_THREADS 8
+#define GROUP_COMMIT_ITEMS 200
+#define GROUP_COMMIT_INTERVAL_MS 20
+
+void *group_commit_writer(void *arg)
+{
+  int thread_id = *(int *)arg;
+  char key[32];
+  long failures = 0;
+  DBWriteLogStats stats;
+
+  for (int i = 0; i < GROUP_COMMIT_ITEMS; i++)
+  {
+    sprintf(key, "Commit%d-%d", thread_id, i);
+    set_item(key, cJSON_CreateObject());
+    // returned once the record is fsynced
+    stats = get_write_log_stats();
+    if (stats.syncs == 0)
+      failures++;
+    delete_item(key);
+  }
+
+  return (void *)failures;
+}
+
+void static count_log_record(DBLogRecordType type, const char *key, const char *value, uint64_t expires_at,
+                             void *data)
+{
+  (void)type;
+  (void)key;
+  (void)value;
+  (void)expires_at;
+  (*(unsigned long *)data)++;
+}
+
+// Polls the stats of the log until `syncs` or `writes` goes past `before`.
+bool static wait_for_log_stats(DBWriteLogStats before, bool sync)
+{
+  DBWriteLogStats stats;
+
+  for (int i = 0; i < 1000; i++)
+  {
+    stats = get_write_log_stats();
+    if ((sync && stats.syncs > before.syncs) || (!sync && stats.writes > before.writes))
+      return true;
+    usleep(1000);
+  }
+
+  return false;
+}
+
+bool test_group_commit()
+{
+  pthread_t threads[GROUP_COMMIT_THREADS];
+  int thread_ids[GROUP_COMMIT_THREADS];
+  long failures = 0;
+
+  set_write_log_sync_policy(DBLogSync_Always, 0);
+  unlink(WAL_FILENAME);
+  bool result = open_database_log(WAL_FILENAME);
+  DBWriteLogStats before = get_write_log_stats();
+
+  for (int i = 0; i < GROUP_COMMIT_THREADS; i++)
+  {
+    thread_ids[i] = i;
+    pthread_create(&threads[i], NULL, group_commit_writer, &thread_ids[i]);
+  }
+  for (int i = 0; i < GROUP_COMMIT_THREADS; i++)
+  {
+    void *failed = NULL;
+    pthread_join(threads[i], &failed);
+    failures += (long)failed;
+  }
+
+  // every record is on disk, a sync per batch at most
+  DBWriteLogStats after = get_write_log_stats();
+  unsigned long records = after.records - before.records;
+  unsigned long replayed = 0;
+  replay_write_log(WAL_FILENAME, count_log_record, &replayed);
+  result = result && failures == 0 && records == 2 * GROUP_COMMIT_THREADS * GROUP_COMMIT_ITEMS &&
+           replayed == records && after.syncs - before.syncs == after.writes - before.writes &&
+           after.writes - before.writes <= records;
+
+  // written without a sync
+  set_write_log_sync_policy(DBLogSync_Never, 0);
+  before = get_write_log_stats();
+  delete_item("Commit0-0");
+  set_item("Commit0-0", cJSON_CreateObject());
+  result = result && wait_for_log_stats(before, false) && get_write_log_stats().syncs == before.syncs;
+
+  // written and synced by the flusher alone
+  set_write_log_sync_policy(DBLogSync_Periodic, GROUP_COMMIT_INTERVAL_MS);
+  before = get_write_log_stats();
+  delete_item("Commit0-0");
+  result = result && wait_for_log_stats(before, true);
+
+  close_database_log();
+  unlink(WAL_FILENAME);
+  set_write_log_sync_policy(WRITE_LOG_DEFAULT_SYNC_POLICY, WRITE_LOG_DEFAULT_SYNC_INTERVAL_MS);
+
+  if (!result)
+  {
+    printf("group_commit() " FAIL "\n");
+    return false;
+  }
+
+  printf("group_commit() " PASS "\n");
+  return true;
+}
+
+#define CHECKPOINT_FILENAME "test-checkpoint.json"
+#define CHECKPOINT_INTERVAL_MS 10
+#define CHECKPOINT_ROUNDS 20
+#define CHECKPOINT_ITEMS 100
+
+// Returns NULL if the file does not exist.
+cJSON static *read_json_file(const char *filename)
+{
+  char data[1 << 16];
+  FILE *file = fopen(filename, "r");
+
+  if (file == NULL)
+    return NULL;
+
+  size_t length = fread(data, 1, sizeof(data) - 1, file);
+  data[length] = '\0';
+  fclose(file);
+
+  return cJSON_Parse(data);
+}
+
+bool test_checkpointer()
+{
+  char key[32];
+  cJSON *json = NULL;
+  DBStats before = db_stats();
+
+  // an empty log is only seen after a checkpoint that has every write
+  set_write_log_sync_policy(DBLogSync_Always, 0);
+  unlink(WAL_FILENAME);
+  bool result = open_database_log(WAL_FILENAME) && start_checkpointer(CHECKPOINT_FILENAME, CHECKPOINT_INTERVAL_MS);
+
+  // written while the checkpoints scan the shards
+  for (int round = 0; round < CHECKPOINT_ROUNDS; round++)
+  {
+    for (int i = 0; i < CHECKPOINT_ITEMS; i++)
+    {
+      sprintf(key, "Checkpoint%d", i);
+      json = cJSON_CreateObject();
+      cJSON_AddNumberToObject(json, "number", round);
+      set_item(key, json);
+    }
+    usleep(1000);
+  }
+
+  // the log is emptied by the first checkpoint after the last write
+  for (int i = 0; i < 1000 && (db_stats().checkpoints == before.checkpoints || get_file_size(WAL_FILENAME) != 0); i++)
+    usleep(1000);
+  stop_checkpointer();
+  close_database_log();
+  result = result && db_stats().checkpoints > before.checkpoints && get_file_size(WAL_FILENAME) == 0;
+
+  // the last checkpoint has the last writes, in the file or in its changes
+  cJSON *saved = read_json_file(CHECKPOINT_FILENAME);
+  cJSON *delta = read_json_file(CHECKPOINT_FILENAME DATABASE_DELTA_SUFFIX);
+  cJSON *changes = cJSON_GetObjectItem(delta, "set");
+  for (int i = 0; i < CHECKPOINT_ITEMS; i++)
+  {
+    sprintf(key, "Checkpoint%d", i);
+    json = cJSON_GetObjectItem(changes, key) != NULL ? cJSON_GetObjectItem(changes, key) : cJSON_GetObjectItem(saved, key);
+    result = result && json != NULL && cJSON_GetObjectItem(json, "number")->valueint == CHECKPOINT_ROUNDS - 1;
+    delete_item(key);
+  }
+  result = result && cJSON_GetObjectItem(saved, "Alice") == NULL && cJSON_GetObjectItem(saved, "Bob") != NULL;
+  cJSON_Delete(saved);
+  cJSON_Delete(delta);
+  unlink(WAL_FILENAME);
+  unlink(CHECKPOINT_FILENAME);
+  unlink(CHECKPOINT_FILENAME DATABASE_DELTA_SUFFIX);
+  set_write_log_sync_policy(WRITE_LOG_DEFAULT_SYNC_POLICY, WRITE_LOG_DEFAULT_SYNC_INTERVAL_MS);
+
+  if (!result)
+  {
+    printf("checkpointer() " FAIL "\n");
+    return false;
+  }
+
+  printf("checkpointer() " PASS "\n");
+  return true;
+}
+
+#define BUDGET_ITEMS 64
+#define BUDGET_SPILL_FILENAME "test-budget.spill"
+
+// Must run after the tests that keep pointers to a json, which may be evicted.
+bool test_memory_budget()
+{
+  char key[32];
+  cJSON *json = NULL;
+
+  for (int i = 0; i < BUDGET_ITEMS; i++)
+  {
+    sprintf(key, "BudgetItem%d", i);
+    json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "name", key);
+    cJSON_AddNumberToObject(json, "index", i);
+    set_item(key, json);
+  }
+
+  DBItem *handle = acquire_item("BudgetItem0");
+  DBStats before = db_stats();
+  unsigned long budget = before.json_bytes / 2;
+  set_memory_spill_file(BUDGET_SPILL_FILENAME);
+  bool result = set_memory_budget(budget) && get_file_size(BUDGET_SPILL_FILENAME) > 0;
+  DBStats during = db_stats();
+
+  // exists does not read the evicted jsons back
+  for (int i = 0; i < BUDGET_ITEMS; i++)
+  {
+    sprintf(key, "BudgetItem%d", i);
+    result = result && exists(key);
+  }
+  DBStats checked = db_stats();
+
+  result = result && during.json_bytes <= budget && during.evicted_items > 0 &&
+           during.evictions > before.evictions && during.spill_bytes > 0 &&
+           checked.reloads == during.reloads && handle->json != NULL;
+
+  // evicted jsons are read back
+  for (int i = 0; i < BUDGET_ITEMS; i++)
+  {
+    sprintf(key, "BudgetItem%d", i);
+    DBItem *item = get_item(key);
+    result = result && item != NULL && item->json != NULL &&
+             strcmp(cJSON_GetObjectItem(item->json, "name")->valuestring, key) == 0 &&
+             cJSON_GetObjectItem(item->json, "index")->valueint == i;
+  }
+  // the json read back last is evicted by the next lookup, the json of the
+  // handle stays resident
+  result = result && get_item("BudgetItem0") == handle;
+  DBStats after = db_stats();
+  result = result && after.reloads > checked.reloads && after.json_bytes <= budget;
+
+  // every json but the one of the handle is over a budget this small, the
+  // json returned is still not evicted by the lookup that read it back
+  DBItem *items[2];
+  const char *keys[2] = {"BudgetItem1", "BudgetItem2"};
+  result = result && set_memory_budget(1);
+  for (int i = 0; i < BUDGET_ITEMS; i++)
+  {
+    sprintf(key, "BudgetItem%d", i);
+    DBItem *item = get_item(key);
+    result = result && item != NULL && item->json != NULL;
+  }
+  result = result && get_items(keys, 2, items) == 2 && items[0]->json != NULL && items[1]->json != NULL;
+
+  release_item(handle);
+  set_memory_budget(0);
+  for (int i = 0; i < BUDGET_ITEMS; i++)
+  {
+    sprintf(key, "BudgetItem%d", i);
+    result = result && delete_item(key);
+  }
+  unlink(BUDGET_SPILL_FILENAME);
+
+  if (!result)
+  {
+    printf("memory_budget() " FAIL "\n");
+    return false;
+  }
+
+  printf("memory_budget() " PASS "\n");
+  return true;
+}
+
+#define DELTA_FILENAME "test-delta.json"
+#define DELTA_ITEMS 100
+#define DELTA_FULL_CHANGES 40
+
+void static set_number_item(const char *key, int number)
+{
+  cJSON *json = cJSON_CreateObject();
+
+  cJSON_AddNumberToObject(json, "number", number);
+  set_item(key, json);
+}
+
+// Loads the database again, must run after the tests that keep pointers to
+// a json.
+bool test_delta_save()
+{
+  char key[32];
+  char stale_delta[1 << 12];
+  size_t stale_length = 0;
+  struct stat base_before;
+  struct stat base_after;
+
+  for (int i = 0; i < DELTA_ITEMS; i++)
+  {
+    sprintf(key, "DeltaItem%d", i);
+    set_number_item(key, i);
+  }
+  save_database(DELTA_FILENAME);
+  DBStats saved = db_stats();
+  bool result = saved.dirty_items == 0 && saved.deleted_keys == 0 && stat(DELTA_FILENAME, &base_before) == 0;
+
+  // a set, a rename, a delete, and a key deleted then set again
+  set_number_item("DeltaItem0", -1);
+  rename_item("DeltaItem1", "DeltaRenamed");
+  delete_item("DeltaItem2");
+  delete_item("DeltaItem3");
+  set_number_item("DeltaItem3", -3);
+  DBStats changed = db_stats();
+  save_database_changes(DELTA_FILENAME);
+  result = result && changed.dirty_items == 3 && changed.deleted_keys == 3 && stat(DELTA_FILENAME, &base_after) == 0 &&
+           base_after.st_ino == base_before.st_ino && base_after.st_size == base_before.st_size &&
+           get_file_size(DELTA_FILENAME DATABASE_DELTA_SUFFIX) > 0;
+
+  FILE *file = fopen(DELTA_FILENAME DATABASE_DELTA_SUFFIX, "r");
+  if (file != NULL)
+  {
+    stale_length = fread(stale_delta, 1, sizeof(stale_delta), file);
+    fclose(file);
+  }
+
+  // applied on top of the file, and tracked as changes again
+  load_database(DELTA_FILENAME);
+  changed = db_stats();
+  result = result && has_number("DeltaItem0", -1) && has_number("DeltaRenamed", 1) && !exists("DeltaItem1") &&
+           !exists("DeltaItem2") && has_number("DeltaItem3", -3) && has_number("DeltaItem4", 4) &&
+           changed.dirty_items == 3 && changed.deleted_keys == 2;
+
+  // too many changes, saved in full
+  for (int i = 0; i < DELTA_FULL_CHANGES; i++)
+  {
+    sprintf(key, "DeltaItem%d", i + 4);
+    set_number_item(key, -i);
+  }
+  save_database_changes(DELTA_FILENAME);
+  result = result && db_stats().dirty_items == 0 && get_file_size(DELTA_FILENAME DATABASE_DELTA_SUFFIX) == -1;
+
+  // changes left by a full save that did not finish are not applied
+  file = fopen(DELTA_FILENAME DATABASE_DELTA_SUFFIX, "w");
+  result = result && file != NULL && fwrite(stale_delta, 1, stale_length, file) == stale_length;
+  if (file != NULL)
+    fclose(file);
+  load_database(DELTA_FILENAME);
+  result = result && has_number("DeltaItem4", 0) && has_number("DeltaItem0", -1) &&
+           get_file_size(DELTA_FILENAME DATABASE_DELTA_SUFFIX) == -1 && db_stats().dirty_items == 0;
+
+  for (int i = 0; i < DELTA_ITEMS; i++)
+  {
+    sprintf(key, "DeltaItem%d", i);
+    delete_item(key);
+  }
+  delete_item("DeltaRenamed");
+  unlink(DELTA_FILENAME);
+
+  if (!result)
+  {
+    printf("delta_save() " FAIL "\n");
+    return false;
+  }
+
+  printf("delta_save() " PASS "\n");
+  return true;
+}
+
+#define PERSISTED_TTL_FILENAME "test-ttl.json"
+#define PERSISTED_TTL_LOG_FILENAME "test-ttl.wal"
+#define PERSISTED_TTL_MS 60000
+#define PERSISTED_TTL_ITEMS 8
+
+bool static has_persisted_ttl(const char *key)
+{
+  long ttl = get_item_ttl(key);
+
+  return ttl > PERSISTED_TTL_MS / 2 && ttl <= PERSISTED_TTL_MS;
+}
+
+// Expiries kept by a save, a delta and the log, and an item that expired
+// while it was not loaded.
+bool test_ttl_persistence()
+{
+  char key[32];
+
+  for (int i = 0; i < PERSISTED_TTL_ITEMS; i++)
+  {
+    sprintf(key, "PersistedItem%d", i);
+    set_item(key, cJSON_CreateObject());
+  }
+  set_item_with_ttl("PersistedTTLItem", cJSON_CreateObject(), PERSISTED_TTL_MS);
+  set_item_with_ttl("PersistedShortTTLItem", cJSON_CreateObject(), TTL_MS);
+  // keys that look like the member the expiries are saved in
+  set_item_with_ttl(DATABASE_EXPIRY_MEMBER, cJSON_CreateObject(), PERSISTED_TTL_MS);
+  set_item("$" DATABASE_EXPIRY_MEMBER, cJSON_CreateObject());
+  save_database(PERSISTED_TTL_FILENAME);
+
+  load_database(PERSISTED_TTL_FILENAME);
+  bool result = has_persisted_ttl("PersistedTTLItem") && has_persisted_ttl(DATABASE_EXPIRY_MEMBER) &&
+                get_item_ttl("$" DATABASE_EXPIRY_MEMBER) == -1 && get_item_ttl("PersistedItem0") == -1 &&
+                get_item_ttl("PersistedShortTTLItem") > 0;
+
+  // deleted when loaded after its expiry
+  usleep((TTL_MS + 20) * 1000);
+  load_database(PERSISTED_TTL_FILENAME);
+  result = result && !exists("PersistedShortTTLItem") && has_persisted_ttl("PersistedTTLItem") &&
+           db_stats().deleted_keys == 1;
+
+  // saved in the changes
+  set_item_with_ttl("PersistedDeltaTTLItem", cJSON_CreateObject(), PERSISTED_TTL_MS);
+  save_database_changes(PERSISTED_TTL_FILENAME);
+  result = result && get_file_size(PERSISTED_TTL_FILENAME DATABASE_DELTA_SUFFIX) > 0;
+  load_database(PERSISTED_TTL_FILENAME);
+  result = result && has_persisted_ttl("PersistedDeltaTTLItem") && has_persisted_ttl("PersistedTTLItem");
+
+  // replayed from the log, with a set and a rename
+  unlink(PERSISTED_TTL_LOG_FILENAME);
+  result = result && open_database_log(PERSISTED_TTL_LOG_FILENAME);
+  set_item_with_ttl("PersistedLoggedTTLItem", cJSON_CreateObject(), PERSISTED_TTL_MS);
+  rename_item("PersistedTTLItem", "PersistedRenamedTTLItem");
+  close_database_log();
+  delete_item("PersistedLoggedTTLItem");
+  delete_item("PersistedRenamedTTLItem");
+  result = result && open_database_log(PERSISTED_TTL_LOG_FILENAME) && has_persisted_ttl("PersistedLoggedTTLItem") &&
+           has_persisted_ttl("PersistedRenamedTTLItem") && !exists("PersistedTTLItem");
+  close_database_log();
+
+  for (int i = 0; i < PERSISTED_TTL_ITEMS; i++)
+  {
+    sprintf(key, "PersistedItem%d", i);
+    delete_item(key);
+  }
+  delete_item("PersistedDeltaTTLItem");
+  delete_item("PersistedLoggedTTLItem");
+  delete_item("PersistedRenamedTTLItem");
+  delete_item(DATABASE_EXPIRY_MEMBER);
+  delete_item("$" DATABASE_EXPIRY_MEMBER);
+  unlink(PERSISTED_TTL_FILENAME);
+  unlink(PERSISTED_TTL_FILENAME DATABASE_DELTA_SUFFIX);
+  unlink(PERSISTED_TTL_LOG_FILENAME);
+
+  if (!result)
+  {
+    printf("ttl_persistence() " FAIL "\n");
+    return false;
+  }
+
+  printf("ttl_persistence() " PASS "\n");
+  return true;
+}
+
+#define PARALLEL_FILENAME "test-parallel.json"
+#define PARALLEL_THREADS 4
+
+bool static has_records_of(cJSON *expected)
+{
+  DBKeys *keys = get_database_keys();
+  bool result = keys != NULL && keys->length == cJSON_GetArraySize(expected);
+  DBItem *item = NULL;
+
+  free_keys(keys);
+  for (cJSON *json = expected->child; result && json != NULL; json = json->next)
+  {
+    item = get_item(json->string);
+    result = item != NULL && cJSON_Compare(item->json, json, true);
+  }
+
+  return result;
+}
+
+// Loads the database again, from a file split between threads at commas
+// that its strings hold too.
+bool test_parallel_load()
+{
+  cJSON *tricky = cJSON_CreateObject();
+  cJSON *list = cJSON_AddArrayToObject(tricky, "list");
+
+  cJSON_AddStringToObject(tricky, "name", "\"},{\"x\":[");
+  cJSON_AddItemToArray(list, cJSON_CreateString("a,\\\",b"));
+  cJSON_AddItemToArray(list, cJSON_CreateObject());
+  set_item("Parallel, \"{key}\"", tricky);
+  save_database(PARALLEL_FILENAME);
+  cJSON *expected = read_json_file(PARALLEL_FILENAME);
+
+  set_database_load_threads(PARALLEL_THREADS);
+  load_database(PARALLEL_FILENAME);
+  bool result = expected != NULL && has_records_of(expected);
+
+  // the names of the loaded records are pooled
+  DBItem *item = get_item("Parallel, \"{key}\"");
+  result = result && item != NULL && cJSON_GetObjectItem(item->json, "list")->string == intern_string("list");
+
+  // nothing is loaded when a chunk is not valid, or empty after a trailing
+  // comma
+  const char *invalid[2] = {"{\"a\":1,\"b\":2,\"c\":x,\"d\":4,\"e\":5}", "{\"a\":1,\"b\":2,\"c\":3,}"};
+  FILE *file = NULL;
+  DBKeys *keys = NULL;
+  for (int i = 0; i < 2; i++)
+  {
+    file = fopen(PARALLEL_FILENAME, "w");
+    result = result && file != NULL && fputs(invalid[i], file) >= 0;
+    if (file != NULL)
+      fclose(file);
+    load_database(PARALLEL_FILENAME);
+    keys = get_database_keys();
+    result = result && keys != NULL && keys->length == 0;
+    free_keys(keys);
+  }
+
+  // the same records when loaded by a single thread
+  file = fopen(PARALLEL_FILENAME, "w");
+  char *text = expected != NULL ? cJSON_Print(expected) : NULL;
+  result = result && file != NULL && text != NULL && fputs(text, file) >= 0;
+  if (file != NULL)
+    fclose(file);
+  cJSON_free(text);
+  set_database_load_threads(1);
+  load_database(PARALLEL_FILENAME);
+  result = result && has_records_of(expected);
+  set_database_load_threads(0);
+
+  delete_item("Parallel, \"{key}\"");
+  cJSON_Delete(expected);
+  unlink(PARALLEL_FILENAME);
+
+  if (!result)
+  {
+    printf("parallel_load() " FAIL "\n");
+    return false;
+  }
+
+  printf("parallel_load() " PASS "\n");
+  return true;
+}
+
 int main()
 {
   // Load the database twice to test the cleaning functionality
@@ -197,6 +1731,7 @@ int main()
   test_stats[test_get_item("Alice", "Alice")]++;
   test_stats[test_get_item("Unknown", NULL)]++;
   test_stats[test_get_item(NULL, NULL)]++;
+  test_stats[test_loaded_records(26)]++;
 
   cJSON *new_person1 = cJSON_CreateObject();
   cJSON_AddStringToObject(new_person1, "name", "Person1");
@@ -206,6 +1741,7 @@ int main()
   cJSON_AddStringToObject(new_person2, "jobTitle", "Manager");
   test_stats[test_set_item("Person1", new_person1)]++;
   test_stats[test_set_item(NULL, new_person2)]++;
+  cJSON_Delete(new_person2);
   test_stats[test_set_item(NULL, NULL)]++;
 
   test_stats[test_rename_item("Alice", "Alex")]++;
@@ -217,8 +1753,32 @@ int main()
 
   test_stats[test_delete_item("Alex", true)]++;
   test_stats[test_delete_item("Unknown", false)]++;
+  test_stats[test_bulk_items(10000)]++;
+  test_stats[test_concurrent_items()]++;
+  test_stats[test_lock_free_reads()]++;
+  test_stats[test_lock_free_renames()]++;
+  test_stats[test_item_handles("Handle")]++;
+  test_stats[test_upsert_item("Upsert")]++;
+  test_stats[test_allocator_stats()]++;
+  test_stats[test_inline_keys()]++;
+  test_stats[test_hash_key()]++;
+  test_stats[test_ordered_keys()]++;
+  test_stats[test_batch_items()]++;
+  test_stats[test_scan_database()]++;
+  test_stats[test_filter_stats()]++;
+  test_stats[test_db_stats()]++;
+  test_stats[test_interned_names()]++;
+  test_stats[test_item_ttl()]++;
+  test_stats[test_timing_wheel()]++;
+  test_stats[test_write_log()]++;
+  test_stats[test_group_commit()]++;
+  test_stats[test_checkpointer()]++;
   test_stats[test_get_database_keys(26)]++;
   test_stats[test_get_cjson_keys(new_person1, 2)]++;
+  test_stats[test_memory_budget()]++;
+  test_stats[test_delta_save()]++;
+  test_stats[test_ttl_persistence()]++;
+  test_stats[test_parallel_load()]++;
 
   save_database("test-after.json");
 
@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "./timingwheel.h"
+
+#define TIMING_WHEEL_SLOT_MASK (TIMING_WHEEL_SLOTS - 1)
+// Ticks covered by the levels below `level`.
+#define TIMING_WHEEL_SPAN(level) ((uint64_t)1 << ((level) * TIMING_WHEEL_SLOT_BITS))
+
+DBTimer static **get_timer_slot(DBTimingWheel *wheel, uint64_t deadline);
+void static cascade_timers(DBTimingWheel *wheel, int level, unsigned long index);
+int static next_occupied_slot(uint64_t occupied, unsigned long index);
+uint64_t static get_next_event_tick(DBTimingWheel *wheel);
+
+void init_timing_wheel(DBTimingWheel *wheel, uint64_t tick)
+{
+  wheel->tick = tick;
+  wheel->count = 0;
+  for (int level = 0; level < TIMING_WHEEL_LEVELS; level++)
+  {
+    for (int i = 0; i < TIMING_WHEEL_SLOTS; i++)
+      wheel->slots[level][i] = NULL;
+    wheel->occupied[level] = 0;
+  }
+}
+
+void clear_timing_wheel(DBTimingWheel *wheel, void (*free_timer)(DBTimer *timer))
+{
+  DBTimer *timer = NULL;
+  DBTimer *next = NULL;
+
+  for (int level = 0; level < TIMING_WHEEL_LEVELS; level++)
+  {
+    for (int i = 0; i < TIMING_WHEEL_SLOTS; i++)
+    {
+      for (timer = wheel->slots[level][i]; timer != NULL; timer = next)
+      {
+        next = timer->next;
+        free_timer(timer);
+      }
+      wheel->slots[level][i] = NULL;
+    }
+    wheel->occupied[level] = 0;
+  }
+  wheel->count = 0;
+}
+
+// The level is the first one whose span holds the distance to the deadline.
+DBTimer static **get_timer_slot(DBTimingWheel *wheel, uint64_t deadline)
+{
+  if (deadline < wheel->tick)
+    deadline = wheel->tick;
+
+  uint64_t distance = deadline - wheel->tick;
+
+  for (int level = 0; level < TIMING_WHEEL_LEVELS - 1; level++)
+  {
+    if (distance < TIMING_WHEEL_SPAN(level + 1))
+      return &wheel->slots[level][(deadline >> (level * TIMING_WHEEL_SLOT_BITS)) & TIMING_WHEEL_SLOT_MASK];
+  }
+
+  // moved down again when its slot is reached
+  if (distance >= TIMING_WHEEL_SPAN(TIMING_WHEEL_LEVELS))
+    deadline = wheel->tick + TIMING_WHEEL_SPAN(TIMING_WHEEL_LEVELS) - 1;
+
+  return &wheel->slots[TIMING_WHEEL_LEVELS - 1][(deadline >> ((TIMING_WHEEL_LEVELS - 1) * TIMING_WHEEL_SLOT_BITS)) & TIMING_WHEEL_SLOT_MASK];
+}
+
+void add_timer(DBTimingWheel *wheel, DBTimer *timer)
+{
+  DBTimer **slot = get_timer_slot(wheel, timer->deadline);
+  unsigned long position = (unsigned long)(slot - &wheel->slots[0][0]);
+
+  timer->next = *slot;
+  timer->previous = slot;
+  if (*slot != NULL)
+    (*slot)->previous = &timer->next;
+  *slot = timer;
+  wheel->occupied[position / TIMING_WHEEL_SLOTS] |= (uint64_t)1 << (position & TIMING_WHEEL_SLOT_MASK);
+  wheel->count++;
+}
+
+// The first timer of a slot points to the slot itself, the slot is empty
+// once it is removed without a next timer.
+void remove_timer(DBTimingWheel *wheel, DBTimer *timer)
+{
+  uintptr_t position = ((uintptr_t)timer->previous - (uintptr_t)&wheel->slots[0][0]) / sizeof(DBTimer *);
+
+  *timer->previous = timer->next;
+  if (timer->next != NULL)
+    timer->next->previous = timer->previous;
+  else if (position < TIMING_WHEEL_LEVELS * TIMING_WHEEL_SLOTS)
+    wheel->occupied[position / TIMING_WHEEL_SLOTS] &= ~((uint64_t)1 << (position & TIMING_WHEEL_SLOT_MASK));
+  timer->next = NULL;
+  timer->previous = NULL;
+  wheel->count--;
+}
+
+// The slot is emptied before its timers are added again, they may land in
+// the same slot when their deadline is past the last level.
+void static cascade_timers(DBTimingWheel *wheel, int level, unsigned long index)
+{
+  DBTimer *timer = wheel->slots[level][index];
+  DBTimer *next = NULL;
+
+  wheel->slots[level][index] = NULL;
+  wheel->occupied[level] &= ~((uint64_t)1 << index);
+  for (; timer != NULL; timer = next)
+  {
+    next = timer->next;
+    wheel->count--;
+    add_timer(wheel, timer);
+  }
+}
+
+// Returns how many slots after `index` the first slot in use at or after it
+// is, wrapping around the level, -1 if none is.
+int static next_occupied_slot(uint64_t occupied, unsigned long index)
+{
+  if (occupied == 0)
+    return -1;
+
+  uint64_t rotated = index == 0 ? occupied : (occupied >> index) | (occupied << (TIMING_WHEEL_SLOTS - index));
+
+  return __builtin_ctzll(rotated);
+}
+
+// The first tick from the current one at which a slot of level 0 expires,
+// or a slot of a higher level is moved down, the wheel must not be empty.
+// Nothing happens on the ticks in between.
+uint64_t static get_next_event_tick(DBTimingWheel *wheel)
+{
+  uint64_t next = UINT64_MAX;
+  uint64_t position = 0;
+  uint64_t tick = 0;
+  int distance = 0;
+
+  for (int level = 0; level < TIMING_WHEEL_LEVELS; level++)
+  {
+    // the slots of a level above 0 are moved down on the ticks where the
+    // levels below wrap, the first of which is rounded up from the current
+    position = (wheel->tick + TIMING_WHEEL_SPAN(level) - 1) >> (level * TIMING_WHEEL_SLOT_BITS);
+    distance = next_occupied_slot(wheel->occupied[level], position & TIMING_WHEEL_SLOT_MASK);
+    if (distance < 0)
+      continue;
+
+    tick = (position + (uint64_t)distance) << (level * TIMING_WHEEL_SLOT_BITS);
+    if (tick < next)
+      next = tick;
+  }
+
+  return next;
+}
+
+unsigned long advance_timing_wheel(DBTimingWheel *wheel, uint64_t tick, void (*expire)(DBTimer *timer, void *data), void *data)
+{
+  unsigned long expired = 0;
+  unsigned long index = 0;
+  uint64_t next = 0;
+  DBTimer *timer = NULL;
+
+  while (wheel->tick <= tick)
+  {
+    // the ticks without a slot to expire or to move down are skipped
+    next = wheel->count != 0 ? get_next_event_tick(wheel) : UINT64_MAX;
+    if (next > tick)
+    {
+      wheel->tick = tick + 1;
+      break;
+    }
+    wheel->tick = next;
+
+    // a level moves the next slot of the level above down when it wraps
+    index = wheel->tick & TIMING_WHEEL_SLOT_MASK;
+    for (int level = 1; index == 0 && level < TIMING_WHEEL_LEVELS; level++)
+    {
+      index = (wheel->tick >> (level * TIMING_WHEEL_SLOT_BITS)) & TIMING_WHEEL_SLOT_MASK;
+      cascade_timers(wheel, level, index);
+    }
+
+    // a timer added again by `expire` with a past deadline goes to the next tick
+    index = wheel->tick & TIMING_WHEEL_SLOT_MASK;
+    wheel->tick++;
+    while ((timer = wheel->slots[0][index]) != NULL)
+    {
+      remove_timer(wheel, timer);
+      expire(timer, data);
+      expired++;
+    }
+  }
+
+  return expired;
+}
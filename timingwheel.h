@@ -0,0 +1,56 @@
+#ifndef CCH137_TIMINGWHEEL_H
+#define CCH137_TIMINGWHEEL_H
+
+#include <stdint.h>
+
+// Hierarchical timing wheel. Level 0 has a slot per tick, each higher level
+// a slot per TIMING_WHEEL_SLOTS slots of the level below. When the lower
+// level wraps, the timers of the next slot of the level above are moved
+// down, so that adding, removing and expiring a timer are O(1). A deadline
+// past the last level is kept in its last slot and moved down again until
+// it is reached. The wheel keeps a bitmap of the slots in use per level, so
+// that it moves from one tick that has timers to expire or to move down
+// straight to the next, however many ticks are in between.
+//
+// Not thread safe, every call on a wheel and its timers must be serialized
+// by the caller.
+
+// At most 6, the slots of a level are mapped by a 64 bit word.
+#define TIMING_WHEEL_SLOT_BITS 6
+#define TIMING_WHEEL_SLOTS (1 << TIMING_WHEEL_SLOT_BITS)
+#define TIMING_WHEEL_LEVELS 4
+
+typedef struct DBTimer
+{
+  uint64_t deadline;
+  void *data;
+  struct DBTimer *next;
+  // the pointer to this timer in its slot, or in the previous timer
+  struct DBTimer **previous;
+} DBTimer;
+
+typedef struct DBTimingWheel
+{
+  // the next tick to expire
+  uint64_t tick;
+  unsigned long count;
+  DBTimer *slots[TIMING_WHEEL_LEVELS][TIMING_WHEEL_SLOTS];
+  // bit i of a level is set while its slot i has timers
+  uint64_t occupied[TIMING_WHEEL_LEVELS];
+} DBTimingWheel;
+
+void init_timing_wheel(DBTimingWheel *wheel, uint64_t tick);
+// Calls free_timer on every timer and empties the wheel.
+void clear_timing_wheel(DBTimingWheel *wheel, void (*free_timer)(DBTimer *timer));
+
+// The deadline of the timer must be set, a deadline already past expires at
+// the next tick.
+void add_timer(DBTimingWheel *wheel, DBTimer *timer);
+void remove_timer(DBTimingWheel *wheel, DBTimer *timer);
+
+// Expires every timer up to `tick` included. The timers are removed from the
+// wheel before `expire` is called, which may add or remove other timers.
+// Returns the number of timers expired.
+unsigned long advance_timing_wheel(DBTimingWheel *wheel, uint64_t tick, void (*expire)(DBTimer *timer, void *data), void *data);
+
+#endif
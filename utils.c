@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <time.h>
 #include "./utils.h"
 
 void memory_error_handler(const char *filename, int line, const char *funcname)
@@ -11,6 +12,13 @@ void memory_error_handler(const char *filename, int line, const char *funcname)
   exit(1);
 }
 
+void file_error_handler(const char *path, const char *filename, int line, const char *funcname)
+{
+  printf("Error: Failed to read file %s in '%s' function\n", path, funcname);
+  printf("    at %s:%d\n", filename, line);
+  exit(1);
+}
+
 char *input_string()
 {
   size_t buffer_size = INPUT_STRING_CHUNK_SIZE;
@@ -101,3 +109,15 @@ void print_tabs(int tab_depth, bool end_with_dash)
     while (tab_depth--)
       printf("  ");
 }
+
+void get_deadline(struct timespec *deadline, unsigned long ms)
+{
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  deadline->tv_sec += (time_t)(ms / 1000);
+  deadline->tv_nsec += (long)(ms % 1000) * 1000000L;
+  if (deadline->tv_nsec >= 1000000000L)
+  {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000L;
+  }
+}
@@ -1,7 +1,10 @@
 #ifndef CCH137_UTILS_H
 #define CCH137_UTILS_H
 
+#include <time.h>
+
 void memory_error_handler(const char *filename, int line, const char *funcname);
+void file_error_handler(const char *path, const char *filename, int line, const char *funcname);
 
 char *input_string();
 int input_int();
@@ -12,6 +15,10 @@ char *int_to_string(int value);
 
 void print_tabs(int depth, bool end_with_dash);
 
+// Sets `deadline` to `ms` from now on the monotonic clock, for the timed
+// waits of the conditions created with it.
+void get_deadline(struct timespec *deadline, unsigned long ms);
+
 #define INPUT_STRING_CHUNK_SIZE 8
 
 #endif
@@ -0,0 +1,536 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "./utils.h"
+#include "./wal.h"
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+// The type of a set record followed by the expiry of its item, replayed as
+// a DBLogRecord_Set.
+#define WRITE_LOG_EXPIRING_SET 3
+
+typedef struct DBLogBuffer
+{
+  char *data;
+  size_t length;
+  size_t capacity;
+} DBLogBuffer;
+
+// -1 while the log is closed.
+int write_log_file = -1;
+char *write_log_filename = NULL;
+// Serializes the records, the state of the flusher, and opening, closing and
+// rotating the log.
+pthread_mutex_t write_log_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Wakes the flusher, and the threads waiting for a batch.
+pthread_cond_t write_log_flush_cond;
+pthread_cond_t write_log_written_cond;
+pthread_once_t write_log_once = PTHREAD_ONCE_INIT;
+pthread_t write_log_flusher;
+
+// The records appended since the last batch, swapped with the spare buffer
+// when a batch is taken.
+DBLogBuffer write_log_buffer = {NULL, 0, 0};
+DBLogBuffer write_log_spare_buffer = {NULL, 0, 0};
+// The last record appended, and the last one written, or fsynced with
+// DBLogSync_Always.
+uint64_t write_log_appended = 0;
+uint64_t write_log_written = 0;
+// A batch is being written outside of the mutex.
+bool write_log_flushing = false;
+bool write_log_stopping = false;
+// A batch could not be written, the records after it can not be replayed.
+bool write_log_failed = false;
+DBLogSyncPolicy write_log_policy = WRITE_LOG_DEFAULT_SYNC_POLICY;
+unsigned long write_log_interval_ms = WRITE_LOG_DEFAULT_SYNC_INTERVAL_MS;
+DBWriteLogStats write_log_stats = {0, 0, 0};
+
+void static init_write_log();
+uint32_t static add_to_checksum(uint32_t checksum, const void *data, size_t length);
+uint32_t static get_record_checksum(const DBLogRecordHeader *header, uint64_t expires_at, const char *key, const char *value);
+bool static write_all(int file, const char *data, size_t length);
+char static *read_file(const char *filename, size_t *length);
+char static *get_rotated_filename(const char *filename);
+void static add_to_log_buffer(DBLogBuffer *buffer, const void *data, size_t length);
+void static write_batch(bool sync);
+void static flush_all_records();
+void static *run_write_log_flusher(void *data);
+
+// The waits of the flusher are timed on the monotonic clock.
+void static init_write_log()
+{
+  pthread_condattr_t attributes;
+
+  pthread_condattr_init(&attributes);
+  pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+  pthread_cond_init(&write_log_flush_cond, &attributes);
+  pthread_cond_init(&write_log_written_cond, NULL);
+  pthread_condattr_destroy(&attributes);
+}
+
+// FNV-1a, the seeded hash of the keys changes every run.
+uint32_t static add_to_checksum(uint32_t checksum, const void *data, size_t length)
+{
+  const unsigned char *bytes = (const unsigned char *)data;
+
+  for (size_t i = 0; i < length; i++)
+    checksum = (checksum ^ bytes[i]) * FNV_PRIME;
+
+  return checksum;
+}
+
+// Covers the header after the checksum, the expiry if the record has one,
+// the key and the value.
+uint32_t static get_record_checksum(const DBLogRecordHeader *header, uint64_t expires_at, const char *key, const char *value)
+{
+  uint32_t checksum = FNV_OFFSET_BASIS;
+
+  checksum = add_to_checksum(checksum, &header->type, sizeof(DBLogRecordHeader) - sizeof(header->checksum));
+  if (header->type == WRITE_LOG_EXPIRING_SET)
+    checksum = add_to_checksum(checksum, &expires_at, sizeof(expires_at));
+  checksum = add_to_checksum(checksum, key, header->key_length);
+  checksum = add_to_checksum(checksum, value, header->value_length);
+
+  return checksum;
+}
+
+bool static write_all(int file, const char *data, size_t length)
+{
+  ssize_t result = 0;
+
+  while (length > 0)
+  {
+    result = write(file, data, length);
+    if (result <= 0)
+      return false;
+    data += result;
+    length -= (size_t)result;
+  }
+
+  return true;
+}
+
+// Returns NULL if the file does not exist.
+char static *read_file(const char *filename, size_t *length)
+{
+  FILE *file = fopen(filename, "rb");
+
+  if (file == NULL)
+    return NULL;
+
+  fseek(file, 0, SEEK_END);
+  *length = (size_t)ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  char *data = (char *)malloc(*length + 1);
+
+  if (!data)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  *length = fread(data, 1, *length, file);
+  fclose(file);
+
+  return data;
+}
+
+char static *get_rotated_filename(const char *filename)
+{
+  char *rotated = (char *)malloc(strlen(filename) + sizeof(WRITE_LOG_ROTATED_SUFFIX));
+
+  if (!rotated)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  strcpy(rotated, filename);
+  strcat(rotated, WRITE_LOG_ROTATED_SUFFIX);
+
+  return rotated;
+}
+
+void static add_to_log_buffer(DBLogBuffer *buffer, const void *data, size_t length)
+{
+  if (buffer->length + length > buffer->capacity)
+  {
+    size_t capacity = buffer->capacity != 0 ? buffer->capacity : 4096;
+
+    while (buffer->length + length > capacity)
+      capacity *= 2;
+
+    char *grown = (char *)realloc(buffer->data, capacity);
+
+    if (!grown)
+      memory_error_handler(__FILE__, __LINE__, __func__);
+
+    buffer->data = grown;
+    buffer->capacity = capacity;
+  }
+
+  memcpy(buffer->data + buffer->length, data, length);
+  buffer->length += length;
+}
+
+// Must be called with the mutex locked and no batch being written. The
+// records appended so far are written outside of the mutex, so that writers
+// go on filling the other buffer meanwhile.
+void static write_batch(bool sync)
+{
+  DBLogBuffer batch = write_log_buffer;
+  uint64_t last = write_log_appended;
+  int file = write_log_file;
+
+  write_log_buffer = write_log_spare_buffer;
+  write_log_buffer.length = 0;
+  write_log_flushing = true;
+  pthread_mutex_unlock(&write_log_mutex);
+
+  bool written = write_all(file, batch.data, batch.length);
+  bool synced = written && sync && fsync(file) == 0;
+
+  pthread_mutex_lock(&write_log_mutex);
+  write_log_spare_buffer = batch;
+  write_log_flushing = false;
+  write_log_written = last;
+  write_log_stats.writes++;
+  if (synced)
+    write_log_stats.syncs++;
+  if (!written || (sync && !synced))
+  {
+    write_log_failed = true;
+    printf("Warning: Failed to write file %s\n", write_log_filename);
+  }
+  pthread_cond_broadcast(&write_log_written_cond);
+}
+
+// Must be called with the mutex locked. Returns with every record written
+// and fsynced, and no batch being written.
+void static flush_all_records()
+{
+  while (write_log_flushing || write_log_buffer.length > 0)
+  {
+    if (write_log_flushing)
+      pthread_cond_wait(&write_log_written_cond, &write_log_mutex);
+    else
+      write_batch(true);
+  }
+}
+
+// Every batch is taken by this thread, so that the writers that append while
+// a batch is written share the next write and fsync.
+void static *run_write_log_flusher(void *data)
+{
+  struct timespec deadline;
+
+  pthread_mutex_lock(&write_log_mutex);
+  get_deadline(&deadline, write_log_interval_ms);
+  while (!write_log_stopping)
+  {
+    // a batch taken by a rotation or a flush
+    if (write_log_flushing)
+    {
+      pthread_cond_wait(&write_log_written_cond, &write_log_mutex);
+      continue;
+    }
+
+    if (write_log_policy == DBLogSync_Periodic)
+    {
+      // woken early by a full buffer or a change of policy
+      if (write_log_buffer.length < WRITE_LOG_BUFFER_LIMIT &&
+          pthread_cond_timedwait(&write_log_flush_cond, &write_log_mutex, &deadline) != ETIMEDOUT)
+        continue;
+      get_deadline(&deadline, write_log_interval_ms);
+    }
+    else if (write_log_buffer.length == 0)
+    {
+      pthread_cond_wait(&write_log_flush_cond, &write_log_mutex);
+      get_deadline(&deadline, write_log_interval_ms);
+      continue;
+    }
+
+    if (write_log_buffer.length > 0 && !write_log_flushing)
+      write_batch(write_log_policy != DBLogSync_Never);
+  }
+  pthread_mutex_unlock(&write_log_mutex);
+
+  return data;
+}
+
+bool open_write_log(const char *filename)
+{
+  close_write_log();
+  pthread_once(&write_log_once, init_write_log);
+
+  int file = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0600);
+
+  if (file == -1)
+  {
+    printf("Warning: Failed to open file %s\n", filename);
+    return false;
+  }
+
+  char *copy = (char *)malloc(strlen(filename) + 1);
+
+  if (!copy)
+    memory_error_handler(__FILE__, __LINE__, __func__);
+
+  strcpy(copy, filename);
+
+  pthread_mutex_lock(&write_log_mutex);
+  write_log_stopping = false;
+  write_log_failed = false;
+  if (pthread_create(&write_log_flusher, NULL, run_write_log_flusher, NULL) != 0)
+  {
+    pthread_mutex_unlock(&write_log_mutex);
+    printf("Warning: Failed to start the flusher of file %s\n", filename);
+    close(file);
+    free(copy);
+    return false;
+  }
+  write_log_filename = copy;
+  __atomic_store_n(&write_log_file, file, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&write_log_mutex);
+
+  return true;
+}
+
+void close_write_log()
+{
+  pthread_mutex_lock(&write_log_mutex);
+  // the file is -1 while the flusher runs if it could not be reopened by a
+  // rotation
+  if (write_log_filename == NULL)
+  {
+    pthread_mutex_unlock(&write_log_mutex);
+    return;
+  }
+
+  flush_all_records();
+  write_log_stopping = true;
+  pthread_cond_signal(&write_log_flush_cond);
+  pthread_mutex_unlock(&write_log_mutex);
+  pthread_join(write_log_flusher, NULL);
+
+  pthread_mutex_lock(&write_log_mutex);
+  // appended while the flusher stopped
+  flush_all_records();
+  if (write_log_file != -1)
+    close(write_log_file);
+  __atomic_store_n(&write_log_file, -1, __ATOMIC_RELEASE);
+  free(write_log_filename);
+  write_log_filename = NULL;
+  pthread_cond_broadcast(&write_log_written_cond);
+  pthread_mutex_unlock(&write_log_mutex);
+}
+
+bool is_write_log_open()
+{
+  return __atomic_load_n(&write_log_file, __ATOMIC_ACQUIRE) != -1;
+}
+
+void set_write_log_sync_policy(DBLogSyncPolicy policy, unsigned long interval_ms)
+{
+  pthread_once(&write_log_once, init_write_log);
+  pthread_mutex_lock(&write_log_mutex);
+  write_log_policy = policy;
+  write_log_interval_ms = interval_ms;
+  pthread_cond_signal(&write_log_flush_cond);
+  pthread_mutex_unlock(&write_log_mutex);
+}
+
+uint64_t append_write_log_record(DBLogRecordType type, const char *key, const char *value, uint64_t expires_at)
+{
+  DBLogRecordHeader header;
+  header.type = type == DBLogRecord_Set && expires_at != 0 ? WRITE_LOG_EXPIRING_SET : (uint32_t)type;
+  header.key_length = (uint32_t)strlen(key);
+  header.value_length = value != NULL ? (uint32_t)strlen(value) : 0;
+  header.checksum = get_record_checksum(&header, expires_at, key, value);
+
+  uint64_t sequence = 0;
+
+  pthread_mutex_lock(&write_log_mutex);
+  if (write_log_file != -1)
+  {
+    add_to_log_buffer(&write_log_buffer, &header, sizeof(DBLogRecordHeader));
+    if (header.type == WRITE_LOG_EXPIRING_SET)
+      add_to_log_buffer(&write_log_buffer, &expires_at, sizeof(expires_at));
+    add_to_log_buffer(&write_log_buffer, key, header.key_length);
+    if (value != NULL)
+      add_to_log_buffer(&write_log_buffer, value, header.value_length);
+    sequence = ++write_log_appended;
+    write_log_stats.records++;
+    if (write_log_policy != DBLogSync_Periodic || write_log_buffer.length >= WRITE_LOG_BUFFER_LIMIT)
+      pthread_cond_signal(&write_log_flush_cond);
+  }
+  pthread_mutex_unlock(&write_log_mutex);
+
+  return sequence;
+}
+
+bool wait_for_write_log(uint64_t sequence)
+{
+  pthread_mutex_lock(&write_log_mutex);
+  while (write_log_policy == DBLogSync_Always && write_log_written < sequence && write_log_file != -1 &&
+         !write_log_failed)
+    pthread_cond_wait(&write_log_written_cond, &write_log_mutex);
+  bool written = !write_log_failed;
+  pthread_mutex_unlock(&write_log_mutex);
+
+  return written;
+}
+
+bool flush_write_log()
+{
+  pthread_mutex_lock(&write_log_mutex);
+  flush_all_records();
+  bool written = !write_log_failed;
+  pthread_mutex_unlock(&write_log_mutex);
+
+  return written;
+}
+
+DBWriteLogStats get_write_log_stats()
+{
+  pthread_mutex_lock(&write_log_mutex);
+  DBWriteLogStats stats = write_log_stats;
+  pthread_mutex_unlock(&write_log_mutex);
+
+  return stats;
+}
+
+unsigned long replay_write_log(const char *filename, void (*apply)(DBLogRecordType type, const char *key, const char *value, uint64_t expires_at, void *data), void *data)
+{
+  size_t length = 0;
+  char *records = read_file(filename, &length);
+
+  if (records == NULL)
+    return 0;
+
+  size_t offset = 0;
+  size_t header_length = 0;
+  unsigned long applied = 0;
+  DBLogRecordHeader header;
+  uint64_t expires_at = 0;
+  char *key = NULL;
+  char *value = NULL;
+  char saved = '\0';
+
+  while (offset + sizeof(DBLogRecordHeader) <= length)
+  {
+    memcpy(&header, records + offset, sizeof(DBLogRecordHeader));
+    header_length = sizeof(DBLogRecordHeader) + (header.type == WRITE_LOG_EXPIRING_SET ? sizeof(expires_at) : 0);
+    if ((header.type != DBLogRecord_Set && header.type != DBLogRecord_Delete && header.type != WRITE_LOG_EXPIRING_SET) ||
+        header_length > length - offset || header.key_length > length - offset - header_length ||
+        header.value_length > length - offset - header_length - header.key_length)
+      break;
+
+    expires_at = 0;
+    if (header.type == WRITE_LOG_EXPIRING_SET)
+      memcpy(&expires_at, records + offset + sizeof(DBLogRecordHeader), sizeof(expires_at));
+    key = records + offset + header_length;
+    value = key + header.key_length;
+    if (get_record_checksum(&header, expires_at, key, value) != header.checksum)
+      break;
+
+    // the key and the value are terminated in place, the value is followed
+    // by the next record or by the byte after the data
+    saved = value[header.value_length];
+    value[header.value_length] = '\0';
+    char *key_copy = (char *)malloc(header.key_length + 1);
+
+    if (!key_copy)
+      memory_error_handler(__FILE__, __LINE__, __func__);
+
+    memcpy(key_copy, key, header.key_length);
+    key_copy[header.key_length] = '\0';
+    if (header.type == DBLogRecord_Delete)
+      apply(DBLogRecord_Delete, key_copy, NULL, 0, data);
+    else
+      apply(DBLogRecord_Set, key_copy, value, expires_at, data);
+    free(key_copy);
+    value[header.value_length] = saved;
+
+    offset += header_length + header.key_length + header.value_length;
+    applied++;
+  }
+
+  free(records);
+
+  // the records after a torn one were never acknowledged
+  if (offset < length)
+  {
+    printf("Warning: Dropped %lu bytes at the end of file %s\n", (unsigned long)(length - offset), filename);
+    if (truncate(filename, (off_t)offset) != 0)
+      printf("Warning: Failed to write file %s\n", filename);
+  }
+
+  return applied;
+}
+
+bool rotate_write_log()
+{
+  pthread_mutex_lock(&write_log_mutex);
+
+  if (write_log_file == -1)
+  {
+    pthread_mutex_unlock(&write_log_mutex);
+    return false;
+  }
+
+  // the records appended so far go to the rotated file
+  flush_all_records();
+
+  char *rotated_filename = get_rotated_filename(write_log_filename);
+  bool rotated = false;
+
+  if (access(rotated_filename, F_OK) != 0)
+  {
+    rotated = rename(write_log_filename, rotated_filename) == 0;
+  }
+  else
+  {
+    // the previous records were not saved, the new ones go after them
+    size_t length = 0;
+    char *records = read_file(write_log_filename, &length);
+    int rotated_file = open(rotated_filename, O_WRONLY | O_APPEND);
+    rotated = records != NULL && rotated_file != -1 && write_all(rotated_file, records, length) &&
+              fsync(rotated_file) == 0 && truncate(write_log_filename, 0) == 0;
+    if (rotated_file != -1)
+      close(rotated_file);
+    free(records);
+  }
+
+  if (rotated)
+  {
+    close(write_log_file);
+    __atomic_store_n(&write_log_file, open(write_log_filename, O_WRONLY | O_CREAT | O_APPEND, 0600), __ATOMIC_RELEASE);
+    if (write_log_file == -1)
+      printf("Warning: Failed to open file %s\n", write_log_filename);
+  }
+  else
+  {
+    printf("Warning: Failed to write file %s\n", rotated_filename);
+  }
+
+  free(rotated_filename);
+  pthread_mutex_unlock(&write_log_mutex);
+
+  return rotated;
+}
+
+void remove_rotated_write_log()
+{
+  pthread_mutex_lock(&write_log_mutex);
+  if (write_log_filename != NULL)
+  {
+    char *rotated_filename = get_rotated_filename(write_log_filename);
+    unlink(rotated_filename);
+    free(rotated_filename);
+  }
+  pthread_mutex_unlock(&write_log_mutex);
+}
@@ -0,0 +1,98 @@
+#ifndef CCH137_WAL_H
+#define CCH137_WAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Append-only log of the writes made since the last save of the database.
+// Each record starts with a checksum of the rest of it, so that a record
+// torn by a crash is detected and dropped on replay with everything after
+// it. Writers copy their records to a buffer, which a single flusher thread
+// writes to the file in batches, see DBLogSyncPolicy.
+//
+// A record is a DBLogRecordHeader followed by the key and the value, without
+// terminators. A set whose item expires is written with its own type, and
+// the expiry between the header and the key. Every record can be applied
+// again, so that the writes made while a save is running can be replayed on
+// top of it.
+
+typedef enum DBLogRecordType
+{
+  DBLogRecord_Set = 1,
+  DBLogRecord_Delete = 2
+} DBLogRecordType;
+
+typedef struct DBLogRecordHeader
+{
+  uint32_t checksum;
+  uint32_t type;
+  uint32_t key_length;
+  uint32_t value_length;
+} DBLogRecordHeader;
+
+// How the records reach the disk. The records are appended to a buffer and
+// written by a single flusher thread, a batch of records per write.
+typedef enum DBLogSyncPolicy
+{
+  // each batch is fsynced, and wait_for_write_log() returns once the batch
+  // of the record is, so that writers that wait together share an fsync
+  DBLogSync_Always = 0,
+  // the buffer is written and fsynced every interval
+  DBLogSync_Periodic = 1,
+  // each batch is written as soon as possible, the system flushes it
+  DBLogSync_Never = 2
+} DBLogSyncPolicy;
+
+#define WRITE_LOG_DEFAULT_SYNC_POLICY DBLogSync_Periodic
+#define WRITE_LOG_DEFAULT_SYNC_INTERVAL_MS 100
+// The flusher is woken before the end of the interval past this.
+#define WRITE_LOG_BUFFER_LIMIT (1 << 20)
+
+typedef struct DBWriteLogStats
+{
+  unsigned long records;
+  // batches written, and fsynced
+  unsigned long writes;
+  unsigned long syncs;
+} DBWriteLogStats;
+
+// Opens the log for appending, creating it if needed, and starts its flusher.
+bool open_write_log(const char *filename);
+// Writes and fsyncs the records left, then stops the flusher.
+void close_write_log();
+bool is_write_log_open();
+
+// `interval_ms` is only used by DBLogSync_Periodic. Can be changed while the
+// log is open.
+void set_write_log_sync_policy(DBLogSyncPolicy policy, unsigned long interval_ms);
+
+// `value` is NULL for a delete. `expires_at` is the wall clock time in
+// milliseconds at which the item of a set expires, 0 if it does not. Returns
+// the sequence number of the record, to be passed to wait_for_write_log(), or
+// 0 if the log is closed.
+uint64_t append_write_log_record(DBLogRecordType type, const char *key, const char *value, uint64_t expires_at);
+// With DBLogSync_Always, blocks until the record `sequence` is fsynced, and
+// returns immediately otherwise. Must not be called with a lock held that
+// other writers need. Returns false if a batch could not be written.
+bool wait_for_write_log(uint64_t sequence);
+// Writes and fsyncs every record appended so far, whatever the policy.
+bool flush_write_log();
+
+DBWriteLogStats get_write_log_stats();
+
+// Calls `apply` for each valid record of the file, with the value NULL for a
+// delete, and the expiry of a set as it was appended. A torn record at the
+// end is cut from the file. Returns the number of records applied.
+unsigned long replay_write_log(const char *filename, void (*apply)(DBLogRecordType type, const char *key, const char *value, uint64_t expires_at, void *data), void *data);
+
+// Moves the records written so far to the file of the log with
+// WRITE_LOG_ROTATED_SUFFIX, and goes on in an empty log. The records are
+// added to those already moved there if the previous ones were not removed.
+bool rotate_write_log();
+// Called once the records moved by rotate_write_log() are saved elsewhere.
+void remove_rotated_write_log();
+
+#define WRITE_LOG_ROTATED_SUFFIX ".old"
+
+#endif